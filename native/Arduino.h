@@ -0,0 +1,288 @@
+// Host stand-in for the subset of the Teensy Arduino core used by SDPeek.
+// Only what src/main.cpp needs is provided; behaviour follows Teensyduino.
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <math.h>
+#include <functional>
+#include <utility>
+#include <algorithm>
+
+#define F(s) (s)
+#define DMAMEM
+#define EXTMEM
+#define FLASHMEM
+#define PROGMEM
+#define F_CPU_ACTUAL 600000000UL
+#define ARM_DWT_CYCCNT (nativeCycleCount())
+#define HEX 16
+#define DEC 10
+
+uint32_t millis();
+uint32_t micros();
+inline long random(long howbig) { return howbig > 0 ? ::random() % howbig : 0; }
+inline long random(long howsmall, long howbig) { return howsmall >= howbig ? howsmall : howsmall + random(howbig - howsmall); }
+inline void randomSeed(unsigned long seed) { ::srandom(seed); }
+void delay(uint32_t ms);
+void yield();
+uint32_t nativeCycleCount();
+
+extern uint8_t external_psram_size;
+void* extmem_malloc(size_t size);
+void extmem_free(void* ptr);
+
+template <class A, class B>
+constexpr auto min(A&& a, B&& b) -> decltype(a < b ? std::forward<A>(a) : std::forward<B>(b)) {
+    return a < b ? std::forward<A>(a) : std::forward<B>(b);
+}
+template <class A, class B>
+constexpr auto max(A&& a, B&& b) -> decltype(a < b ? std::forward<A>(a) : std::forward<B>(b)) {
+    return a >= b ? std::forward<A>(a) : std::forward<B>(b);
+}
+template <class T, class L, class H>
+constexpr T constrain(T amt, L low, H high) { return amt < low ? low : (amt > high ? high : amt); }
+
+class String {
+public:
+    String(const char* s = "") { assign(s ? s : "", s ? strlen(s) : 0); }
+    String(const String& o) { assign(o.buf_, o.len_); }
+    String(String&& o) noexcept : buf_(o.buf_), len_(o.len_), cap_(o.cap_) { o.buf_ = nullptr; o.len_ = o.cap_ = 0; }
+    explicit String(char c) { char b[2] = {c, 0}; assign(b, 1); }
+    String(int v, unsigned char base = 10) { fromSigned(v, base); }
+    String(unsigned int v, unsigned char base = 10) { fromUnsigned(v, base); }
+    String(long v, unsigned char base = 10) { fromSigned(v, base); }
+    String(unsigned long v, unsigned char base = 10) { fromUnsigned(v, base); }
+    String(long long v, unsigned char base = 10) { fromSigned(v, base); }
+    String(unsigned long long v, unsigned char base = 10) { fromUnsigned(v, base); }
+    String(float v, int decimals = 2) { fromDouble(v, decimals); }
+    String(double v, int decimals = 2) { fromDouble(v, decimals); }
+    ~String() { free(buf_); }
+
+    String& operator=(const String& o) { if (this != &o) assign(o.buf_, o.len_); return *this; }
+    String& operator=(String&& o) noexcept { std::swap(buf_, o.buf_); std::swap(len_, o.len_); std::swap(cap_, o.cap_); return *this; }
+    String& operator=(const char* s) { assign(s, strlen(s)); return *this; }
+
+    unsigned int length() const { return len_; }
+    const char* c_str() const { return buf_ ? buf_ : ""; }
+    char charAt(unsigned int i) const { return i < len_ ? buf_[i] : 0; }
+    char operator[](unsigned int i) const { return charAt(i); }
+    char& operator[](unsigned int i) { return buf_[i]; }
+    bool reserve(unsigned int n) { grow(n); return true; }
+
+    String& concat(const char* s, unsigned int n) { grow(len_ + n); memcpy(buf_ + len_, s, n); len_ += n; buf_[len_] = 0; return *this; }
+    String& operator+=(const String& s) { return concat(s.c_str(), s.len_); }
+    String& operator+=(const char* s) { return concat(s, strlen(s)); }
+    String& operator+=(char c) { return concat(&c, 1); }
+    String& operator+=(int v) { return *this += String(v); }
+    String& operator+=(unsigned int v) { return *this += String(v); }
+    String& operator+=(long v) { return *this += String(v); }
+    String& operator+=(unsigned long v) { return *this += String(v); }
+
+    friend String operator+(const String& a, const String& b) { String r(a); r += b; return r; }
+    friend String operator+(const String& a, const char* b) { String r(a); r += b; return r; }
+    friend String operator+(const char* a, const String& b) { String r(a); r += b; return r; }
+    friend String operator+(const String& a, char b) { String r(a); r += b; return r; }
+    friend String operator+(const String& a, int b) { String r(a); r += String(b); return r; }
+    friend String operator+(const String& a, unsigned int b) { String r(a); r += String(b); return r; }
+    friend String operator+(const String& a, long b) { String r(a); r += String(b); return r; }
+    friend String operator+(const String& a, unsigned long b) { String r(a); r += String(b); return r; }
+
+    bool equals(const String& o) const { return len_ == o.len_ && memcmp(c_str(), o.c_str(), len_) == 0; }
+    bool equals(const char* s) const { return strcmp(c_str(), s) == 0; }
+    bool operator==(const String& o) const { return equals(o); }
+    bool operator==(const char* s) const { return equals(s); }
+    bool operator!=(const String& o) const { return !equals(o); }
+    bool operator!=(const char* s) const { return !equals(s); }
+    bool operator<(const String& o) const { return strcmp(c_str(), o.c_str()) < 0; }
+    int compareTo(const String& o) const { return strcmp(c_str(), o.c_str()); }
+    bool equalsIgnoreCase(const String& o) const { return len_ == o.len_ && strcasecmp(c_str(), o.c_str()) == 0; }
+
+    bool startsWith(const String& p) const { return p.len_ <= len_ && memcmp(c_str(), p.c_str(), p.len_) == 0; }
+    bool startsWith(const String& p, unsigned int off) const { return off + p.len_ <= len_ && memcmp(c_str() + off, p.c_str(), p.len_) == 0; }
+    bool endsWith(const String& s) const { return s.len_ <= len_ && memcmp(c_str() + len_ - s.len_, s.c_str(), s.len_) == 0; }
+
+    int indexOf(char c, unsigned int from = 0) const {
+        for (unsigned int i = from; i < len_; i++) if (buf_[i] == c) return i;
+        return -1;
+    }
+    int indexOf(const String& s, unsigned int from = 0) const {
+        if (from > len_) return -1;
+        const char* p = strstr(c_str() + from, s.c_str());
+        return p ? (int)(p - c_str()) : -1;
+    }
+    int indexOf(const char* s, unsigned int from = 0) const { return indexOf(String(s), from); }
+    int lastIndexOf(char c) const { return lastIndexOf(c, len_ ? len_ - 1 : 0); }
+    int lastIndexOf(char c, unsigned int from) const {
+        if (!len_) return -1;
+        if (from >= len_) from = len_ - 1;
+        for (int i = from; i >= 0; i--) if (buf_[i] == c) return i;
+        return -1;
+    }
+    String substring(unsigned int from) const { return substring(from, len_); }
+    String substring(unsigned int from, unsigned int to) const {
+        if (from > to) std::swap(from, to);
+        if (from > len_) return String();
+        if (to > len_) to = len_;
+        String r; r.assign(c_str() + from, to - from); return r;
+    }
+    String& toLowerCase() { for (unsigned int i = 0; i < len_; i++) buf_[i] = tolower((unsigned char)buf_[i]); return *this; }
+    String& toUpperCase() { for (unsigned int i = 0; i < len_; i++) buf_[i] = toupper((unsigned char)buf_[i]); return *this; }
+    String& trim() {
+        if (!len_) return *this;
+        unsigned int b = 0, e = len_;
+        while (b < e && isspace((unsigned char)buf_[b])) b++;
+        while (e > b && isspace((unsigned char)buf_[e - 1])) e--;
+        memmove(buf_, buf_ + b, e - b); len_ = e - b; buf_[len_] = 0;
+        return *this;
+    }
+    String& remove(unsigned int index) { if (index < len_) { len_ = index; buf_[len_] = 0; } return *this; }
+    String& remove(unsigned int index, unsigned int count) {
+        if (index >= len_) return *this;
+        if (count > len_ - index) count = len_ - index;
+        memmove(buf_ + index, buf_ + index + count, len_ - index - count + 1); len_ -= count;
+        return *this;
+    }
+    long toInt() const { return strtol(c_str(), nullptr, 10); }
+    float toFloat() const { return strtof(c_str(), nullptr); }
+
+private:
+    void grow(unsigned int n) {
+        if (n + 1 <= cap_) return;
+        unsigned int cap = cap_ ? cap_ : 16;
+        while (cap < n + 1) cap *= 2;
+        buf_ = (char*)realloc(buf_, cap); cap_ = cap;
+        if (!len_) buf_[0] = 0;
+    }
+    void assign(const char* s, unsigned int n) { len_ = 0; grow(n); memmove(buf_, s, n); len_ = n; buf_[n] = 0; }
+    template <typename T> void fromSigned(T v, unsigned char base) {
+        if (v < 0) { fromUnsigned((unsigned long long)(-(long long)v), base); String r("-"); r += *this; *this = r; }
+        else fromUnsigned((unsigned long long)v, base);
+    }
+    template <typename T> void fromUnsigned(T v, unsigned char base) {
+        char b[72]; int i = 70; b[71] = 0;
+        unsigned long long x = v;
+        do { int d = x % base; b[i--] = d < 10 ? '0' + d : 'A' + d - 10; x /= base; } while (x);
+        assign(b + i + 1, 70 - i);
+    }
+    void fromDouble(double v, int decimals) { char b[64]; snprintf(b, sizeof(b), "%.*f", decimals, v); assign(b, strlen(b)); }
+
+    char* buf_ = nullptr;
+    unsigned int len_ = 0;
+    unsigned int cap_ = 0;
+};
+
+class Print {
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t b) = 0;
+    virtual size_t write(const uint8_t* buf, size_t n) { size_t r = 0; while (n--) r += write(*buf++); return r; }
+    virtual int availableForWrite() { return 0; }
+    virtual void flush() {}
+    size_t write(const char* s) { return write((const uint8_t*)s, strlen(s)); }
+    size_t write(const char* s, size_t n) { return write((const uint8_t*)s, n); }
+
+    size_t print(const char* s) { return write(s); }
+    size_t print(const String& s) { return write((const uint8_t*)s.c_str(), s.length()); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(int v, int base = DEC) { return printNumber((long long)v, base); }
+    size_t print(unsigned int v, int base = DEC) { return printNumber((unsigned long long)v, base); }
+    size_t print(long v, int base = DEC) { return printNumber((long long)v, base); }
+    size_t print(unsigned long v, int base = DEC) { return printNumber((unsigned long long)v, base); }
+    size_t print(long long v, int base = DEC) { return printNumber(v, base); }
+    size_t print(unsigned long long v, int base = DEC) { return printNumber(v, base); }
+    size_t print(double v, int digits = 2) { char b[64]; snprintf(b, sizeof(b), "%.*f", digits, v); return write(b); }
+
+    size_t println() { return write("\r\n"); }
+    template <typename T> size_t println(const T& v) { size_t n = print(v); return n + println(); }
+    template <typename T> size_t println(const T& v, int fmt) { size_t n = print(v, fmt); return n + println(); }
+
+    int printf(const char* fmt, ...) __attribute__((format(printf, 2, 3))) {
+        char b[512];
+        va_list ap; va_start(ap, fmt);
+        int n = vsnprintf(b, sizeof(b), fmt, ap);
+        va_end(ap);
+        if (n < 0) return n;
+        if ((size_t)n >= sizeof(b)) n = sizeof(b) - 1;
+        write((const uint8_t*)b, n);
+        return n;
+    }
+
+private:
+    size_t printNumber(long long v, int base) {
+        if (v < 0 && base == 10) { size_t n = write((uint8_t)'-'); return n + printNumber((unsigned long long)(-v), base); }
+        return printNumber((unsigned long long)v, base);
+    }
+    size_t printNumber(unsigned long long v, int base) { String s(v, (unsigned char)base); return print(s); }
+};
+
+class Stream : public Print {
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    void setTimeout(unsigned long ms) { timeout_ = ms; }
+
+    size_t readBytes(char* buf, size_t n) {
+        size_t count = 0;
+        while (count < n) {
+            int c = timedRead();
+            if (c < 0) break;
+            buf[count++] = (char)c;
+        }
+        return count;
+    }
+    String readStringUntil(char terminator) {
+        String r;
+        int c = timedRead();
+        while (c >= 0 && c != terminator) { r += (char)c; c = timedRead(); }
+        return r;
+    }
+    long parseInt() {
+        int c;
+        do { c = timedPeek(); if (c < 0) return 0; if (c == '-' || isdigit(c)) break; read(); } while (true);
+        bool neg = false; long v = 0;
+        if (c == '-') { neg = true; read(); }
+        while ((c = timedPeek()) >= 0 && isdigit(c)) { v = v * 10 + (c - '0'); read(); }
+        return neg ? -v : v;
+    }
+
+protected:
+    int timedRead() {
+        uint32_t start = millis();
+        do { int c = read(); if (c >= 0) return c; yield(); } while (millis() - start < timeout_);
+        return -1;
+    }
+    int timedPeek() {
+        uint32_t start = millis();
+        do { int c = peek(); if (c >= 0) return c; yield(); } while (millis() - start < timeout_);
+        return -1;
+    }
+    unsigned long timeout_ = 1000;
+};
+
+// Serial stand-in backed by a pseudo terminal (see native/native_main.cpp).
+class usb_serial_class : public Stream {
+public:
+    void begin(long) {}
+    int available() override;
+    int read() override;
+    int peek() override;
+    size_t readBytes(char* buf, size_t n);
+    size_t write(uint8_t b) override { return write(&b, 1); }
+    size_t write(const uint8_t* buf, size_t n) override;
+    using Print::write;
+    int availableForWrite() override;
+    void flush() override;
+    void send_now() { flush(); }
+    uint8_t dtr();
+    operator bool() { return true; }
+};
+
+extern usb_serial_class Serial;
+#define SerialUSB Serial
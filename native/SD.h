@@ -0,0 +1,182 @@
+// Host stand-in for the Teensy SD library and the SdFat classes it exposes
+// through SD.sdfs. The card is a directory on the host (SDPEEK_SD_ROOT,
+// default ./sdcard); volume geometry comes from statvfs(), or from the
+// SDPEEK_CARD_IMAGE image when one is given.
+#pragma once
+
+#include <Arduino.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <memory>
+#include <string>
+
+#ifndef O_AT_END
+#define O_AT_END 0x100000
+#endif
+#define O_READ O_RDONLY
+#define O_WRITE O_WRONLY
+typedef int oflag_t;
+
+#define FILE_READ 0
+#define FILE_WRITE 1
+#define FILE_WRITE_BEGIN 2
+#define BUILTIN_SDCARD 254
+
+#define FAT_TYPE_EXFAT 64
+#define FAT_DATE(y, m, d) (uint16_t)(((y) - 1980) << 9 | (m) << 5 | (d))
+#define FAT_YEAR(d) (1980 + ((d) >> 9))
+#define FAT_MONTH(d) (((d) >> 5) & 0XF)
+#define FAT_DAY(d) ((d) & 0X1F)
+#define FAT_HOUR(t) ((t) >> 11)
+#define FAT_MINUTE(t) (((t) >> 5) & 0X3F)
+#define FAT_SECOND(t) (2 * ((t) & 0X1F))
+
+class FsVolume;
+
+// Raw sectors come from SDPEEK_CARD_IMAGE when set (for exercising code that
+// reads the FAT directly); without it every raw read fails.
+class SdCard {
+public:
+    bool readSector(uint32_t sector, uint8_t* dst) { return readSectors(sector, dst, 1); }
+    bool readSectors(uint32_t sector, uint8_t* dst, size_t ns);
+    bool isBusy() { return false; }
+};
+
+class FsFile : public Stream {
+public:
+    FsFile() {}
+    FsFile(const FsFile&) = delete;
+    FsFile& operator=(const FsFile&) = delete;
+    FsFile(FsFile&& o) noexcept { moveFrom(o); }
+    FsFile& operator=(FsFile&& o) noexcept { if (this != &o) { close(); moveFrom(o); } return *this; }
+    ~FsFile() { close(); }
+
+    bool open(FsVolume* vol, const char* path, oflag_t oflag = O_RDONLY);
+    bool open(FsFile* dir, const char* path, oflag_t oflag = O_RDONLY);
+    bool open(FsFile* dir, uint32_t index, oflag_t oflag = O_RDONLY);  // index as reported by dirIndex()
+    bool openNext(FsFile* dir, oflag_t oflag = O_RDONLY);
+    bool close();
+    bool isOpen() const { return fd_ >= 0 || dir_; }
+    explicit operator bool() const { return isOpen(); }
+    bool isDir() const { return dir_ != nullptr; }
+    bool isFile() const { return fd_ >= 0; }
+    bool isBusy() { return false; }
+    bool isContiguous() { return contiguous_; }
+
+    int read() override { uint8_t b; return read(&b, 1) == 1 ? b : -1; }
+    int read(void* buf, size_t count);
+    int peek() override;
+    int available() override;
+    size_t write(uint8_t b) override { return write(&b, 1); }
+    size_t write(const void* buf, size_t count);
+    size_t write(const uint8_t* buf, size_t count) override { return write((const void*)buf, count); }
+    size_t write(const char* s) { return write((const void*)s, strlen(s)); }
+    void flush() override {}
+    bool sync() { return isOpen(); }
+    int fgets(char* str, int num, const char* delim = nullptr);
+
+    uint64_t fileSize() const;
+    uint64_t curPosition() const { return pos_; }
+    bool seekSet(uint64_t pos) { if (!isFile()) return false; pos_ = pos; return true; }
+    bool seekCur(int64_t off) { return seekSet(pos_ + off); }
+    bool seekEnd(int64_t off = 0) { return seekSet(fileSize() + off); }
+    void rewind() { pos_ = 0; if (dir_) rewinddir(dir_); }
+    bool rewindDirectory() { rewind(); return true; }
+    bool truncate() { return truncate(pos_); }
+    bool truncate(uint64_t length);
+    bool preAllocate(uint64_t length);
+    bool remove();
+    bool rmdir();
+    size_t getName(char* name, size_t len);
+    bool getModifyDateTime(uint16_t* pdate, uint16_t* ptime);
+    uint32_t dirIndex() const { return dirIndex_; }
+
+    const std::string& hostPath() const { return host_; }
+
+private:
+    void moveFrom(FsFile& o);
+    bool openHost(const std::string& host, const std::string& name, oflag_t oflag);
+
+    int fd_ = -1;
+    DIR* dir_ = nullptr;
+    uint64_t pos_ = 0;
+    std::string host_;
+    std::string name_;
+    uint32_t dirIndex_ = 0;
+    uint32_t nextIndex_ = 0;
+    std::string lastName_;  // Entry last returned by openNext() from this directory
+    bool contiguous_ = false;
+    bool append_ = false;
+};
+
+class FsVolume {
+public:
+    FsFile open(const char* path, oflag_t oflag = O_RDONLY) { FsFile f; f.open(this, path, oflag); return f; }
+    bool exists(const char* path);
+    bool mkdir(const char* path, bool pFlag = true);
+    bool remove(const char* path);
+    bool rmdir(const char* path);
+    bool rename(const char* oldPath, const char* newPath);
+    uint32_t clusterCount();
+    uint32_t freeClusterCount();
+    uint32_t bytesPerCluster();
+    uint32_t sectorsPerCluster() { return bytesPerCluster() / 512; }
+    uint8_t fatType();
+    uint32_t fatStartSector();
+    uint32_t dataStartSector() { return 0; }
+    SdCard* card() { return &card_; }
+
+    std::string hostPath(const char* path) const;
+
+private:
+    SdCard card_;
+};
+
+typedef FsVolume SdFs;
+
+class File : public Stream {
+public:
+    File() {}
+    explicit File(FsFile&& f) : f_(std::make_shared<FsFile>(std::move(f))) {}
+    int available() override { return f_ ? f_->available() : 0; }
+    int read() override { return f_ ? f_->read() : -1; }
+    int peek() override { return f_ ? f_->peek() : -1; }
+    size_t read(void* buf, size_t n) { int r = f_ ? f_->read(buf, n) : -1; return r < 0 ? 0 : r; }
+    size_t write(uint8_t b) override { return f_ ? f_->write(&b, 1) : 0; }
+    size_t write(const uint8_t* buf, size_t n) override { return f_ ? f_->write(buf, n) : 0; }
+    using Print::write;
+    bool seek(uint64_t pos) { return f_ && f_->seekSet(pos); }
+    uint64_t position() { return f_ ? f_->curPosition() : 0; }
+    uint64_t size() { return f_ ? f_->fileSize() : 0; }
+    bool truncate(uint64_t size = 0) { return f_ && f_->truncate(size); }
+    void close() { if (f_) f_->close(); f_.reset(); }
+    operator bool() { return f_ && f_->isOpen(); }
+    const char* name() { if (!f_) return ""; f_->getName(name_, sizeof(name_)); return name_; }
+    bool isDirectory() { return f_ && f_->isDir(); }
+    File openNextFile(uint8_t mode = 0) {
+        FsFile n;
+        if (!f_ || !n.openNext(f_.get(), mode == FILE_READ ? O_RDONLY : O_RDWR)) return File();
+        return File(std::move(n));
+    }
+    void rewindDirectory() { if (f_) f_->rewind(); }
+
+private:
+    std::shared_ptr<FsFile> f_;
+    char name_[256];
+};
+
+class SDClass {
+public:
+    bool begin(uint8_t csPin = 10);
+    File open(const char* path, uint8_t mode = FILE_READ);
+    bool exists(const char* path) { return sdfs.exists(path); }
+    bool mkdir(const char* path) { return sdfs.mkdir(path); }
+    bool remove(const char* path) { return sdfs.remove(path); }
+    bool rmdir(const char* path) { return sdfs.rmdir(path); }
+    bool rename(const char* a, const char* b) { return sdfs.rename(a, b); }
+    uint64_t totalSize() { return (uint64_t)sdfs.clusterCount() * sdfs.bytesPerCluster(); }
+    uint64_t usedSize() { return (uint64_t)(sdfs.clusterCount() - sdfs.freeClusterCount()) * sdfs.bytesPerCluster(); }
+    SdFs sdfs;
+};
+
+extern SDClass SD;
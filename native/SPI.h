@@ -0,0 +1,2 @@
+// Host stand-in for the Teensy SPI library; SD access goes through SD.h.
+#pragma once
@@ -0,0 +1,271 @@
+#!/usr/bin/env python3
+"""
+Protocol benchmarks against the native build, for catching regressions
+without hardware.
+
+For each tree size the script generates a synthetic tree, starts the native
+firmware on a pty with an empty scratch card, and times syncdir (bundle,
+unchanged resync and framed), downloaddir (plain, bundle and LZ4) and find
+(walking the card, then with the search index) through the same functions
+sync.py uses. Each row also shows the p99 latency of the device's busiest SD
+and USB calls, from its 'stats' histograms.
+
+Run from the repository root:
+
+    pio run -e native
+    python3 native/bench.py --files 1000 10000 100000 --json results.json
+
+With --baseline, rows whose throughput fell by more than --tolerance against
+an earlier --json run are reported and the script exits with status 1.
+"""
+import argparse
+import contextlib
+import io
+import json
+import os
+import random
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+import serial
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), ".."))
+import sync  # noqa: E402
+
+DEFAULT_BINARY = os.path.join(".pio", "build", "native", "program")
+FIND_REPEATS = 5
+
+
+def make_tree(root, count, seed=1):
+    """
+    Write count files of 64 B to 16 KB (log-uniform) in directories of 100,
+    two levels deep, filled with CNF-like text so LZ4 has something to do.
+    Returns the total size in bytes.
+    """
+    rng = random.Random(seed)
+    pool = " ".join(str(rng.randint(-50, 50)) + (" 0\n" if rng.random() < 0.2 else "") for _ in range(40000))
+    pool = pool.encode()
+    total = 0
+    for i in range(count):
+        directory = os.path.join(root, f"d{i // 10000:02d}", f"e{i // 100 % 100:02d}")
+        if i % 100 == 0:
+            os.makedirs(directory, exist_ok=True)
+        size = int(2 ** rng.uniform(6, 14))
+        start = rng.randrange(len(pool) - size)
+        with open(os.path.join(directory, f"f{i:06d}.cnf"), "wb") as file:
+            file.write(pool[start:start + size])
+        total += size
+    return total
+
+
+class NativeDevice:
+    """The native firmware on a pty, with a scratch directory as its card."""
+
+    def __init__(self, binary, card, workdir):
+        self.tty = os.path.join(workdir, "tty")
+        env = dict(os.environ, SDPEEK_SD_ROOT=card, SDPEEK_PTY_LINK=self.tty)
+        self.process = subprocess.Popen([binary], env=env, stderr=subprocess.DEVNULL)
+        deadline = time.time() + 5
+        while not os.path.exists(self.tty):
+            if time.time() > deadline or self.process.poll() is not None:
+                raise RuntimeError(f"{binary} did not start")
+            time.sleep(0.05)
+        self.ser = serial.Serial(self.tty, 2000000, timeout=2)
+        self.command("")
+
+    def command(self, cmd):
+        """Run a shell command; returns its output and the seconds until the
+        prompt came back (the second prompt for commands that start a job)."""
+        self.ser.reset_input_buffer()
+        start = time.time()
+        self.ser.write((cmd + "\n").encode())
+        output = self.read_prompt()
+        if "Started " in output:
+            output += self.read_prompt()
+        return output, time.time() - start
+
+    def read_prompt(self):
+        output = b""
+        while not output.endswith(b"\n> "):
+            chunk = self.ser.read(max(1, self.ser.in_waiting))
+            if not chunk:
+                raise TimeoutError(f"No prompt from the device after {output[-200:]!r}")
+            output += chunk
+        return output.decode(errors="replace")
+
+    def stats(self):
+        stats = sync.read_device_stats(self.ser)
+        self.read_prompt()
+        return stats
+
+    def close(self):
+        self.ser.close()
+        self.process.terminate()
+        self.process.wait()
+
+
+def p99(stats, names):
+    """p99 of the busiest of the named device operations, as a bucket bound."""
+    ops = [stats["ops"][name] for name in names if stats["ops"].get(name, {}).get("count")]
+    if not ops:
+        return "-"
+    op = max(ops, key=lambda op: op["total_us"])
+    rank, seen = op["count"] * 0.99, 0
+    for bucket, count in enumerate(op["histogram"][:-1]):
+        seen += count
+        if seen > rank:
+            return f"<{2 ** bucket} us"
+    return f">{2 ** (len(op['histogram']) - 2)} us"
+
+
+def quietly(function, *args, **kwargs):
+    """Call one of sync.py's transfer functions without its progress output."""
+    with contextlib.redirect_stdout(io.StringIO()), contextlib.redirect_stderr(io.StringIO()):
+        return function(*args, **kwargs)
+
+
+def tree_size(root):
+    files = total = 0
+    for directory, _, names in os.walk(root):
+        for name in names:
+            if name != sync.MANIFEST_NAME:
+                files += 1
+                total += os.path.getsize(os.path.join(directory, name))
+    return files, total
+
+
+def run_size(binary, count, workdir, rows):
+    source = os.path.join(workdir, "source")
+    card = os.path.join(workdir, "card")
+    os.makedirs(card)
+    total = make_tree(source, count)
+    device = NativeDevice(binary, card, workdir)
+
+    def record(operation, seconds, stats, files=count, size=total, extra=None):
+        row = {
+            "files": count,
+            "operation": operation,
+            "seconds": round(seconds, 4),
+            "mb_per_s": round(size / 1e6 / max(seconds, 1e-9), 2) if size else None,
+            "files_per_s": round(files / max(seconds, 1e-9), 1) if files else None,
+            "sd_p99": p99(stats, ["sd.read", "sd.write", "sd.openNext"]),
+            "usb_p99": p99(stats, ["usb.read", "usb.write"]),
+        }
+        row.update(extra or {})
+        rows.append(row)
+        print_row(row)
+
+    def timed(operation, function, *args, **kwargs):
+        device.command("stats reset")
+        start = time.time()
+        ok = quietly(function, device.ser, *args, **kwargs)
+        seconds = time.time() - start
+        device.command("")  # Whatever the transfer left unread ends at this prompt
+        if ok is False:
+            raise RuntimeError(f"{operation} failed")
+        return seconds, device.stats()
+
+    try:
+        seconds, stats = timed("sync (bundle)", sync.sync_directory, source, "/SYNC", mode="bundle")
+        record("sync (bundle)", seconds, stats)
+        seconds, stats = timed("resync (unchanged)", sync.sync_directory, source, "/SYNC", mode="bundle")
+        record("resync (unchanged)", seconds, stats, size=0)
+        seconds, stats = timed("sync (framed)", sync.sync_directory, source, "/FRAMED", mode="framed")
+        record("sync (framed)", seconds, stats)
+
+        for name, bundle, compress in (("plain", False, False), ("bundle", True, False), ("lz4", True, True)):
+            target = os.path.join(workdir, "download-" + name)
+            os.makedirs(target)
+            seconds, stats = timed(f"download ({name})", sync.download_directory, "/SYNC", target,
+                                   bundle=bundle, compress=compress)
+            if tree_size(target) != (count, total):
+                raise RuntimeError(f"download ({name}) does not match the source tree")
+            record(f"download ({name})", seconds, stats)
+            shutil.rmtree(target)
+
+        # Substring patterns are answered from the metadata cache or a walk of
+        # the card, prefix patterns from the search index once it is built
+        for label in ("find (substring)", "find (indexed)"):
+            suffix = "*" if label == "find (indexed)" else ""
+            if suffix:
+                output, seconds = device.command("index")
+                if "Error" in output:
+                    raise RuntimeError("index failed: " + output.strip())
+                record("index", seconds, device.stats(), size=0)
+            device.command("stats reset")
+            times = []
+            for i in range(FIND_REPEATS):
+                pattern = f"f{random.Random(i).randrange(count):06d}"
+                output, seconds = device.command(f"find {pattern}{suffix}")
+                if pattern not in output:
+                    raise RuntimeError(f"{label} did not find {pattern}")
+                times.append(seconds)
+            record(label, statistics.median(times), device.stats(), files=0, size=0,
+                   extra={"max_seconds": round(max(times), 4)})
+    finally:
+        device.close()
+
+
+def print_row(row):
+    if row.get("mb_per_s") is None and row.get("files_per_s") is None and "max_seconds" not in row:
+        rate = ""
+    elif "max_seconds" in row:
+        rate = f"{'max ' + format(row['max_seconds'], '.3f') + ' s':>20}"
+    else:
+        rate = f"{row['mb_per_s'] or 0:>9.2f} {row['files_per_s'] or 0:>10.0f}"
+    print(f"{row['files']:>7}  {row['operation']:<20} {row['seconds']:>9.3f}  {rate:<20}  "
+          f"{row['sd_p99']:>10}  {row['usb_p99']:>10}")
+
+
+def compare(rows, baseline_path, tolerance):
+    with open(baseline_path) as file:
+        baseline = {(row["files"], row["operation"]): row for row in json.load(file)}
+    regressions = []
+    for row in rows:
+        before = baseline.get((row["files"], row["operation"]))
+        if not before:
+            continue
+        now, then = row["seconds"], before["seconds"]
+        if then and now > then * (1 + tolerance):
+            regressions.append(f"{row['operation']} at {row['files']} files: {then:.3f} s -> {now:.3f} s")
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("--binary", default=DEFAULT_BINARY, help="native firmware (default: %(default)s)")
+    parser.add_argument("--files", type=int, nargs="+", default=[1000, 10000], help="tree sizes to run")
+    parser.add_argument("--json", help="write the results to this file")
+    parser.add_argument("--baseline", help="results of an earlier run to compare against")
+    parser.add_argument("--tolerance", type=float, default=0.25, help="allowed slowdown against the baseline")
+    args = parser.parse_args()
+
+    if not os.path.exists(args.binary):
+        sys.exit(f"Error: {args.binary} not found, build it with 'pio run -e native'")
+
+    rows = []
+    print(f"{'files':>7}  {'operation':<20} {'seconds':>9}  {'MB/s':>9} {'files/s':>10}  {'SD p99':>10}  {'USB p99':>10}")
+    for count in args.files:
+        workdir = tempfile.mkdtemp(prefix="sdpeek-bench-")
+        try:
+            run_size(args.binary, count, workdir, rows)
+        finally:
+            shutil.rmtree(workdir, ignore_errors=True)
+
+    if args.json:
+        with open(args.json, "w") as file:
+            json.dump(rows, file, indent=2)
+    if args.baseline:
+        regressions = compare(rows, args.baseline, args.tolerance)
+        for line in regressions:
+            print("Regression: " + line)
+        if regressions:
+            sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
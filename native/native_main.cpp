@@ -0,0 +1,441 @@
+// Host entry point for the native build (pio run -e native): runs setup()/
+// loop() with SerialUSB bound to a pseudo terminal and the SD card mapped onto
+// a host directory, so sync.py and native/bench.py can drive the protocols
+// without hardware.
+//
+//   SDPEEK_SD_ROOT        host directory used as the card root (default ./sdcard)
+//   SDPEEK_PTY_LINK       optional symlink created to the pty slave device
+//   SDPEEK_PSRAM_MB       emulated PSRAM size, 0 for a board without it (default 16)
+//   SDPEEK_CARD_IMAGE     raw FAT32/exFAT image serving sector reads and volume
+//                         geometry (for the free space counter)
+//   SDPEEK_IMAGE_FREE     free cluster count reported for the image
+//   SDPEEK_OPEN_DELAY_US  delay added to each directory entry read, to mimic
+//                         a slow card
+#include <Arduino.h>
+#include <SD.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/time.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+void setup();
+void loop();
+
+usb_serial_class Serial;
+SDClass SD;
+uint8_t external_psram_size = 16;  // MB, SDPEEK_PSRAM_MB=0 emulates a board without PSRAM
+
+static int ptyFd = -1;
+static int openDelayUs = 0;
+static bool hostAttached = false;
+static uint8_t rxBuf[64 * 1024];
+static size_t rxHead = 0, rxTail = 0;
+
+static uint64_t nowNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+static const uint64_t bootNanos = nowNanos();
+
+uint32_t millis() { return (uint32_t)((nowNanos() - bootNanos) / 1000000ULL); }
+uint32_t micros() { return (uint32_t)((nowNanos() - bootNanos) / 1000ULL); }
+uint32_t nativeCycleCount() { return (uint32_t)((nowNanos() - bootNanos) * (F_CPU_ACTUAL / 1000000) / 1000); }
+void delay(uint32_t ms) { usleep(ms * 1000); }
+void* extmem_malloc(size_t size) { return malloc(size); }
+void extmem_free(void* ptr) { free(ptr); }
+
+// Pull whatever the host has written into the receive buffer; blocks for at
+// most timeoutMs when nothing is buffered so idle loops do not spin a core.
+static void pumpSerial(int timeoutMs) {
+    if (rxHead == rxTail) rxHead = rxTail = 0;
+    if (rxTail == sizeof(rxBuf)) {
+        if (rxHead == 0) return;
+        memmove(rxBuf, rxBuf + rxHead, rxTail - rxHead);
+        rxTail -= rxHead;
+        rxHead = 0;
+    }
+    struct pollfd pfd = {ptyFd, POLLIN, 0};
+    if (poll(&pfd, 1, rxHead == rxTail ? timeoutMs : 0) <= 0) return;
+    ssize_t n = ::read(ptyFd, rxBuf + rxTail, sizeof(rxBuf) - rxTail);
+    if (n > 0) {
+        rxTail += n;
+        hostAttached = true;
+    } else if (n < 0 && errno == EIO) {
+        hostAttached = false;
+        usleep(1000);
+    }
+}
+
+void yield() { pumpSerial(0); }
+
+int usb_serial_class::available() {
+    if (rxHead == rxTail) pumpSerial(1);
+    return rxTail - rxHead;
+}
+int usb_serial_class::read() {
+    if (!available()) return -1;
+    return rxBuf[rxHead++];
+}
+int usb_serial_class::peek() {
+    if (!available()) return -1;
+    return rxBuf[rxHead];
+}
+size_t usb_serial_class::readBytes(char* buf, size_t n) {
+    size_t count = 0;
+    uint32_t start = millis();
+    while (count < n) {
+        if (!available()) {
+            if (millis() - start >= timeout_) break;
+            continue;
+        }
+        size_t chunk = min(n - count, rxTail - rxHead);
+        memcpy(buf + count, rxBuf + rxHead, chunk);
+        rxHead += chunk;
+        count += chunk;
+        start = millis();
+    }
+    return count;
+}
+size_t usb_serial_class::write(const uint8_t* buf, size_t n) {
+    size_t done = 0;
+    while (done < n) {
+        ssize_t w = ::write(ptyFd, buf + done, n - done);
+        if (w > 0) {
+            done += w;
+            continue;
+        }
+        if (w < 0 && errno != EAGAIN && errno != EINTR) return done;
+        struct pollfd pfd = {ptyFd, POLLOUT, 0};
+        poll(&pfd, 1, 10);
+        pumpSerial(0);
+    }
+    return done;
+}
+int usb_serial_class::availableForWrite() {
+    struct pollfd pfd = {ptyFd, POLLOUT, 0};
+    return poll(&pfd, 1, 0) > 0 ? 4096 : 0;
+}
+void usb_serial_class::flush() {}
+uint8_t usb_serial_class::dtr() { return hostAttached; }
+
+// SD card stand-in
+
+static std::string sdRoot = "sdcard";
+
+std::string FsVolume::hostPath(const char* path) const {
+    std::string p = sdRoot;
+    if (!path || path[0] != '/') p += '/';
+    if (path) p += path;
+    while (p.size() > sdRoot.size() + 1 && p.back() == '/') p.pop_back();
+    return p;
+}
+
+bool FsVolume::exists(const char* path) {
+    struct stat st;
+    return stat(hostPath(path).c_str(), &st) == 0;
+}
+bool FsVolume::mkdir(const char* path, bool pFlag) {
+    std::string host = hostPath(path);
+    if (pFlag) {
+        for (size_t i = sdRoot.size() + 1; i < host.size(); i++) {
+            if (host[i] == '/') ::mkdir(host.substr(0, i).c_str(), 0755);
+        }
+    }
+    return ::mkdir(host.c_str(), 0755) == 0;
+}
+bool FsVolume::remove(const char* path) { return ::unlink(hostPath(path).c_str()) == 0; }
+bool FsVolume::rmdir(const char* path) { return ::rmdir(hostPath(path).c_str()) == 0; }
+bool FsVolume::rename(const char* a, const char* b) {
+    std::string to = hostPath(b);
+    struct stat st;
+    if (stat(to.c_str(), &st) == 0) return false;
+    return ::rename(hostPath(a).c_str(), to.c_str()) == 0;
+}
+
+// Geometry of SDPEEK_CARD_IMAGE, if one is given
+static int imageFd = -1;
+static struct { uint8_t type; uint32_t fatStart, clusters, bytesPerCluster, freeClusters; } image;
+
+bool SdCard::readSectors(uint32_t sector, uint8_t* dst, size_t ns) {
+    return imageFd >= 0 && pread(imageFd, dst, ns * 512, (off_t)sector * 512) == (ssize_t)(ns * 512);
+}
+
+static uint32_t le32(const uint8_t* p) { return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24; }
+
+static void openImage(const char* path) {
+    imageFd = ::open(path, O_RDONLY);
+    uint8_t s[512];
+    if (imageFd < 0 || pread(imageFd, s, 512, 0) != 512) return;
+    uint32_t start = memcmp(s + 3, "EXFAT   ", 8) == 0 || s[11] | s[12] << 8 ? 0 : le32(s + 446 + 8);
+    if (pread(imageFd, s, 512, (off_t)start * 512) != 512) return;
+    if (memcmp(s + 3, "EXFAT   ", 8) == 0) {
+        image.type = FAT_TYPE_EXFAT;
+        image.fatStart = start + le32(s + 80);
+        image.clusters = le32(s + 92);
+        image.bytesPerCluster = 512u << s[109];
+    } else {
+        uint32_t fatSize = le32(s + 36);
+        uint32_t dataStart = (s[14] | s[15] << 8) + s[16] * fatSize;
+        image.type = 32;
+        image.fatStart = start + (s[14] | s[15] << 8);
+        image.clusters = (le32(s + 32) - dataStart) / s[13];
+        image.bytesPerCluster = 512u * s[13];
+    }
+    if (const char* f = getenv("SDPEEK_IMAGE_FREE")) image.freeClusters = atoi(f);
+    fprintf(stderr, "Card image: FAT type %d, %u clusters of %u bytes\n", image.type, image.clusters, image.bytesPerCluster);
+}
+
+uint8_t FsVolume::fatType() { return image.type ? image.type : FAT_TYPE_EXFAT; }
+uint32_t FsVolume::fatStartSector() { return image.fatStart; }
+uint32_t FsVolume::bytesPerCluster() { return image.type ? image.bytesPerCluster : 32768; }
+uint32_t FsVolume::clusterCount() {
+    if (image.type) return image.clusters;
+    struct statvfs vfs;
+    if (statvfs(sdRoot.c_str(), &vfs) != 0) return 0;
+    return (uint32_t)min((uint64_t)vfs.f_blocks * vfs.f_frsize / bytesPerCluster(), (uint64_t)UINT32_MAX);
+}
+uint32_t FsVolume::freeClusterCount() {
+    if (image.type) return image.freeClusters;
+    struct statvfs vfs;
+    if (statvfs(sdRoot.c_str(), &vfs) != 0) return 0;
+    return (uint32_t)min((uint64_t)vfs.f_bavail * vfs.f_frsize / bytesPerCluster(), (uint64_t)UINT32_MAX);
+}
+
+void FsFile::moveFrom(FsFile& o) {
+    fd_ = o.fd_;
+    dir_ = o.dir_;
+    pos_ = o.pos_;
+    host_ = std::move(o.host_);
+    name_ = std::move(o.name_);
+    dirIndex_ = o.dirIndex_;
+    nextIndex_ = o.nextIndex_;
+    lastName_ = std::move(o.lastName_);
+    contiguous_ = o.contiguous_;
+    append_ = o.append_;
+    o.fd_ = -1;
+    o.dir_ = nullptr;
+}
+
+bool FsFile::openHost(const std::string& host, const std::string& name, oflag_t oflag) {
+    close();
+    struct stat st;
+    bool exists = stat(host.c_str(), &st) == 0;
+    if (exists && S_ISDIR(st.st_mode)) {
+        if ((oflag & O_ACCMODE) != O_RDONLY && (oflag & O_CREAT) && !(oflag & O_RDWR)) return false;
+        dir_ = opendir(host.c_str());
+        if (!dir_) return false;
+    } else {
+        if (!exists && !(oflag & O_CREAT)) return false;
+        if (exists && (oflag & O_CREAT) && (oflag & O_EXCL)) return false;
+        int flags = oflag & (O_ACCMODE | O_CREAT | O_TRUNC);
+        fd_ = ::open(host.c_str(), flags, 0644);
+        if (fd_ < 0) return false;
+    }
+    host_ = host;
+    name_ = name;
+    pos_ = (oflag & O_AT_END) ? fileSize() : 0;
+    append_ = oflag & O_APPEND;
+    nextIndex_ = 0;
+    contiguous_ = false;
+    return true;
+}
+
+bool FsFile::open(FsVolume* vol, const char* path, oflag_t oflag) {
+    std::string host = vol->hostPath(path);
+    size_t slash = host.find_last_of('/');
+    std::string name = host.size() <= sdRoot.size() ? std::string("/") : host.substr(slash + 1);
+    return openHost(host, name, oflag);
+}
+
+bool FsFile::open(FsFile* dir, const char* path, oflag_t oflag) {
+    if (!dir || !dir->isDir()) return false;
+    std::string host = dir->host_ + "/" + path;
+    size_t slash = host.find_last_of('/');
+    return openHost(host, host.substr(slash + 1), oflag);
+}
+
+// Entries have no fixed slots on the host, so an index is resolved by name:
+// directly for the entry openNext() last returned, by counting otherwise.
+bool FsFile::open(FsFile* dir, uint32_t index, oflag_t oflag) {
+    if (!dir || !dir->dir_) return false;
+    std::string name;
+    if (index == dir->nextIndex_) {
+        name = dir->lastName_;
+    } else if (DIR* scan = opendir(dir->host_.c_str())) {
+        uint32_t i = 0;
+        while (struct dirent* de = readdir(scan)) {
+            if (++i == index) {
+                name = de->d_name;
+                break;
+            }
+        }
+        closedir(scan);
+    }
+    if (name.empty() || name == "." || name == "..") return false;
+    if (!openHost(dir->host_ + "/" + name, name, oflag)) return false;
+    dirIndex_ = index;
+    return true;
+}
+
+bool FsFile::openNext(FsFile* dir, oflag_t oflag) {
+    if (!dir || !dir->dir_) return false;
+    if (openDelayUs) usleep(openDelayUs);
+    struct dirent* de;
+    while ((de = readdir(dir->dir_)) != nullptr) {
+        dir->nextIndex_++;
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        if (openHost(dir->host_ + "/" + de->d_name, de->d_name, oflag & ~(O_CREAT | O_TRUNC))) {
+            dirIndex_ = dir->nextIndex_;
+            dir->lastName_ = de->d_name;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool FsFile::close() {
+    if (fd_ >= 0) ::close(fd_);
+    if (dir_) closedir(dir_);
+    fd_ = -1;
+    dir_ = nullptr;
+    return true;
+}
+
+int FsFile::read(void* buf, size_t count) {
+    if (!isFile()) return -1;
+    ssize_t n = pread(fd_, buf, count, pos_);
+    if (n < 0) return -1;
+    pos_ += n;
+    return (int)n;
+}
+int FsFile::peek() {
+    uint8_t b;
+    if (!isFile() || pread(fd_, &b, 1, pos_) != 1) return -1;
+    return b;
+}
+int FsFile::available() {
+    uint64_t size = fileSize();
+    return pos_ < size ? (int)min(size - pos_, (uint64_t)INT32_MAX) : 0;
+}
+size_t FsFile::write(const void* buf, size_t count) {
+    if (!isFile()) return 0;
+    if (append_) pos_ = fileSize();
+    ssize_t n = pwrite(fd_, buf, count, pos_);
+    if (n < 0) return 0;
+    pos_ += n;
+    return (size_t)n;
+}
+int FsFile::fgets(char* str, int num, const char* delim) {
+    int n = 0;
+    while (n < num - 1) {
+        int c = read();
+        if (c < 0) break;
+        str[n++] = (char)c;
+        if (delim ? strchr(delim, c) != nullptr : c == '\n') break;
+    }
+    str[n] = 0;
+    return n ? n : -1;
+}
+uint64_t FsFile::fileSize() const {
+    struct stat st;
+    if (fd_ < 0 || fstat(fd_, &st) != 0) return 0;
+    return st.st_size;
+}
+bool FsFile::truncate(uint64_t length) {
+    if (!isFile() || ftruncate(fd_, length) != 0) return false;
+    if (pos_ > length) pos_ = length;
+    return true;
+}
+bool FsFile::preAllocate(uint64_t length) {
+    if (!isFile() || !length || fileSize() != 0) return false;
+    contiguous_ = true;
+    return true;
+}
+bool FsFile::remove() {
+    if (!isFile()) return false;
+    bool ok = ::unlink(host_.c_str()) == 0;
+    close();
+    return ok;
+}
+bool FsFile::rmdir() {
+    if (!isDir()) return false;
+    bool ok = ::rmdir(host_.c_str()) == 0;
+    close();
+    return ok;
+}
+size_t FsFile::getName(char* name, size_t len) {
+    if (!len) return 0;
+    size_t n = min(name_.size(), len - 1);
+    memcpy(name, name_.c_str(), n);
+    name[n] = 0;
+    return n;
+}
+bool FsFile::getModifyDateTime(uint16_t* pdate, uint16_t* ptime) {
+    struct stat st;
+    if (!isOpen() || stat(host_.c_str(), &st) != 0) return false;
+    struct tm tm;
+    localtime_r(&st.st_mtime, &tm);
+    *pdate = FAT_DATE(tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+    *ptime = (uint16_t)(tm.tm_hour << 11 | tm.tm_min << 5 | tm.tm_sec >> 1);
+    return true;
+}
+
+bool SDClass::begin(uint8_t) {
+    struct stat st;
+    return stat(sdRoot.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+File SDClass::open(const char* path, uint8_t mode) {
+    oflag_t flags = O_RDONLY;
+    if (mode == FILE_WRITE) flags = O_RDWR | O_CREAT | O_AT_END;
+    else if (mode == FILE_WRITE_BEGIN) flags = O_RDWR | O_CREAT;
+    FsFile f;
+    if (!f.open(&sdfs, path, flags)) return File();
+    return File(std::move(f));
+}
+
+int main() {
+    const char* root = getenv("SDPEEK_SD_ROOT");
+    if (root && *root) sdRoot = root;
+    while (sdRoot.size() > 1 && sdRoot.back() == '/') sdRoot.pop_back();
+    if (const char* psram = getenv("SDPEEK_PSRAM_MB")) external_psram_size = atoi(psram);
+    if (const char* card = getenv("SDPEEK_CARD_IMAGE")) openImage(card);
+    if (const char* delay = getenv("SDPEEK_OPEN_DELAY_US")) openDelayUs = atoi(delay);
+    ::mkdir(sdRoot.c_str(), 0755);
+
+    ptyFd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (ptyFd < 0 || grantpt(ptyFd) != 0 || unlockpt(ptyFd) != 0) {
+        perror("posix_openpt");
+        return 1;
+    }
+    fcntl(ptyFd, F_SETFL, fcntl(ptyFd, F_GETFL) | O_NONBLOCK);
+    const char* slave = ptsname(ptyFd);
+
+    // Put the slave side in raw mode so binary transfers pass through untouched.
+    int slaveFd = ::open(slave, O_RDWR | O_NOCTTY);
+    if (slaveFd >= 0) {
+        struct termios tio;
+        tcgetattr(slaveFd, &tio);
+        cfmakeraw(&tio);
+        tcsetattr(slaveFd, TCSANOW, &tio);
+        ::close(slaveFd);
+    }
+
+    const char* link = getenv("SDPEEK_PTY_LINK");
+    if (link && *link) {
+        unlink(link);
+        if (symlink(slave, link) != 0) perror("symlink");
+    }
+    fprintf(stderr, "SDPeek native: serial on %s, card root %s\n", slave, sdRoot.c_str());
+    signal(SIGPIPE, SIG_IGN);
+
+    setup();
+    while (true) loop();
+}
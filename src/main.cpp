@@ -1,21 +1,90 @@
 #include <Arduino.h>
 #include <SD.h>
 #include <SPI.h>
-#include <map>
+#include <algorithm>
+#include <functional>
+#include <malloc.h>
 
 #define SERIAL_BAUD 2000000
 #define MAX_FILE_PREVIEW 1000
 #define SERIAL_TIMEOUT 5000
 #define VERSION "1.2.1"
 #define DEFAULT_SYNC_DIR "/SYNC"
+#define SYNC_MANIFEST "/.sdpeek_manifest"  // Kept under each sync root
+#define MANIFEST_LINE_MAX 320
+#define SD_SECTOR_SIZE 512
+#ifndef IO_BLOCK_SIZE
+#define IO_BLOCK_SIZE (64 * SD_SECTOR_SIZE)  // Staging block for bulk transfers, override with -D IO_BLOCK_SIZE=...
+#endif
+static_assert(IO_BLOCK_SIZE % SD_SECTOR_SIZE == 0, "IO_BLOCK_SIZE must be a multiple of the SD sector size");
+#define FRAME_MAGIC 0xA5
+#define FRAME_HEADER_SIZE 6
+#define FRAME_MAX_PAYLOAD 2048
+#define FRAME_WINDOW 16
+#define FRAME_NAK_INTERVAL 20  // ms between repeated NAKs for the same gap
+#define FRAME_STALL_TIMEOUT 50  // ms before a half-received frame is dropped
+#define BUNDLE_HEADER_SIZE 11
+#define BUNDLE_PATH_MAX 256
+#define LZ4_BLOCK_SIZE (16 * 1024)  // Compression unit; bounds codec RAM to two blocks plus the hash table
+#define LZ4_HASH_BITS 12
+#ifndef CACHE_RAM_BYTES
+#define CACHE_RAM_BYTES (160 * 1024)          // Metadata cache budget on the RAM2 heap
+#endif
+#ifndef CACHE_PSRAM_BYTES
+#define CACHE_PSRAM_BYTES (4 * 1024 * 1024)   // Metadata cache budget when PSRAM is fitted
+#endif
+#define INDEX_FILE "/.sdpeek_index"
+#define INDEX_JOURNAL INDEX_FILE ".log"
+#define INDEX_MAGIC "SDPKIDX1"
+#define INDEX_BLOCK_SIZE (8 * SD_SECTOR_SIZE)
+#define INDEX_RECORD_HEADER 16
+#define INDEX_RECORD_MAX (INDEX_RECORD_HEADER + 255 + BUNDLE_PATH_MAX)
+#define INDEX_JOURNAL_MAX (IO_BLOCK_SIZE / 2)  // A longer journal is compacted into the index
+#define INDEX_MERGE_FANIN 8
+#define INDEX_SORT_PSRAM_BYTES (1024 * 1024)
+#define WALK_MAX_DEPTH 16
+#define GLOB_MAX_TOKENS 32
+#define GREP_PATTERN_MAX 255  // Fits the search's 8-bit shift table
+#define GREP_CONTEXT 160      // Bytes shown either side of a match in an over-long line
+#define DEDUPE_FILE "/.sdpeek_dupes"  // Scratch list of files while dupes runs
+#define DEDUPE_HEAD_BYTES 4096        // Compared before reading a whole file
+#define DEDUPE_RAM_BYTES (64 * 1024)
+#define DEDUPE_PSRAM_BYTES (4 * 1024 * 1024)
+#define DU_TOP_DEFAULT 10  // Largest directories and files listed by du
+#define DU_TOP_MAX 32
+#define LS_PAGE_SIZE 50  // Entries per ls --page
+#define SPACE_SCAN_SECTORS 8  // FAT or bitmap sectors counted per idle slice
+#define JOB_SLICE_MICROS 20000
+#define JOB_PROGRESS_MILLIS 1000
+#define JOB_SLICE_BYTES (256 * 1024)  // Transfer jobs send at most this much per step, a multiple of LZ4_BLOCK_SIZE
+#define SUM_CHUNK (1024 * 1024)  // Default chunk size for `sum`
+#define RPC_SUM_MAX (4 * SUM_CHUNK)  // Longest range one rpc `sum` reads while the loop waits
+#define RECORD_WRITE_BYTES IO_BLOCK_SIZE  // Card writes while recording, a multiple of the sector size
+#define RECORD_RAM_BYTES (192 * 1024)     // Ring buffer without PSRAM; falls back to ioBuffers if the heap is short
+#define RECORD_PSRAM_BYTES (8 * 1024 * 1024)
+#define RECORD_ROTATE_MB 1024
+#define RECORD_IDLE_TIMEOUT 30000  // ms without data before a recording is closed
+#define COMMAND_LINE_MAX 512
+#ifndef PERF_STATS
+#define PERF_STATS 1  // I/O timing counters behind `stats`; build with -D PERF_STATS=0 to compile them out
+#endif
+#define PERF_BUCKETS 20  // Latency histogram: under 1 us, then powers of two up to 256 ms and beyond
+#define PERF_COMMANDS 24
+#define BENCH_FILE "/.sdpeek_bench"
+#define BENCH_DEFAULT_MB 8
+#define BENCH_USB_DEFAULT_MB 4
+#define BENCH_RANDOM_OPS 512  // Random reads and writes per block size
+#define BENCH_SAMPLES 1024    // Latencies kept per test for percentiles
 
 String currentPath = "/";
 
-enum class Error { NONE, FILE_NOT_FOUND, NOT_A_DIRECTORY, INVALID_PATH, SD_INIT_FAILED, REMOVE_FAILED, IS_DIRECTORY, NOT_EMPTY };
-Error findFiles(const String& pattern, const String& currentDir = "");
+enum class Error { NONE, FILE_NOT_FOUND, NOT_A_DIRECTORY, INVALID_PATH, SD_INIT_FAILED, REMOVE_FAILED, IS_DIRECTORY, NOT_EMPTY, TIMEOUT, WRITE_FAILED, PROTOCOL, READ_FAILED };
+Error findFiles(const String& pattern);
 Error countItems(const String& path, unsigned long& fileCount, unsigned long& dirCount);
+void indexJournal(char op, const String& path, uint64_t size = 0);
 
-String formatSize(uint64_t bytes) {
+// Formats into `out` without allocating, for output inside loops.
+const char* formatSize(char* out, size_t length, uint64_t bytes) {
     const char* units[] = {" B", " KB", " MB", " GB"};
     int unitIndex = 0;
     double size = bytes;
@@ -23,7 +92,13 @@ String formatSize(uint64_t bytes) {
         size /= 1024;
         unitIndex++;
     }
-    return String(size, (unitIndex == 0) ? 0 : 1) + units[unitIndex];
+    snprintf(out, length, "%.*f%s", (unitIndex == 0) ? 0 : 1, size, units[unitIndex]);
+    return out;
+}
+
+String formatSize(uint64_t bytes) {
+    char text[24];
+    return formatSize(text, sizeof(text), bytes);
 }
 
 void showBanner() {
@@ -35,24 +110,937 @@ void showBanner() {
 
 void showHelp() {
     SerialUSB.println(F("Available commands:"));
-    SerialUSB.println(F("  ls              - List files in current directory"));
+    SerialUSB.println(F("  ls [path] [--sort name|size|date] [--top N] [--page K] [--summary] - List a directory"));
     SerialUSB.println(F("  pwd             - Print working directory"));
     SerialUSB.println(F("  cd <path>       - Change directory"));
-    SerialUSB.println(F("  cat <file>      - Display file contents"));
+    SerialUSB.println(F("  cat <file> [offset] [length] - Display file contents (first 1000 bytes by default)"));
+    SerialUSB.println(F("  head [-n N] <file> - Show the first N lines (10 by default)"));
+    SerialUSB.println(F("  tail [-n N] <file> - Show the last N lines (10 by default)"));
+    SerialUSB.println(F("  hexdump <file> [offset] [length] - Hex and ASCII dump of a byte range"));
     SerialUSB.println(F("  free            - Show SD card space"));
     SerialUSB.println(F("  rm <file>       - Remove a file"));
+    SerialUSB.println(F("  rm -r <dir>     - Remove a directory and everything in it"));
     SerialUSB.println(F("  rmdir <dir>     - Remove an empty directory"));
     SerialUSB.println(F("  syncdir [path]  - Sync files from host (optional custom path)"));
     SerialUSB.println(F("  resync          - Resync files from host to /SYNC directory"));
+    SerialUSB.println(F("  downloaddir [--bundle [--lz4]] <path> - Send a directory tree to the host"));
+    SerialUSB.println(F("  get <file> [offset] [length] - Send a byte range of a file to the host (run from sync.py)"));
+    SerialUSB.println(F("  put <file> [offset] - Replace a file from offset on with data from the host (run from sync.py)"));
+    SerialUSB.println(F("  record <file> [MB] - Log a stream from the host to the card, rotating files at MB (run from sync.py)"));
+    SerialUSB.println(F("  sum <file> [offset] [length] [chunk] - CRC-32 of a byte range, per chunk (default 1 MB)"));
     SerialUSB.println(F("  foldersummary <path> - Show summary of folder contents"));
+    SerialUSB.println(F("  rpc             - Switch to request/response mode for host tools ('exit' leaves it)"));
     SerialUSB.println(F("  help            - Show this help message"));
-    SerialUSB.println(F("  find <pattern>   - Find files matching pattern (case-insensitive)"));
+    SerialUSB.println(F("  find <pattern>   - Find files by name (case-insensitive, globs like *.cnf or uf50-*/**)"));
+    SerialUSB.println(F("  grep <text> [path] - Find lines containing text in files below path (\"quote\" spaces)"));
+    SerialUSB.println(F("  dupes [path]     - Find files with identical contents and the space they waste"));
+    SerialUSB.println(F("  du [path] [--top N] - Space used below path and its largest directories and files"));
+    SerialUSB.println(F("  index            - Rebuild the search index used by find ('abc*' finds names by prefix)"));
+    SerialUSB.println(F("  walkstats        - Show timing and heap use of the last directory walk"));
+    SerialUSB.println(F("  stats [--raw|reset] - Show I/O latency, throughput, command times and heap high-water"));
+    SerialUSB.println(F("  bench [sd] [MB]  - Time card reads and writes from 512 B to 64 KB blocks on a scratch file"));
+    SerialUSB.println(F("  bench usb [MB]   - USB throughput in both directions (run from sync.py)"));
+    SerialUSB.println(F("  jobs             - Show the running job (clearfolder, rm -r, find, grep, dupes, du, index, bench, downloaddir, get, sum, cat)"));
+    SerialUSB.println(F("  pause / resume   - Pause or resume the running job"));
+    SerialUSB.println(F("  abort            - Stop the running job"));
     SerialUSB.println(F("  count            - Count files and directories in current path"));
  
 }
 Error receiveFile(const String& path);
 void printProgress(unsigned long current, unsigned long total);
 
+size_t heapInUse() {
+    return mallinfo().uordblks;
+}
+
+// Runtime counters behind `stats`. Hot I/O calls go through PERF_TIMED, which
+// reads the cycle counter either side of the call and files the duration in a
+// fixed log2 histogram, so a sample costs a few instructions and nothing is
+// allocated. Command times and the heap high-water mark are taken in loop().
+// With PERF_STATS=0 the wrapper reduces to the bare call.
+enum PerfOp { PERF_SD_OPEN, PERF_SD_OPEN_NEXT, PERF_SD_READ, PERF_SD_WRITE, PERF_USB_READ, PERF_USB_WRITE, PERF_OPS };
+const char* const perfOpNames[PERF_OPS] = {"sd.open", "sd.openNext", "sd.read", "sd.write", "usb.read", "usb.write"};
+
+struct PerfCounter {
+    uint32_t count, maxCycles;
+    uint64_t cycles, bytes;
+    uint32_t buckets[PERF_BUCKETS];  // Bucket 0 is under 1 us, bucket b is [2^(b-1), 2^b) us
+};
+
+struct PerfCommand {
+    char name[12];  // First word of the command line, or the job name
+    uint32_t count;
+    uint64_t micros, maxMicros;
+};
+
+struct PerfStats {
+    PerfCounter ops[PERF_OPS];
+    PerfCommand commands[PERF_COMMANDS];  // The last slot collects verbs that did not fit
+    size_t heapPeak;
+    uint32_t since;  // millis() at the last reset
+};
+PerfStats perf;
+
+#if PERF_STATS
+inline uint64_t perfAmount(int n) { return n > 0 ? n : 0; }
+inline uint64_t perfAmount(size_t n) { return n; }
+template <typename T> uint64_t perfAmount(const T&) { return 0; }
+
+void perfRecord(PerfOp op, uint32_t cycles, uint64_t bytes) {
+    PerfCounter& counter = perf.ops[op];
+    counter.count++;
+    counter.cycles += cycles;
+    counter.bytes += bytes;
+    if (cycles > counter.maxCycles) counter.maxCycles = cycles;
+    uint32_t us = cycles / (F_CPU_ACTUAL / 1000000);
+    int bucket = us ? 32 - __builtin_clz(us) : 0;
+    counter.buckets[min(bucket, PERF_BUCKETS - 1)]++;
+}
+
+// Times one call; reads and writes also count the bytes they return.
+template <typename Call>
+auto perfTimed(PerfOp op, Call call) -> decltype(call()) {
+    uint32_t start = ARM_DWT_CYCCNT;
+    auto result = call();
+    perfRecord(op, ARM_DWT_CYCCNT - start, perfAmount(result));
+    return result;
+}
+#define PERF_TIMED(op, call) perfTimed(op, [&]() { return call; })
+
+void perfCommand(const char* line, uint64_t micros) {
+    size_t length = strcspn(line, " ");
+    if (length == 0) return;
+    length = min(length, sizeof(perf.commands[0].name) - 1);
+    PerfCommand* slot = &perf.commands[PERF_COMMANDS - 1];
+    for (int i = 0; i < PERF_COMMANDS - 1; i++) {
+        PerfCommand& command = perf.commands[i];
+        if (command.count && (strncmp(command.name, line, length) != 0 || command.name[length])) continue;
+        if (!command.count) {
+            memcpy(command.name, line, length);
+            command.name[length] = '\0';
+        }
+        slot = &command;
+        break;
+    }
+    if (slot == &perf.commands[PERF_COMMANDS - 1]) strcpy(slot->name, "(other)");
+    slot->count++;
+    slot->micros += micros;
+    if (micros > slot->maxMicros) slot->maxMicros = micros;
+}
+
+void perfHeap() {
+    size_t used = heapInUse();
+    if (used > perf.heapPeak) perf.heapPeak = used;
+}
+
+void perfReset() {
+    memset(&perf, 0, sizeof(perf));
+    perf.since = millis();
+    perfHeap();
+}
+
+// Upper bound in microseconds of the bucket holding the given fraction of
+// samples; 0 when it falls in the open-ended last bucket.
+uint32_t perfPercentile(const PerfCounter& counter, double fraction) {
+    uint32_t rank = counter.count * fraction, seen = 0;
+    for (int b = 0; b < PERF_BUCKETS - 1; b++) {
+        seen += counter.buckets[b];
+        if (seen > rank) return 1UL << b;
+    }
+    return 0;
+}
+
+String perfMicros(uint32_t us) {
+    return us ? "<" + String(us) + " us" : ">" + String(1UL << (PERF_BUCKETS - 2)) + " us";
+}
+
+void printStats() {
+    uint32_t cyclesPerMicro = F_CPU_ACTUAL / 1000000;
+    SerialUSB.println("\nI/O since reset (" + String((millis() - perf.since) / 1000.0, 1) + " s ago):");
+    for (int i = 0; i < PERF_OPS; i++) {
+        const PerfCounter& counter = perf.ops[i];
+        if (!counter.count) continue;
+        double totalMs = counter.cycles / (cyclesPerMicro * 1000.0);
+        String line = String(perfOpNames[i]) + ": " + String(counter.count) + " calls, " + String(totalMs, 1) + " ms, avg " +
+                      String(totalMs * 1000.0 / counter.count, 1) + " us, p50 " + perfMicros(perfPercentile(counter, 0.5)) +
+                      ", p99 " + perfMicros(perfPercentile(counter, 0.99)) + ", max " + String(counter.maxCycles / cyclesPerMicro) + " us";
+        if (counter.bytes) line += ", " + formatSize(counter.bytes) + " (" + formatSize(counter.bytes / max(totalMs / 1000.0, 0.001)) + "/s)";
+        SerialUSB.println(line);
+    }
+    SerialUSB.println("Bytes in: " + formatSize(perf.ops[PERF_USB_READ].bytes) + ", out: " + formatSize(perf.ops[PERF_USB_WRITE].bytes) +
+                      " (bulk transfers)");
+    SerialUSB.println("Heap: " + String((unsigned long)heapInUse()) + " B in use, " + String((unsigned long)perf.heapPeak) + " B high-water");
+    SerialUSB.println("Commands:");
+    for (const PerfCommand& command : perf.commands) {
+        if (!command.count) continue;
+        SerialUSB.println("  " + String(command.name) + ": " + String(command.count) + " runs, avg " +
+                          String(command.micros / 1000.0 / command.count, 1) + " ms, max " + String(command.maxMicros / 1000.0, 1) + " ms");
+    }
+}
+
+// The same counters as colon-separated records for the host script, in raw
+// cycles with the clock rate to convert them.
+void printStatsRaw() {
+    SerialUSB.println("STATS_BEGIN:" + String(millis() - perf.since) + ":" + String((unsigned long)F_CPU_ACTUAL));
+    for (int i = 0; i < PERF_OPS; i++) {
+        const PerfCounter& counter = perf.ops[i];
+        SerialUSB.print("STATS_OP:" + String(perfOpNames[i]) + ":" + String(counter.count) + ":");
+        SerialUSB.print(counter.cycles);
+        SerialUSB.print(":" + String(counter.maxCycles) + ":");
+        SerialUSB.print(counter.bytes);
+        for (int b = 0; b < PERF_BUCKETS; b++) SerialUSB.print((b ? "," : ":") + String(counter.buckets[b]));
+        SerialUSB.println();
+    }
+    for (const PerfCommand& command : perf.commands) {
+        if (!command.count) continue;
+        SerialUSB.print("STATS_CMD:" + String(command.name) + ":" + String(command.count) + ":");
+        SerialUSB.print(command.micros);
+        SerialUSB.print(":");
+        SerialUSB.println(command.maxMicros);
+    }
+    SerialUSB.println("STATS_HEAP:" + String((unsigned long)heapInUse()) + ":" + String((unsigned long)perf.heapPeak));
+    SerialUSB.println("STATS_END");
+}
+#else
+#define PERF_TIMED(op, call) (call)
+inline void perfCommand(const char*, uint64_t) {}
+inline void perfHeap() {}
+inline void perfReset() {}
+void printStats() { SerialUSB.println("Stats are compiled out (PERF_STATS=0)"); }
+void printStatsRaw() { SerialUSB.println("STATS_END"); }
+#endif
+
+
+// Directory metadata cache shared by ls, count, find, foldersummary and
+// downloaddir. Entries live in one flat array; a directory is read from the
+// card the first time it is visited and its children are appended in one go,
+// so they occupy [firstChild, firstChild + childCount). Names are interned in
+// a shared pool. Writers call cacheInvalidate(), which drops the cached
+// contents of the affected directory; when the arena fills up the cache is
+// reset and commands fall back to walking the card.
+#define CACHE_NONE 0xFFFFFFFFUL
+
+struct CacheEntry {
+    uint32_t name : 31;   // Offset into the name pool
+    uint32_t isDir : 1;
+    uint32_t parent;
+    uint32_t firstChild;
+    uint32_t childCount;  // CACHE_NONE until the directory has been read
+    uint64_t size;
+    uint16_t date, time;  // FAT modify date and time
+};
+
+struct MetadataCache {
+    CacheEntry* entries = nullptr;
+    char* names = nullptr;
+    uint32_t* slots = nullptr;  // Intern table of name offsets, open addressing
+    uint32_t entryCapacity = 0, entryCount = 0;
+    uint32_t nameCapacity = 0, nameUsed = 0;
+    uint32_t slotMask = 0;
+    bool full = false;  // A directory did not fit since the last reset
+};
+static MetadataCache cache;
+
+void cacheReset() {
+    cache.entryCount = 1;  // Entry 0 is the root directory, with the empty name at offset 0
+    cache.entries[0] = {0, 1, 0, 0, CACHE_NONE, 0, 0, 0};
+    cache.names[0] = '\0';
+    cache.nameUsed = 1;
+    memset(cache.slots, 0xFF, (cache.slotMask + 1) * sizeof(uint32_t));
+    cache.full = false;
+}
+
+bool cacheBegin() {
+    if (cache.entries) return true;
+    size_t budget = external_psram_size ? CACHE_PSRAM_BYTES : CACHE_RAM_BYTES;
+    uint8_t* arena = (uint8_t*)(external_psram_size ? extmem_malloc(budget) : malloc(budget));
+    if (!arena) return false;
+    uint32_t slots = 1;
+    while (slots * 2 * sizeof(uint32_t) <= budget / 8) slots *= 2;
+    cache.slots = (uint32_t*)arena;
+    cache.slotMask = slots - 1;
+    cache.entries = (CacheEntry*)(arena + slots * sizeof(uint32_t));
+    cache.entryCapacity = (budget - slots * sizeof(uint32_t)) * 5 / 8 / sizeof(CacheEntry);
+    cache.names = (char*)(cache.entries + cache.entryCapacity);
+    cache.nameCapacity = arena + budget - (uint8_t*)cache.names;
+    cacheReset();
+    return true;
+}
+
+// Returns the pool offset of `name`, adding it if new, or CACHE_NONE when full.
+uint32_t cacheIntern(const char* name) {
+    uint32_t hash = 2166136261UL;
+    for (const char* c = name; *c; c++) hash = (hash ^ (uint8_t)*c) * 16777619UL;
+    for (uint32_t probe = 0; probe <= cache.slotMask; probe++) {
+        uint32_t& slot = cache.slots[(hash + probe) & cache.slotMask];
+        if (slot == CACHE_NONE) {
+            size_t length = strlen(name) + 1;
+            if (cache.nameUsed + length > cache.nameCapacity) return CACHE_NONE;
+            memcpy(cache.names + cache.nameUsed, name, length);
+            slot = cache.nameUsed;
+            cache.nameUsed += length;
+            return slot;
+        }
+        if (strcmp(cache.names + slot, name) == 0) return slot;
+    }
+    return CACHE_NONE;
+}
+
+const char* cacheName(uint32_t index) {
+    return cache.names + cache.entries[index].name;
+}
+
+// Writes the absolute path of an entry ("/" for the root) into `buffer`.
+size_t cachePath(uint32_t index, char* buffer, size_t size) {
+    size_t length = 0;
+    for (uint32_t i = index; i != 0; i = cache.entries[i].parent) length += 1 + strlen(cacheName(i));
+    if (length == 0) length = 1;
+    if (length >= size) return 0;
+    buffer[length] = '\0';
+    buffer[0] = '/';
+    size_t end = length;
+    for (uint32_t i = index; i != 0; i = cache.entries[i].parent) {
+        size_t nameLength = strlen(cacheName(i));
+        end -= nameLength;
+        memcpy(buffer + end, cacheName(i), nameLength);
+        buffer[--end] = '/';
+    }
+    return length;
+}
+
+// Reads a directory's entries from the card if they are not cached yet.
+bool cacheLoad(uint32_t dir) {
+    if (cache.entries[dir].childCount != CACHE_NONE) return true;
+    char path[BUNDLE_PATH_MAX];
+    if (!cachePath(dir, path, sizeof(path))) return false;
+    FsFile handle = PERF_TIMED(PERF_SD_OPEN, SD.sdfs.open(path, O_RDONLY));
+    if (!handle || !handle.isDir()) return false;
+
+    uint32_t first = cache.entryCount;
+    FsFile entry;
+    char name[256];
+    while (PERF_TIMED(PERF_SD_OPEN_NEXT, entry.openNext(&handle, O_RDONLY))) {
+        entry.getName(name, sizeof(name));
+        uint32_t offset = cacheIntern(name);
+        if (offset == CACHE_NONE || cache.entryCount == cache.entryCapacity) {
+            cache.entryCount = first;
+            cache.full = true;
+            return false;
+        }
+        CacheEntry& child = cache.entries[cache.entryCount++];
+        child.name = offset;
+        child.isDir = entry.isDir();
+        child.parent = dir;
+        child.firstChild = 0;
+        child.childCount = entry.isDir() ? CACHE_NONE : 0;
+        child.size = entry.isDir() ? 0 : entry.fileSize();
+        entry.getModifyDateTime(&child.date, &child.time);
+        entry.close();
+    }
+    cache.entries[dir].firstChild = first;
+    cache.entries[dir].childCount = cache.entryCount - first;
+    return true;
+}
+
+// Finds the entry for an absolute path. With `load` set, directories along
+// the way are read as needed; otherwise only what is already cached is used.
+uint32_t cacheFind(const char* path, bool load) {
+    if (!cacheBegin()) return CACHE_NONE;
+    uint32_t current = 0;
+    while (*path) {
+        while (*path == '/') path++;
+        const char* end = path;
+        while (*end && *end != '/') end++;
+        if (end == path) break;
+        if (!cache.entries[current].isDir) return CACHE_NONE;
+        if (load && !cacheLoad(current)) return CACHE_NONE;
+        const CacheEntry& dir = cache.entries[current];
+        if (dir.childCount == CACHE_NONE) return CACHE_NONE;
+        uint32_t match = CACHE_NONE;
+        for (uint32_t i = dir.firstChild; i < dir.firstChild + dir.childCount; i++) {
+            const char* name = cacheName(i);
+            if (strncmp(name, path, end - path) == 0 && name[end - path] == '\0') {
+                match = i;
+                break;
+            }
+        }
+        if (match == CACHE_NONE) return CACHE_NONE;
+        current = match;
+        path = end;
+    }
+    return current;
+}
+
+// Returns a loaded directory for `path`, or CACHE_NONE if it is not a
+// directory or does not fit in the cache.
+uint32_t cacheDirectory(const String& path) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        uint32_t dir = cacheFind(path.c_str(), true);
+        if (dir != CACHE_NONE && cache.entries[dir].isDir && cacheLoad(dir)) return dir;
+        if (!cache.full) break;
+        cacheReset();  // Make room by dropping everything else
+    }
+    return CACHE_NONE;
+}
+
+// Loads every directory below `dir`; false if the tree does not fit.
+bool cacheLoadTree(uint32_t dir) {
+    if (!cacheLoad(dir)) return false;
+    const CacheEntry& entry = cache.entries[dir];
+    for (uint32_t i = entry.firstChild; i < entry.firstChild + entry.childCount; i++) {
+        if (cache.entries[i].isDir && !cacheLoadTree(i)) return false;
+    }
+    return true;
+}
+
+// Counts the files below `dir` without touching the card; false if part of
+// the tree is not cached.
+bool cacheCountFiles(uint32_t dir, unsigned long& files) {
+    const CacheEntry& entry = cache.entries[dir];
+    if (entry.childCount == CACHE_NONE) return false;
+    for (uint32_t i = entry.firstChild; i < entry.firstChild + entry.childCount; i++) {
+        if (!cache.entries[i].isDir) files++;
+        else if (!cacheCountFiles(i, files)) return false;
+    }
+    return true;
+}
+
+// Called after `path` was created, removed or rewritten: forgets the cached
+// contents of its parent directory, which also drops everything below it.
+void cacheInvalidate(const String& path) {
+    if (!cache.entries) return;
+    String parent = path;
+    while (parent.length() > 1 && parent.endsWith("/")) parent.remove(parent.length() - 1);
+    int slash = parent.lastIndexOf('/');
+    parent = slash <= 0 ? String("/") : parent.substring(0, slash);
+    uint32_t dir = cacheFind(parent.c_str(), false);
+    if (dir != CACHE_NONE) cache.entries[dir].childCount = CACHE_NONE;
+}
+
+// Iterative depth-first walk of a directory tree. Open directories live in a
+// fixed stack and every entry's path is built in one reusable buffer, so a
+// walk allocates nothing however large the tree is. Each call to next()
+// reports one event; directories are reported on the way in (ENTER_DIR, with
+// the directory open in `entry`) and again on the way out (LEAVE_DIR, after
+// its handle is closed). Directories deeper than WALK_MAX_DEPTH and names
+// that would overflow the path buffer are reported as skipped, not entered.
+enum class WalkEvent { FILE, ENTER_DIR, LEAVE_DIR };
+
+struct WalkStats {
+    unsigned long entries = 0, skipped = 0;
+    uint32_t micros = 0;
+    uint8_t maxDepth = 0;
+    size_t heapStart = 0, heapPeak = 0;  // Bytes in use on the heap, sampled
+};
+WalkStats lastWalk;
+
+struct TreeWalker {
+    FsFile dirs[WALK_MAX_DEPTH];
+    uint16_t dirLength[WALK_MAX_DEPTH];  // Path length of each open directory
+    FsFile entry;                        // The entry reported by the last event
+    char path[BUNDLE_PATH_MAX];
+    uint16_t length = 0;                 // Length of `path`
+    uint16_t nameOffset = 0;             // Start of the last component in `path`
+    uint16_t rootLength = 0;
+    int depth = -1;
+    bool entering = false;  // Last event was ENTER_DIR; descend on the next call
+    WalkStats stats;
+    uint32_t startMicros = 0;
+
+    ~TreeWalker() { finish(); }
+
+    bool begin(const char* root) {
+        size_t n = strlen(root);
+        while (n > 0 && root[n - 1] == '/') n--;
+        if (n >= sizeof(path)) return false;
+        memcpy(path, root, n);
+        path[n] = '\0';
+        dirs[0] = PERF_TIMED(PERF_SD_OPEN, SD.sdfs.open(n ? path : "/", O_RDONLY));
+        if (!dirs[0] || !dirs[0].isDir()) return false;
+        length = rootLength = dirLength[0] = n;
+        nameOffset = n;
+        depth = 0;
+        entering = false;
+        stats = WalkStats();
+        stats.heapStart = stats.heapPeak = heapInUse();
+        startMicros = micros();
+        return true;
+    }
+
+    // Path of the current entry relative to the root, with a leading '/'.
+    const char* relative() const { return path + rootLength; }
+    const char* name() const { return path + nameOffset; }
+
+    // Called on ENTER_DIR to report the directory's LEAVE_DIR next instead
+    // of walking its contents.
+    void skipChildren() { entering = false; }
+
+    bool next(WalkEvent& event) {
+        if (entry.isOpen()) {
+            if (entering && depth + 1 < WALK_MAX_DEPTH) {
+                depth++;
+                dirs[depth] = std::move(entry);
+                dirLength[depth] = length;
+                if (depth > stats.maxDepth) stats.maxDepth = depth;
+            } else {
+                if (entering) stats.skipped++;
+                bool wasDir = entry.isDir();
+                entry.close();
+                entering = false;
+                if (wasDir) {
+                    event = WalkEvent::LEAVE_DIR;
+                    return true;
+                }
+            }
+            entering = false;
+        }
+        while (depth >= 0) {
+            uint16_t base = dirLength[depth];
+            if (PERF_TIMED(PERF_SD_OPEN_NEXT, entry.openNext(&dirs[depth], O_RDONLY))) {
+                path[base] = '/';
+                size_t n = base + 2u < sizeof(path) ? entry.getName(path + base + 1, sizeof(path) - base - 1) : 0;
+                if (n == 0 || base + 1 + n >= sizeof(path) - 1) {
+                    stats.skipped++;
+                    entry.close();
+                    continue;
+                }
+                length = base + 1 + n;
+                nameOffset = base + 1;
+                if ((++stats.entries & 1023) == 0) sampleHeap();
+                entering = entry.isDir();
+                event = entering ? WalkEvent::ENTER_DIR : WalkEvent::FILE;
+                return true;
+            }
+            dirs[depth].close();
+            path[base] = '\0';
+            length = base;
+            if (depth-- == 0) break;
+            nameOffset = dirLength[depth] + 1;
+            event = WalkEvent::LEAVE_DIR;
+            return true;
+        }
+        finish();
+        return false;
+    }
+
+    void sampleHeap() {
+        size_t used = heapInUse();
+        if (used > stats.heapPeak) stats.heapPeak = used;
+    }
+
+    // Records the walk in lastWalk; runs once, when the walk ends or the
+    // walker goes out of scope.
+    void finish() {
+        if (!startMicros) return;
+        sampleHeap();
+        stats.micros = micros() - startMicros;
+        startMicros = 0;
+        lastWalk = stats;
+        entry.close();
+        for (; depth >= 0; depth--) dirs[depth].close();
+    }
+};
+
+// Runs `visit(walker, event)` for every event of a walk below `root`. The
+// visitor returns Error::NONE to continue; anything else stops the walk and
+// is returned.
+template <typename Visitor>
+Error walkTree(const String& root, Visitor visit) {
+    TreeWalker walker;
+    if (!walker.begin(root.c_str())) return Error::NOT_A_DIRECTORY;
+    WalkEvent event;
+    while (walker.next(event)) {
+        Error err = visit(walker, event);
+        if (err != Error::NONE) return err;
+    }
+    return Error::NONE;
+}
+
+void printWalkStats() {
+    if (!lastWalk.entries && !lastWalk.micros) {
+        SerialUSB.println("No walk since boot");
+        return;
+    }
+    SerialUSB.println("Last walk: " + String(lastWalk.entries) + " entries in " + String(lastWalk.micros / 1000.0, 1) +
+                      " ms, depth " + String(lastWalk.maxDepth) + ", " + String(lastWalk.skipped) + " skipped");
+    if (lastWalk.entries) {
+        SerialUSB.println("Per 10k entries: " + String((double)lastWalk.micros * 10.0 / lastWalk.entries, 1) + " ms");
+    }
+    SerialUSB.println("Heap in use: " + String((unsigned long)lastWalk.heapStart) + " B at start, " +
+                      String((unsigned long)lastWalk.heapPeak) + " B high-water");
+}
+
+// Compiled find pattern, matched case-insensitively without copying the
+// subject. A pattern without wildcards matches anywhere in a name, as find
+// always has. With * or ? it must match the whole name, and once it contains
+// a '/' it matches the path relative to the search root, where ** spans
+// directories: "*.cnf", "uf50-*/**", "**/logs/*.txt".
+struct GlobPattern {
+    enum Op : uint8_t { LITERAL, ONE, STAR, GLOBSTAR, ANY_DIRS };  // ANY_DIRS is a leading or inner "**/"
+    struct Token {
+        Op op;
+        uint8_t offset, length;  // Lowercased literal in `text`
+    };
+    Token tokens[GLOB_MAX_TOKENS];
+    uint8_t count = 0;
+    char text[GLOB_MAX_TOKENS * 4];
+    uint8_t textUsed = 0;
+    bool substring = false;
+    bool pathPattern = false;
+
+    bool compile(const char* pattern) {
+        count = textUsed = 0;
+        pathPattern = strchr(pattern, '/') != nullptr;
+        substring = !pathPattern && !strpbrk(pattern, "*?");
+        if (*pattern == '/') pattern++;
+        while (*pattern) {
+            if (count == GLOB_MAX_TOKENS) return false;
+            Token& token = tokens[count];
+            if (pattern[0] == '*' && pattern[1] == '*') {
+                pattern += 2;
+                while (*pattern == '*') pattern++;
+                token.op = *pattern == '/' ? ANY_DIRS : GLOBSTAR;
+                if (*pattern == '/') pattern++;
+            } else if (*pattern == '*') {
+                token.op = STAR;
+                pattern++;
+            } else if (*pattern == '?') {
+                token.op = ONE;
+                pattern++;
+            } else {
+                token.op = LITERAL;
+                token.offset = textUsed;
+                token.length = 0;
+                while (*pattern && *pattern != '*' && *pattern != '?') {
+                    if (textUsed == sizeof(text) || token.length == 255) return false;
+                    text[textUsed++] = tolower((unsigned char)*pattern++);
+                    token.length++;
+                }
+            }
+            // Collapse runs of the same wildcard
+            if (count > 0 && token.op != LITERAL && token.op == tokens[count - 1].op && token.op != ONE) continue;
+            count++;
+        }
+        return true;
+    }
+
+    bool matches(const char* subject, size_t length) const {
+        if (substring) {
+            if (count == 0) return true;
+            for (const char* s = subject; s + tokens[0].length <= subject + length; s++) {
+                if (literalAt(tokens[0], s)) return true;
+            }
+            return false;
+        }
+        return matchFrom(0, subject, subject + length);
+    }
+
+    // The literal every match must start with, for prefix searches of a
+    // sorted name index; empty for substring and path patterns.
+    size_t prefix(const char*& literal) const {
+        if (substring || pathPattern || count == 0 || tokens[0].op != LITERAL) return 0;
+        literal = text + tokens[0].offset;
+        return tokens[0].length;
+    }
+
+    bool literalAt(const Token& token, const char* s) const {
+        for (uint8_t i = 0; i < token.length; i++) {
+            if (tolower((unsigned char)s[i]) != text[token.offset + i]) return false;
+        }
+        return true;
+    }
+
+    bool matchFrom(uint8_t t, const char* s, const char* end) const {
+        for (; t < count; t++) {
+            const Token& token = tokens[t];
+            switch (token.op) {
+            case LITERAL:
+                if (end - s < token.length || !literalAt(token, s)) return false;
+                s += token.length;
+                break;
+            case ONE:
+                if (s == end || *s == '/') return false;
+                s++;
+                break;
+            case STAR:
+                for (;; s++) {
+                    if (matchFrom(t + 1, s, end)) return true;
+                    if (s == end || *s == '/') return false;
+                }
+            case GLOBSTAR:
+                for (;; s++) {
+                    if (matchFrom(t + 1, s, end)) return true;
+                    if (s == end) return false;
+                }
+            case ANY_DIRS:
+                // Zero or more whole directories
+                if (matchFrom(t + 1, s, end)) return true;
+                for (; s < end; s++) {
+                    if (*s == '/' && matchFrom(t + 1, s + 1, end)) return true;
+                }
+                return false;
+            }
+        }
+        return s == end;
+    }
+};
+
+// Long commands run as jobs. loop() advances the active job in slices of at
+// most JOB_SLICE_MICROS between reading input, so the shell stays responsive:
+// `jobs`, `pause`, `resume` and `abort` control the job and cheap queries
+// still answer while it runs. step() does one bounded unit of work and
+// checks `aborted` itself, so a job only stops where that is safe. A job
+// that streams a transfer protocol is exclusive: it prints no progress and
+// everything but the control commands is ignored until it ends.
+struct Job {
+    const char* name;
+    bool exclusive;
+    bool paused = false;
+    bool aborted = false;
+    uint32_t startMillis, lastProgress;
+
+    Job(const char* name, bool exclusive) : name(name), exclusive(exclusive) {
+        startMillis = lastProgress = millis();
+    }
+    virtual ~Job() {}
+    // One unit of work; returns false once the job has finished or stopped.
+    virtual bool step() = 0;
+    // A line of progress, printed every JOB_PROGRESS_MILLIS by non-exclusive jobs.
+    virtual void progress() {}
+    // Reports the outcome once the job has ended.
+    virtual void finish() = 0;
+
+    uint32_t elapsed() const { return millis() - startMillis; }
+    String rate(unsigned long count) const {
+        return String(count * 1000.0 / max(elapsed(), 1UL), 0) + "/s";
+    }
+};
+Job* activeJob = nullptr;
+
+void startJob(Job* job) {
+    activeJob = job;
+    if (!job->exclusive) SerialUSB.println("Started " + String(job->name) + " ('pause', 'resume' or 'abort')");
+}
+
+void endJob() {
+    activeJob->finish();
+    perfCommand(activeJob->name, (uint64_t)activeJob->elapsed() * 1000);
+    delete activeJob;
+    activeJob = nullptr;
+    SerialUSB.print("\n> ");
+}
+
+void runJob() {
+    if (activeJob->paused) return;
+    uint32_t start = micros();
+    bool running = true;
+    while (running && micros() - start < JOB_SLICE_MICROS) running = activeJob->step();
+    if (!running) {
+        endJob();
+    } else if (!activeJob->exclusive && millis() - activeJob->lastProgress >= JOB_PROGRESS_MILLIS) {
+        activeJob->lastProgress = millis();
+        activeJob->progress();
+    }
+}
+
+// Handles job control commands; returns false for anything else.
+bool jobControl(const String& cmd) {
+    if (cmd != "jobs" && cmd != "pause" && cmd != "resume" && cmd != "abort") return false;
+    if (!activeJob) {
+        SerialUSB.println("No job running");
+        return true;
+    }
+    if (cmd == "pause") {
+        activeJob->paused = true;
+    } else if (cmd == "resume") {
+        activeJob->paused = false;
+    } else if (cmd == "abort") {
+        activeJob->aborted = true;
+        activeJob->paused = false;
+    }
+    if (activeJob->exclusive) return true;
+    SerialUSB.println(String(activeJob->name) + (activeJob->aborted ? " stopping" : activeJob->paused ? " paused" : " running") +
+                      ", " + String(activeJob->elapsed() / 1000.0, 1) + " s elapsed");
+    if (!activeJob->aborted) activeJob->progress();
+    return true;
+}
+
+// A yes/no question; the next input line answers it and `onYes` runs only
+// for 'y'. Nothing blocks while the answer is outstanding.
+struct PendingConfirm {
+    bool active = false;
+    std::function<void()> onYes;
+};
+PendingConfirm pendingConfirm;
+
+void confirmAction(const String& action, std::function<void()> onYes) {
+    SerialUSB.print("Are you sure you want to " + action + "? (y/N): ");
+    pendingConfirm.active = true;
+    pendingConfirm.onYes = onYes;
+}
+
+void answerConfirm(String response) {
+    std::function<void()> onYes = pendingConfirm.onYes;
+    pendingConfirm = PendingConfirm();
+    if (response.toLowerCase().startsWith("y")) onYes();
+    else SerialUSB.println("Cancelled");
+    if (!pendingConfirm.active && !(activeJob && activeJob->exclusive)) SerialUSB.print("\n> ");
+}
+
+// Free space comes from the volume's own cluster accounting: the FAT on
+// FAT16/FAT32, the allocation bitmap on exFAT. loop() counts it a few sectors
+// at a time while the device is idle and caches the result; write and delete
+// paths adjust the cached figure as they go and queue a recount, so `free`
+// answers at once even on large cards. Volumes whose tables cannot be read
+// directly fall back to SdFat's own (blocking) free cluster count, still only
+// in idle time.
+struct VolumeSpace {
+    uint8_t fatType = 0;
+    uint32_t clusters = 0, bytesPerCluster = 0;
+    uint32_t freeClusters = 0;
+    bool known = false;    // freeClusters holds a count, possibly adjusted since
+    bool pending = false;  // A recount is queued or under way
+    uint32_t firstSector = 0, sectors = 0;  // Table being counted; no sectors means fall back
+    uint32_t nextSector = 0, tally = 0;
+};
+VolumeSpace space;
+DMAMEM static uint8_t spaceBuffer[SPACE_SCAN_SECTORS * SD_SECTOR_SIZE] __attribute__((aligned(32)));
+
+uint32_t readLe32(const uint8_t* p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+uint32_t clustersFor(uint64_t size) {
+    if (!space.bytesPerCluster) return 0;
+    return (size + space.bytesPerCluster - 1) / space.bytesPerCluster;
+}
+
+// Finds the exFAT allocation bitmap: the boot record (at sector 0 or the start
+// of an MBR partition) names the root directory, whose 0x81 entry gives the
+// bitmap's first cluster and length. The bitmap is only read directly when
+// its FAT chain shows it to be contiguous, which is how formatters lay it out.
+bool locateBitmap(uint32_t& first, uint32_t& sectors) {
+    SdCard* card = SD.sdfs.card();
+    uint8_t* sector = spaceBuffer;
+    uint32_t starts[5] = {0};
+    size_t startCount = 1;
+    if (!card->readSector(0, sector)) return false;
+    for (int i = 0; i < 4; i++) {
+        uint32_t lba = readLe32(sector + 446 + 16 * i + 8);
+        if (lba) starts[startCount++] = lba;
+    }
+    for (size_t i = 0; i < startCount; i++) {
+        if (!card->readSector(starts[i], sector) || memcmp(sector + 3, "EXFAT   ", 8) != 0) continue;
+        if (starts[i] + readLe32(sector + 80) != SD.sdfs.fatStartSector() || sector[109] > 25) continue;
+        uint32_t fatStart = starts[i] + readLe32(sector + 80);
+        uint32_t heapStart = starts[i] + readLe32(sector + 88);
+        uint32_t rootCluster = readLe32(sector + 96);
+        uint32_t sectorsPerCluster = 1UL << sector[109];
+        uint32_t rootSector = heapStart + (rootCluster - 2) * sectorsPerCluster;
+
+        uint32_t bitmapCluster = 0;
+        uint64_t bitmapBytes = 0;
+        for (uint32_t s = 0; s < sectorsPerCluster && !bitmapCluster; s++) {
+            if (!card->readSector(rootSector + s, sector)) return false;
+            for (int e = 0; e < SD_SECTOR_SIZE; e += 32) {
+                if (sector[e] == 0x81 && (sector[e + 1] & 1) == 0) {
+                    bitmapCluster = readLe32(sector + e + 20);
+                    bitmapBytes = readLe32(sector + e + 24) | (uint64_t)readLe32(sector + e + 28) << 32;
+                    break;
+                }
+            }
+        }
+        uint32_t bitmapClusters = (bitmapBytes + sectorsPerCluster * SD_SECTOR_SIZE - 1) / (sectorsPerCluster * SD_SECTOR_SIZE);
+        if (bitmapCluster < 2 || bitmapBytes < (space.clusters + 7) / 8) return false;
+        for (uint32_t c = bitmapCluster; c < bitmapCluster + bitmapClusters; c++) {
+            if (!card->readSector(fatStart + c / (SD_SECTOR_SIZE / 4), sector)) return false;
+            uint32_t next = readLe32(sector + c % (SD_SECTOR_SIZE / 4) * 4);
+            bool last = c + 1 == bitmapCluster + bitmapClusters;
+            if (last ? next < 0xFFFFFFF8 : next != c + 1) return false;
+        }
+        first = heapStart + (bitmapCluster - 2) * sectorsPerCluster;
+        sectors = (space.clusters + 8UL * SD_SECTOR_SIZE - 1) / (8UL * SD_SECTOR_SIZE);
+        return true;
+    }
+    return false;
+}
+
+void spaceRecount() {
+    if (!space.bytesPerCluster) return;
+    space.pending = true;
+    space.nextSector = 0;
+    space.tally = 0;
+}
+
+// Called once the card is mounted; the first count runs from loop().
+void spaceBegin() {
+    space = VolumeSpace();
+    space.fatType = SD.sdfs.fatType();
+    space.clusters = SD.sdfs.clusterCount();
+    space.bytesPerCluster = SD.sdfs.bytesPerCluster();
+    if (space.fatType == 32 || space.fatType == 16) {
+        uint32_t entryBytes = space.fatType / 8;
+        space.firstSector = SD.sdfs.fatStartSector();
+        space.sectors = (((uint64_t)space.clusters + 2) * entryBytes + SD_SECTOR_SIZE - 1) / SD_SECTOR_SIZE;
+    } else if (space.fatType == FAT_TYPE_EXFAT && !locateBitmap(space.firstSector, space.sectors)) {
+        space.sectors = 0;
+    }
+    spaceRecount();
+}
+
+// Accounts a file going from oldSize to newSize bytes (0 when created or
+// removed) until the queued recount confirms it. Directories are charged as
+// one cluster, which a large directory's removal understates, so `free`
+// calls the figure approximate until the recount has finished.
+void spaceChanged(uint64_t oldSize, uint64_t newSize) {
+    if (!space.bytesPerCluster) return;
+    int64_t freed = (int64_t)clustersFor(oldSize) - clustersFor(newSize);
+    if (space.known) space.freeClusters = constrain((int64_t)space.freeClusters + freed, (int64_t)0, (int64_t)space.clusters);
+    spaceRecount();
+}
+
+// One slice of the recount, run from loop() when no command is waiting.
+void spaceIdle() {
+    if (!space.pending) return;
+    if (space.sectors == 0) {
+        uint32_t freeClusters = SD.sdfs.freeClusterCount();
+        if (freeClusters <= space.clusters) {
+            space.freeClusters = freeClusters;
+            space.known = true;
+        }
+        space.pending = false;
+        return;
+    }
+    uint32_t count = min((uint32_t)SPACE_SCAN_SECTORS, space.sectors - space.nextSector);
+    if (!SD.sdfs.card()->readSectors(space.firstSector + space.nextSector, spaceBuffer, count)) {
+        space.sectors = 0;  // Fall back on the next slice
+        return;
+    }
+    if (space.fatType == FAT_TYPE_EXFAT) {
+        // One bit per cluster from cluster 2, set when allocated
+        uint32_t bit = space.nextSector * SD_SECTOR_SIZE * 8;
+        for (uint32_t i = 0; i < count * SD_SECTOR_SIZE && bit < space.clusters; i++, bit += 8) {
+            uint8_t used = spaceBuffer[i];
+            if (space.clusters - bit < 8) used |= 0xFF << (space.clusters - bit);
+            space.tally += 8 - __builtin_popcount(used);
+        }
+    } else {
+        uint32_t entryBytes = space.fatType / 8;
+        uint32_t entry = space.nextSector * (SD_SECTOR_SIZE / entryBytes);
+        for (uint32_t i = 0; i < count * SD_SECTOR_SIZE; i += entryBytes, entry++) {
+            if (entry < 2) continue;
+            if (entry >= space.clusters + 2) break;
+            uint32_t value = entryBytes == 4 ? readLe32(spaceBuffer + i) & 0x0FFFFFFF : spaceBuffer[i] | spaceBuffer[i + 1] << 8;
+            if (value == 0) space.tally++;
+        }
+    }
+    space.nextSector += count;
+    if (space.nextSector >= space.sectors) {
+        space.freeClusters = space.tally;
+        space.known = true;
+        space.pending = false;
+    }
+}
 
 Error changeDirectory(const String& path) {
     String newPath = path.startsWith("/") ? path : currentPath + path;
@@ -66,7 +1054,7 @@ Error changeDirectory(const String& path) {
         return Error::NONE;
     }
     if (!newPath.endsWith("/")) newPath += "/";
-    File dir = SD.open(newPath.c_str());
+    File dir = PERF_TIMED(PERF_SD_OPEN, SD.open(newPath.c_str()));
     if (!dir) return Error::FILE_NOT_FOUND;
     if (!dir.isDirectory()) {
         dir.close();
@@ -77,44 +1065,42 @@ Error changeDirectory(const String& path) {
     return Error::NONE;
 }
 
-bool confirmAction(const String& action) {
-    SerialUSB.print("Are you sure you want to " + action + "? (y/N): ");
-    while (!SerialUSB.available()) {}
-    String response = SerialUSB.readStringUntil('\n');
-    return response.toLowerCase().startsWith("y");
+// Removes a file or an empty directory the caller has checked, keeping the
+// cache, the search index and the free space figure in step.
+bool deleteFile(const String& path, uint64_t size) {
+    cacheInvalidate(path);
+    if (!SD.remove(path.c_str())) return false;
+    indexJournal('-', path);
+    spaceChanged(size, 0);
+    return true;
+}
+
+bool deleteDirectory(const String& path) {
+    cacheInvalidate(path);
+    if (!SD.rmdir(path.c_str())) return false;
+    indexJournal('-', path);
+    spaceChanged(space.bytesPerCluster, 0);
+    return true;
 }
 
 Error removeFile(const String& path) {
-    File file = SD.open(path.c_str());
+    File file = PERF_TIMED(PERF_SD_OPEN, SD.open(path.c_str()));
     if (!file) return Error::FILE_NOT_FOUND;
     if (file.isDirectory()) {
         file.close();
         return Error::IS_DIRECTORY;
     }
+    uint64_t size = file.size();
     file.close();
-    if (!confirmAction("delete " + path)) return Error::NONE;
-    return SD.remove(path.c_str()) ? Error::NONE : Error::REMOVE_FAILED;
+    confirmAction("delete " + path, [path, size]() {
+        if (deleteFile(path, size)) SerialUSB.println("File removed successfully");
+        else SerialUSB.println("Error: Failed to remove file");
+    });
+    return Error::NONE;
 }
 
 
 
-unsigned long countFilesRecursive(File dir) {
-    unsigned long count = 0;
-    File entry = dir.openNextFile();
-    
-    while (entry) {
-        if (entry.isDirectory()) {
-            count += countFilesRecursive(entry);
-        } else {
-            count++;
-        }
-        entry.close();
-        entry = dir.openNextFile();
-    }
-    
-    return count;
-}
-
 // Add this helper function to get relative path
 String getRelativePath(const String& basePath, const String& fullPath) {
     if (fullPath.startsWith(basePath)) {
@@ -124,367 +1110,4022 @@ String getRelativePath(const String& basePath, const String& fullPath) {
 }
 
 Error removeDirectory(const String& path) {
-    File dir = SD.open(path.c_str());
+    File dir = PERF_TIMED(PERF_SD_OPEN, SD.open(path.c_str()));
     if (!dir) return Error::FILE_NOT_FOUND;
     if (!dir.isDirectory()) {
         dir.close();
         return Error::NOT_A_DIRECTORY;
     }
-    if (dir.openNextFile()) {
+    if (PERF_TIMED(PERF_SD_OPEN_NEXT, dir.openNextFile())) {
         dir.close();
         return Error::NOT_EMPTY;
     }
-    dir.close();
-    if (!confirmAction("remove directory " + path)) return Error::NONE;
-    return SD.rmdir(path.c_str()) ? Error::NONE : Error::REMOVE_FAILED;
+    dir.close();
+    confirmAction("remove directory " + path, [path]() {
+        if (deleteDirectory(path)) SerialUSB.println("Directory removed successfully");
+        else SerialUSB.println("Error: Failed to remove directory");
+    });
+    return Error::NONE;
+}
+
+void showFreeSpace() {
+    if (!space.bytesPerCluster) {
+        SerialUSB.println("Error: No card mounted");
+        return;
+    }
+    uint64_t totalSpace = (uint64_t)space.clusters * space.bytesPerCluster;
+    SerialUSB.println("\nSD Card Information:");
+    SerialUSB.println("-------------------");
+    SerialUSB.println("File System: " + (space.fatType == FAT_TYPE_EXFAT ? String("exFAT") : "FAT" + String(space.fatType)));
+    SerialUSB.println("Cluster Size: " + formatSize(space.bytesPerCluster));
+    SerialUSB.println("Total Size: " + formatSize(totalSpace));
+    if (!space.known) {
+        uint32_t done = space.sectors ? (uint64_t)space.nextSector * 100 / space.sectors : 0;
+        SerialUSB.println("Free Space: still counting (" + String(done) + "% done), try again shortly");
+        return;
+    }
+    uint64_t freeSpace = (uint64_t)space.freeClusters * space.bytesPerCluster;
+    SerialUSB.println("Used Space: " + formatSize(totalSpace - freeSpace));
+    SerialUSB.println("Free Space: " + formatSize(freeSpace) + (space.pending ? " (approximate, recounting)" : ""));
+}
+
+// Bulk transfers stage data in two sector-aligned blocks: while one waits
+// for the card to finish programming the previous write, USB fills the other.
+// Other commands borrow them as scratch space: ls (its sort heap), rpc
+// (responses, and sum's reads), find and the index journal (journal text,
+// index reads and compaction), index, grep, dupes, sum, tail, bench and
+// record's fallback ring. That is safe only because one job runs at a time
+// and jobInput() lets nothing but pwd, free, walkstats, stats and help run
+// beside it; a command added there must not touch ioBuffers.
+DMAMEM static uint8_t ioBuffers[2][IO_BLOCK_SIZE] __attribute__((aligned(32)));
+
+struct TransferStats {
+    uint64_t bytes = 0;
+    uint32_t startMicros = 0;
+    uint32_t totalMicros = 0;
+    uint32_t sdMicros = 0;       // Time spent inside SD reads/writes
+    uint32_t usbWaitMicros = 0;  // Time spent waiting for the USB link
+    uint64_t wireBytes = 0;      // Compressed size on the link, when compressing
+    uint32_t codecMicros = 0;    // Time spent compressing or decompressing
+};
+
+uint32_t crc32Update(uint32_t crc, const uint8_t* data, size_t length) {
+    static uint32_t table[256];
+    if (!table[1]) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    }
+    crc = ~crc;
+    while (length--) crc = table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+// Writes full IO_BLOCK_SIZE blocks only. FsFile::write blocks until the data
+// has gone to the card, so USB is not read during a write beyond what the USB
+// stack buffers. The overlap comes afterwards: while the card reports busy
+// programming that write, the next full block is held back and the caller
+// keeps pulling from USB into the other buffer.
+struct BlockWriter {
+    FsFile& file;
+    TransferStats& stats;
+    uint8_t fillIndex = 0;
+    size_t fillLength = 0;
+    int8_t pendingIndex = -1;
+    size_t pendingLength = 0;
+    bool failed = false;
+
+    BlockWriter(FsFile& f, TransferStats& s) : file(f), stats(s) {}
+
+    // Free space in the block being filled, or nullptr while both blocks are full.
+    uint8_t* space(size_t& room) {
+        room = IO_BLOCK_SIZE - fillLength;
+        return room > 0 ? ioBuffers[fillIndex] + fillLength : nullptr;
+    }
+
+    void commit(size_t count) {
+        fillLength += count;
+        stats.bytes += count;
+    }
+
+    bool append(const uint8_t* data, size_t count) {
+        while (count > 0) {
+            size_t room;
+            uint8_t* dst = space(room);
+            if (!dst) {
+                if (!poll()) return false;
+                continue;
+            }
+            size_t chunk = min(room, count);
+            memcpy(dst, data, chunk);
+            commit(chunk);
+            data += chunk;
+            count -= chunk;
+        }
+        return poll();
+    }
+
+    bool writePending() {
+        uint32_t start = micros();
+        size_t written = PERF_TIMED(PERF_SD_WRITE, file.write(ioBuffers[pendingIndex], pendingLength));
+        stats.sdMicros += micros() - start;
+        failed = written != pendingLength;
+        pendingIndex = -1;
+        return !failed;
+    }
+
+    // Issues the held-back block once the card is idle, then rotates a full
+    // fill block into its place.
+    bool poll() {
+        if (pendingIndex >= 0 && !file.isBusy() && !writePending()) return false;
+        if (fillLength == IO_BLOCK_SIZE && pendingIndex < 0) {
+            pendingIndex = fillIndex;
+            pendingLength = fillLength;
+            fillIndex ^= 1;
+            fillLength = 0;
+        }
+        return !failed;
+    }
+
+    bool finish() {
+        if (pendingIndex >= 0 && !writePending()) return false;
+        if (fillLength > 0) {
+            pendingIndex = fillIndex;
+            pendingLength = fillLength;
+            fillLength = 0;
+            if (!writePending()) return false;
+        }
+        return true;
+    }
+};
+
+// Receives `size` bytes from USB into an open file. Bytes accumulate in
+// stats, so one TransferStats can span many files; `crc`, if given, is
+// updated with everything received.
+Error receiveStream(FsFile& file, uint64_t size, TransferStats& stats, uint32_t* crc = nullptr) {
+    BlockWriter writer(file, stats);
+    uint64_t end = stats.bytes + size;
+    uint32_t lastData = millis();
+    while (stats.bytes < end) {
+        size_t room;
+        uint8_t* dst = writer.space(room);
+        uint32_t pollStart = micros();
+        int available = SerialUSB.available();
+        if (dst && available > 0) {
+            size_t want = min(min(room, (size_t)available), (size_t)(end - stats.bytes));
+            size_t got = PERF_TIMED(PERF_USB_READ, SerialUSB.readBytes((char*)dst, want));
+            if (crc) *crc = crc32Update(*crc, dst, got);
+            writer.commit(got);
+            lastData = millis();
+        } else if (dst) {
+            if (millis() - lastData > SERIAL_TIMEOUT) {
+                writer.finish();
+                return Error::TIMEOUT;
+            }
+            yield();
+            stats.usbWaitMicros += micros() - pollStart;
+        }
+        if (!writer.poll()) return Error::WRITE_FAILED;
+    }
+    return writer.finish() ? Error::NONE : Error::WRITE_FAILED;
+}
+
+// Streams `size` bytes of an open file to USB. Writes are sized to
+// availableForWrite() so they never block; whenever the USB side is full the
+// next block is read from the card instead, overlapping the SD read with the
+// transmission of the current block. A short read is padded with zeros so the
+// host still receives exactly `size` bytes, and reported as READ_FAILED.
+Error sendStream(FsFile& file, uint64_t size, TransferStats& stats, uint32_t* crc = nullptr) {
+    size_t length[2] = {0, 0};
+    uint8_t current = 0;
+    size_t sent = 0;
+    uint64_t unread = size;
+    bool readFailed = false;
+    auto readBlock = [&](uint8_t index) {
+        size_t want = min((uint64_t)IO_BLOCK_SIZE, unread);
+        uint32_t start = micros();
+        int got = readFailed ? 0 : PERF_TIMED(PERF_SD_READ, file.read(ioBuffers[index], want));
+        stats.sdMicros += micros() - start;
+        if (got < (int)want) {
+            readFailed = true;
+            got = max(got, 0);
+            memset(ioBuffers[index] + got, 0, want - got);
+        }
+        if (crc) *crc = crc32Update(*crc, ioBuffers[index], want);
+        length[index] = want;
+        unread -= want;
+    };
+
+    if (unread) readBlock(current);
+    uint32_t lastProgress = millis();
+    while (length[current] > 0) {
+        uint32_t pollStart = micros();
+        int room = SerialUSB.availableForWrite();
+        if (room > 0) {
+            size_t chunk = min((size_t)room, length[current] - sent);
+            PERF_TIMED(PERF_USB_WRITE, SerialUSB.write(ioBuffers[current] + sent, chunk));
+            sent += chunk;
+            stats.bytes += chunk;
+            lastProgress = millis();
+            if (sent == length[current]) {
+                length[current] = 0;
+                sent = 0;
+                current ^= 1;
+                if (!length[current] && unread) readBlock(current);
+            }
+        } else if (!length[current ^ 1] && unread) {
+            readBlock(current ^ 1);
+        } else {
+            if (millis() - lastProgress > SERIAL_TIMEOUT) return Error::TIMEOUT;
+            yield();
+            stats.usbWaitMicros += micros() - pollStart;
+        }
+    }
+    return readFailed ? Error::READ_FAILED : Error::NONE;
+}
+
+// Bytes per microsecond is MB/s (10^6 bytes). A transfer is SD-bound when
+// the card accounts for more than half of the wall time.
+void printTransferStats(const TransferStats& stats) {
+    uint32_t elapsed = max(stats.totalMicros, 1UL);
+    SerialUSB.printf("  %.2f MB/s overall in %lu ms", (double)stats.bytes / elapsed, (unsigned long)(elapsed / 1000));
+    if (stats.sdMicros > 0) SerialUSB.printf(", SD %.2f MB/s", (double)stats.bytes / stats.sdMicros);
+    if (stats.codecMicros > 0) {
+        SerialUSB.printf(", LZ4 %.2fx at %.2f MB/s", (double)stats.bytes / max(stats.wireBytes, (uint64_t)1),
+                         (double)stats.bytes / stats.codecMicros);
+    }
+    uint32_t busiest = max(stats.sdMicros, stats.codecMicros);
+    SerialUSB.printf(", USB wait %lu ms -> %s-bound\r\n", (unsigned long)(stats.usbWaitMicros / 1000),
+                     busiest * 2 <= elapsed ? "USB" : busiest == stats.sdMicros ? "SD" : "CPU");
+}
+
+// Framed sync protocol. Every frame is
+//   magic(1) type(1) seq(2) length(2) payload(length) crc32(4)
+// little-endian, with the CRC covering header and payload. The host keeps up
+// to FRAME_WINDOW frames in flight; the device buffers out-of-order frames and
+// cumulatively ACKs delivery. A NAK carries the next expected sequence number
+// and a bitmap of the frames still missing from the window, so only damaged
+// or lost frames are resent.
+enum class Frame : uint8_t { FILE_BEGIN = 1, DATA, FILE_END, SYNC_END, ACK = 0x10, NAK, ABORT };
+enum class FrameStatus { PENDING, GOOD, BAD };
+
+struct FrameReader {
+    uint8_t buffer[FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD + 4];
+    size_t have = 0;
+    size_t need = 1;
+
+    Frame type() const { return (Frame)buffer[1]; }
+    uint16_t seq() const { return buffer[2] | buffer[3] << 8; }
+    uint16_t length() const { return buffer[4] | buffer[5] << 8; }
+    const uint8_t* payload() const { return buffer + FRAME_HEADER_SIZE; }
+
+    FrameStatus poll() {
+        int available = SerialUSB.available();
+        if (available <= 0) return FrameStatus::PENDING;
+        if (have == 0) {
+            if (SerialUSB.read() == FRAME_MAGIC) {
+                buffer[have++] = FRAME_MAGIC;
+                need = FRAME_HEADER_SIZE;
+            }
+            return FrameStatus::PENDING;
+        }
+        have += PERF_TIMED(PERF_USB_READ, SerialUSB.readBytes((char*)buffer + have, min((size_t)available, need - have)));
+        if (have < need) return FrameStatus::PENDING;
+        if (need == FRAME_HEADER_SIZE) {
+            if (length() > FRAME_MAX_PAYLOAD) {
+                have = 0;  // Corrupt header, hunt for the next magic byte
+                return FrameStatus::BAD;
+            }
+            need = FRAME_HEADER_SIZE + length() + 4;
+            return FrameStatus::PENDING;
+        }
+        have = 0;
+        const uint8_t* crc = buffer + need - 4;
+        uint32_t expected = crc[0] | crc[1] << 8 | crc[2] << 16 | (uint32_t)crc[3] << 24;
+        return crc32Update(0, buffer, need - 4) == expected ? FrameStatus::GOOD : FrameStatus::BAD;
+    }
+};
+
+struct FrameSlot {
+    bool full;
+    Frame type;
+    uint16_t length;
+    uint8_t data[FRAME_MAX_PAYLOAD];
+};
+
+DMAMEM static FrameSlot frameSlots[FRAME_WINDOW];
+
+void sendFrame(Frame type, uint16_t seq, const uint8_t* payload = nullptr, uint16_t length = 0) {
+    uint8_t header[FRAME_HEADER_SIZE] = {FRAME_MAGIC, (uint8_t)type, (uint8_t)seq, (uint8_t)(seq >> 8),
+                                         (uint8_t)length, (uint8_t)(length >> 8)};
+    uint32_t crc = crc32Update(crc32Update(0, header, sizeof(header)), payload, length);
+    uint8_t trailer[4] = {(uint8_t)crc, (uint8_t)(crc >> 8), (uint8_t)(crc >> 16), (uint8_t)(crc >> 24)};
+    PERF_TIMED(PERF_USB_WRITE, SerialUSB.write(header, sizeof(header)));
+    if (length) PERF_TIMED(PERF_USB_WRITE, SerialUSB.write(payload, length));
+    PERF_TIMED(PERF_USB_WRITE, SerialUSB.write(trailer, sizeof(trailer)));
+    SerialUSB.send_now();
+}
+
+void sendAbort(const String& message) {
+    sendFrame(Frame::ABORT, 0, (const uint8_t*)message.c_str(), message.length());
+}
+
+// Creates `path` and any missing parents one level at a time, so the index
+// journal and the free space figure account for every directory made.
+bool makeDirectories(String path) {
+    while (path.length() > 1 && path.endsWith("/")) path.remove(path.length() - 1);
+    if (path.length() == 0 || SD.sdfs.exists(path.c_str())) return true;
+    int slash = path.lastIndexOf('/');
+    if (slash > 0 && !makeDirectories(path.substring(0, slash))) return false;
+    if (!SD.sdfs.mkdir(path.c_str(), false)) return false;
+    indexJournal('D', path);
+    spaceChanged(0, space.bytesPerCluster);
+    return true;
+}
+
+bool ensureParentDirectory(const String& path) {
+    int slash = path.lastIndexOf('/');
+    if (slash <= 0) return true;
+    return makeDirectories(path.substring(0, slash));
+}
+
+// Opens `path` to be rewritten from scratch, moving the free-space figure
+// from whatever the file held before to its new size. A file of more than one
+// cluster has its whole extent reserved up front, contiguous where the card
+// has a long enough free run, so BlockWriter's blocks go down without a FAT
+// update at every cluster boundary; closeReceived() gives back whatever an
+// aborted transfer left unused.
+FsFile createFile(const String& path, uint64_t size) {
+    FsFile file = PERF_TIMED(PERF_SD_OPEN, SD.sdfs.open(path.c_str(), O_WRONLY | O_CREAT));
+    if (!file) return file;
+    uint64_t previous = file.fileSize();
+    if (previous && !file.truncate(0)) {
+        file.close();
+        return file;
+    }
+    spaceChanged(previous, size);
+    if (size > space.bytesPerCluster) file.preAllocate(size);  // Without a free run that long the file just grows
+    return file;
+}
+
+// Closes a file opened by createFile() for `size` bytes and journals it at
+// the size it ended up with. A transfer that stopped short leaves the file
+// cut at what was written, with the rest of the reserved extent released.
+void closeReceived(FsFile& file, const String& path, uint64_t size) {
+    uint64_t written = file.curPosition();
+    if (written < size && file.truncate(written)) spaceChanged(size, written);
+    indexJournal('F', path, file.fileSize());
+    file.close();
+}
+
+struct FramedSession {
+    const String& root;
+    FsFile file;
+    String path;
+    TransferStats stats;
+    BlockWriter writer;
+    uint32_t fileSize = 0;
+    uint64_t fileStartBytes = 0;
+    unsigned long files = 0;
+    bool done = false;
+
+    FramedSession(const String& r) : root(r), writer(file, stats) {}
+};
+
+// Applies one in-order frame to the session.
+Error deliverFrame(FramedSession& session, Frame type, const uint8_t* payload, uint16_t length) {
+    switch (type) {
+    case Frame::FILE_BEGIN: {
+        if (length < 5 || session.file) return Error::PROTOCOL;
+        session.fileSize = payload[0] | payload[1] << 8 | payload[2] << 16 | (uint32_t)payload[3] << 24;
+        session.path = session.root;
+        session.path.concat((const char*)payload + 4, length - 4);  // Relative path, already '/'-prefixed
+        if (!ensureParentDirectory(session.path)) return Error::INVALID_PATH;
+        session.file = createFile(session.path, session.fileSize);
+        if (!session.file) return Error::FILE_NOT_FOUND;
+        session.fileStartBytes = session.stats.bytes;
+        return Error::NONE;
+    }
+    case Frame::DATA:
+        if (!session.file) return Error::PROTOCOL;
+        return session.writer.append(payload, length) ? Error::NONE : Error::WRITE_FAILED;
+    case Frame::FILE_END: {
+        if (!session.file) return Error::PROTOCOL;
+        bool ok = session.writer.finish();
+        closeReceived(session.file, session.path, session.fileSize);
+        if (!ok) return Error::WRITE_FAILED;
+        if (session.stats.bytes - session.fileStartBytes != session.fileSize) return Error::PROTOCOL;
+        session.files++;
+        return Error::NONE;
+    }
+    case Frame::SYNC_END:
+        if (session.file) return Error::PROTOCOL;
+        session.done = true;
+        return Error::NONE;
+    default:
+        return Error::PROTOCOL;
+    }
+}
+
+Error receiveFramed(const String& root) {
+    SerialUSB.println("MODE_OK:FRAMED " + String(FRAME_WINDOW) + " " + String(FRAME_MAX_PAYLOAD));
+    for (auto& slot : frameSlots) slot.full = false;
+    static FrameReader reader;
+    reader.have = 0;
+    FramedSession session(root);
+    session.stats.startMicros = micros();
+    uint16_t expected = 0;
+    uint16_t highest = 0;  // Furthest sequence number buffered out of order
+    uint16_t unacked = 0;
+    unsigned long resendRequests = 0;
+    uint32_t lastData = millis();
+    uint32_t lastNak = 0;
+    auto framesAhead = [&]() -> uint16_t {
+        uint16_t ahead = highest - expected;
+        return ahead < FRAME_WINDOW ? ahead : 0;
+    };
+    auto requestResend = [&]() {
+        if (millis() - lastNak < FRAME_NAK_INTERVAL) return;
+        uint16_t ahead = framesAhead();
+        uint32_t missing = 0;
+        for (uint16_t i = 0; i <= ahead; i++) {
+            if (!frameSlots[(uint16_t)(expected + i) % FRAME_WINDOW].full) missing |= 1UL << i;
+        }
+        uint8_t bitmap[4] = {(uint8_t)missing, (uint8_t)(missing >> 8), (uint8_t)(missing >> 16), (uint8_t)(missing >> 24)};
+        sendFrame(Frame::NAK, expected, bitmap, sizeof(bitmap));
+        lastNak = millis();
+        resendRequests++;
+    };
+
+    while (!session.done) {
+        if (SerialUSB.available()) lastData = millis();
+        FrameStatus status = reader.poll();
+        if (status == FrameStatus::PENDING) {
+            if (!SerialUSB.available()) {
+                if (unacked) {
+                    sendFrame(Frame::ACK, expected);
+                    unacked = 0;
+                }
+                uint32_t idle = millis() - lastData;
+                if (idle > SERIAL_TIMEOUT) {
+                    if (session.file) closeReceived(session.file, session.path, session.fileSize);
+                    sendAbort("timeout");
+                    return Error::TIMEOUT;
+                }
+                if (idle > FRAME_STALL_TIMEOUT && (reader.have > 0 || framesAhead() > 0)) {
+                    reader.have = 0;  // A corrupt length may be waiting on bytes that never come
+                    requestResend();
+                }
+                if (!session.writer.poll()) {
+                    closeReceived(session.file, session.path, session.fileSize);
+                    sendAbort("SD write failed");
+                    return Error::WRITE_FAILED;
+                }
+            }
+            continue;
+        }
+        if (status == FrameStatus::BAD) {
+            requestResend();
+            continue;
+        }
+        uint16_t distance = reader.seq() - expected;
+        if (distance >= FRAME_WINDOW) {
+            sendFrame(Frame::ACK, expected);  // Duplicate of a delivered frame, our ACK was lost
+            continue;
+        }
+        if (distance > 0) {
+            if (distance > framesAhead()) highest = reader.seq();
+            FrameSlot& slot = frameSlots[reader.seq() % FRAME_WINDOW];
+            if (!slot.full) {
+                slot.full = true;
+                slot.type = reader.type();
+                slot.length = reader.length();
+                memcpy(slot.data, reader.payload(), reader.length());
+            }
+            requestResend();
+            continue;
+        }
+        frameSlots[expected % FRAME_WINDOW].full = false;
+        Error err = deliverFrame(session, reader.type(), reader.payload(), reader.length());
+        expected++;
+        while (err == Error::NONE && frameSlots[expected % FRAME_WINDOW].full) {
+            FrameSlot& slot = frameSlots[expected % FRAME_WINDOW];
+            slot.full = false;
+            err = deliverFrame(session, slot.type, slot.data, slot.length);
+            expected++;
+        }
+        if (err != Error::NONE) {
+            if (session.file) closeReceived(session.file, session.path, session.fileSize);
+            sendAbort(err == Error::WRITE_FAILED ? "SD write failed" : "bad frame sequence");
+            return err;
+        }
+        if (++unacked >= FRAME_WINDOW / 2 || session.done) {
+            sendFrame(Frame::ACK, expected);
+            unacked = 0;
+        }
+    }
+    session.stats.totalMicros = micros() - session.stats.startMicros;
+    SerialUSB.println("\nSynced " + String(session.files) + " files, " + formatSize(session.stats.bytes) +
+                      ", " + String(resendRequests) + " resend requests");
+    printTransferStats(session.stats);
+    return Error::NONE;
+}
+
+// LZ4 block format, used per LZ4_BLOCK_SIZE block inside bundles. Each
+// sequence is a token (literal length << 4 | match length - 4), extra length
+// bytes, the literals, a 2-byte match offset and extra match length bytes;
+// the last sequence carries literals only.
+static_assert(LZ4_BLOCK_SIZE <= 65536, "LZ4 hash table stores 16-bit block offsets");
+DMAMEM static uint8_t lz4Raw[LZ4_BLOCK_SIZE] __attribute__((aligned(32)));
+DMAMEM static uint8_t lz4Wire[LZ4_BLOCK_SIZE] __attribute__((aligned(32)));
+
+static uint8_t* lz4WriteLength(uint8_t* out, size_t length) {
+    if (length < 15) return out;
+    for (length -= 15; length >= 255; length -= 255) *out++ = 255;
+    *out++ = length;
+    return out;
+}
+
+static uint32_t lz4Read32(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+// Returns the compressed size, or 0 if it would not fit in `capacity`.
+size_t lz4Compress(const uint8_t* src, size_t length, uint8_t* dst, size_t capacity) {
+    static uint16_t table[1 << LZ4_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    const uint8_t* const end = src + length;
+    const uint8_t* anchor = src;
+    uint8_t* out = dst;
+    uint8_t* const outEnd = dst + capacity;
+
+    if (length >= 13) {
+        const uint8_t* const matchLimit = end - 5;    // The last 5 bytes are always literals
+        const uint8_t* const searchLimit = end - 12;  // and the last match starts 12 bytes before the end
+        const uint8_t* in = src;
+        while (in < searchLimit) {
+            uint32_t sequence = lz4Read32(in);
+            uint32_t hash = (sequence * 2654435761U) >> (32 - LZ4_HASH_BITS);
+            const uint8_t* match = src + table[hash];
+            table[hash] = in - src;
+            if (match >= in || lz4Read32(match) != sequence) {
+                in += 1 + ((in - anchor) >> 6);  // Skip faster through data that does not compress
+                continue;
+            }
+            while (in > anchor && match > src && in[-1] == match[-1]) {
+                in--;
+                match--;
+            }
+            const uint8_t* matchEnd = in + 4;
+            for (const uint8_t* ref = match + 4; matchEnd < matchLimit && *matchEnd == *ref; ref++) matchEnd++;
+
+            size_t literalLength = in - anchor;
+            size_t matchLength = matchEnd - in - 4;
+            if (out + literalLength + literalLength / 255 + matchLength / 255 + 5 > outEnd) return 0;
+            *out++ = min(literalLength, (size_t)15) << 4 | min(matchLength, (size_t)15);
+            out = lz4WriteLength(out, literalLength);
+            memcpy(out, anchor, literalLength);
+            out += literalLength;
+            uint16_t offset = in - match;
+            *out++ = offset;
+            *out++ = offset >> 8;
+            out = lz4WriteLength(out, matchLength);
+            in = anchor = matchEnd;
+        }
+    }
+
+    size_t literalLength = end - anchor;
+    if (out + literalLength + literalLength / 255 + 2 > outEnd) return 0;
+    *out++ = min(literalLength, (size_t)15) << 4;
+    out = lz4WriteLength(out, literalLength);
+    memcpy(out, anchor, literalLength);
+    return out + literalLength - dst;
+}
+
+// Returns the decompressed size, or -1 if the block is malformed.
+int lz4Decompress(const uint8_t* src, size_t length, uint8_t* dst, size_t capacity) {
+    const uint8_t* in = src;
+    const uint8_t* const end = src + length;
+    uint8_t* out = dst;
+    uint8_t* const outEnd = dst + capacity;
+    auto readLength = [&](size_t& value) {
+        if (value < 15) return true;
+        uint8_t extra;
+        do {
+            if (in >= end) return false;
+            extra = *in++;
+            value += extra;
+        } while (extra == 255);
+        return true;
+    };
+
+    while (in < end) {
+        uint8_t token = *in++;
+        size_t literalLength = token >> 4;
+        if (!readLength(literalLength)) return -1;
+        if (literalLength > (size_t)(end - in) || literalLength > (size_t)(outEnd - out)) return -1;
+        memcpy(out, in, literalLength);
+        out += literalLength;
+        in += literalLength;
+        if (in == end) break;
+
+        if (end - in < 2) return -1;
+        size_t offset = in[0] | in[1] << 8;
+        in += 2;
+        size_t matchLength = token & 15;
+        if (!readLength(matchLength)) return -1;
+        matchLength += 4;
+        if (offset == 0 || offset > (size_t)(out - dst) || matchLength > (size_t)(outEnd - out)) return -1;
+        const uint8_t* ref = out - offset;
+        if (offset >= matchLength) {
+            memcpy(out, ref, matchLength);
+            out += matchLength;
+        } else {
+            while (matchLength--) *out++ = *ref++;  // Overlapping copy repeats the pattern
+        }
+    }
+    return out - dst;
+}
+
+// Bundle transport: a whole tree as one continuous stream of entries, each a
+// BUNDLE_HEADER_SIZE header
+//   type(1) path length(2) size(8)
+// followed by the '/'-prefixed relative path and, for files, `size` bytes of
+// data. Nothing is acknowledged per entry, USB flow control paces the sender.
+// The END entry carries the CRC-32 of every byte before it in its size field;
+// ABORTED ends the stream early, in the same form, when the job is aborted.
+// A COMPRESSED file's data is a series of LZ4_BLOCK_SIZE blocks, each sent as
+// a u32 length (bit 31 set: stored raw) and the LZ4 block; `size` is the
+// decompressed file size.
+enum class BundleEntry : uint8_t { FILE_DATA = 'F', COMPRESSED = 'Z', DIRECTORY = 'D', READ_ERROR = 'X', END = 'E', ABORTED = 'A' };
+#define BUNDLE_BLOCK_STORED 0x80000000UL
+
+void packBundleHeader(uint8_t* header, BundleEntry type, uint16_t pathLength, uint64_t size) {
+    header[0] = (uint8_t)type;
+    header[1] = pathLength;
+    header[2] = pathLength >> 8;
+    for (int i = 0; i < 8; i++) header[3 + i] = size >> (8 * i);
+}
+
+bool readExact(uint8_t* buffer, size_t length) {
+    uint32_t lastData = millis();
+    while (length > 0) {
+        int available = SerialUSB.available();
+        if (available > 0) {
+            size_t got = PERF_TIMED(PERF_USB_READ, SerialUSB.readBytes((char*)buffer, min((size_t)available, length)));
+            buffer += got;
+            length -= got;
+            lastData = millis();
+        } else if (millis() - lastData > SERIAL_TIMEOUT) {
+            return false;
+        } else {
+            yield();
+        }
+    }
+    return true;
+}
+
+// Swallows whatever the host still has in flight after an aborted stream so
+// it is not parsed as commands.
+void discardInput(uint32_t quietMillis) {
+    uint8_t scratch[64];
+    uint32_t lastData = millis();
+    while (millis() - lastData < quietMillis) {
+        int available = SerialUSB.available();
+        if (available > 0) {
+            SerialUSB.readBytes((char*)scratch, min((size_t)available, sizeof(scratch)));
+            lastData = millis();
+        } else {
+            yield();
+        }
+    }
+}
+
+Error receiveCompressed(FsFile& file, uint64_t size, TransferStats& stats, uint32_t& crc) {
+    BlockWriter writer(file, stats);
+    for (uint64_t remaining = size; remaining > 0;) {
+        uint32_t raw = min((uint64_t)LZ4_BLOCK_SIZE, remaining);
+        uint8_t prefix[4];
+        if (!readExact(prefix, sizeof(prefix))) return Error::TIMEOUT;
+        uint32_t word = prefix[0] | prefix[1] << 8 | prefix[2] << 16 | (uint32_t)prefix[3] << 24;
+        uint32_t length = word & ~BUNDLE_BLOCK_STORED;
+        bool stored = word & BUNDLE_BLOCK_STORED;
+        if (length > raw || (stored && length != raw)) return Error::PROTOCOL;
+        if (!readExact(lz4Wire, length)) return Error::TIMEOUT;
+        crc = crc32Update(crc32Update(crc, prefix, sizeof(prefix)), lz4Wire, length);
+        stats.wireBytes += sizeof(prefix) + length;
+
+        const uint8_t* data = lz4Wire;
+        if (!stored) {
+            uint32_t start = micros();
+            int decoded = lz4Decompress(lz4Wire, length, lz4Raw, raw);
+            stats.codecMicros += micros() - start;
+            if (decoded != (int)raw) return Error::PROTOCOL;
+            data = lz4Raw;
+        }
+        if (!writer.append(data, raw)) return Error::WRITE_FAILED;
+        remaining -= raw;
+    }
+    return writer.finish() ? Error::NONE : Error::WRITE_FAILED;
+}
+
+// Sends a file as LZ4 blocks. Once a block compresses by less than 10% the
+// rest of the file is stored raw, so incompressible data costs no CPU.
+Error sendCompressed(FsFile& file, uint64_t size, TransferStats& stats, uint32_t& crc) {
+    bool compress = true, readFailed = false;
+    for (uint64_t remaining = size; remaining > 0;) {
+        uint32_t raw = min((uint64_t)LZ4_BLOCK_SIZE, remaining);
+        uint32_t start = micros();
+        int got = readFailed ? 0 : PERF_TIMED(PERF_SD_READ, file.read(lz4Raw, raw));
+        stats.sdMicros += micros() - start;
+        if (got < (int)raw) {
+            readFailed = true;
+            got = max(got, 0);
+            memset(lz4Raw + got, 0, raw - got);
+        }
+
+        size_t length = 0;
+        if (compress) {
+            start = micros();
+            length = lz4Compress(lz4Raw, raw, lz4Wire, raw - 1);
+            stats.codecMicros += micros() - start;
+            compress = length > 0 && length * 10 <= raw * 9;
+        }
+        uint32_t word = length ? length : raw | BUNDLE_BLOCK_STORED;
+        const uint8_t* data = length ? lz4Wire : lz4Raw;
+        if (!length) length = raw;
+        uint8_t prefix[4] = {(uint8_t)word, (uint8_t)(word >> 8), (uint8_t)(word >> 16), (uint8_t)(word >> 24)};
+        crc = crc32Update(crc32Update(crc, prefix, sizeof(prefix)), data, length);
+
+        start = micros();
+        PERF_TIMED(PERF_USB_WRITE, SerialUSB.write(prefix, sizeof(prefix)));
+        if (PERF_TIMED(PERF_USB_WRITE, SerialUSB.write(data, length)) != length) return Error::TIMEOUT;
+        stats.usbWaitMicros += micros() - start;
+        stats.wireBytes += sizeof(prefix) + length;
+        stats.bytes += raw;
+        remaining -= raw;
+    }
+    return readFailed ? Error::READ_FAILED : Error::NONE;
+}
+
+// Unpacks a bundle from the host into `root` as it arrives. The reply
+// advertises LZ4 support; the host decides per file whether to compress.
+Error receiveBundle(const String& root) {
+    SerialUSB.println("MODE_OK:BUNDLE LZ4 " + String(LZ4_BLOCK_SIZE));
+    TransferStats stats;
+    stats.startMicros = micros();
+    uint32_t crc = 0;
+    unsigned long files = 0;
+    uint8_t header[BUNDLE_HEADER_SIZE];
+    char relative[BUNDLE_PATH_MAX];
+    Error err = Error::NONE;
+    while (err == Error::NONE) {
+        if (!readExact(header, sizeof(header))) {
+            err = Error::TIMEOUT;
+            break;
+        }
+        BundleEntry type = (BundleEntry)header[0];
+        uint16_t pathLength = header[1] | header[2] << 8;
+        uint64_t size = 0;
+        for (int i = 7; i >= 0; i--) size = size << 8 | header[3 + i];
+        if (type == BundleEntry::END) {
+            if ((uint32_t)size != crc) err = Error::PROTOCOL;
+            break;
+        }
+        crc = crc32Update(crc, header, sizeof(header));
+        if (pathLength == 0 || pathLength >= sizeof(relative)) {
+            err = Error::PROTOCOL;
+            break;
+        }
+        if (!readExact((uint8_t*)relative, pathLength)) {
+            err = Error::TIMEOUT;
+            break;
+        }
+        crc = crc32Update(crc, (const uint8_t*)relative, pathLength);
+        relative[pathLength] = '\0';
+        String path = root + relative;
+
+        if (type == BundleEntry::DIRECTORY) {
+            if (!makeDirectories(path)) err = Error::INVALID_PATH;
+        } else if (type == BundleEntry::FILE_DATA || type == BundleEntry::COMPRESSED) {
+            if (!ensureParentDirectory(path)) {
+                err = Error::INVALID_PATH;
+                break;
+            }
+            FsFile file = createFile(path, size);
+            if (!file) {
+                err = Error::FILE_NOT_FOUND;
+                break;
+            }
+            err = type == BundleEntry::COMPRESSED ? receiveCompressed(file, size, stats, crc)
+                                                  : receiveStream(file, size, stats, &crc);
+            closeReceived(file, path, size);
+            files++;
+        } else {
+            err = Error::PROTOCOL;
+        }
+    }
+    stats.totalMicros = micros() - stats.startMicros;
+
+    if (err != Error::NONE) {
+        const char* reason = err == Error::TIMEOUT ? "timeout"
+                           : err == Error::WRITE_FAILED ? "SD write failed"
+                           : err == Error::PROTOCOL ? "corrupt bundle"
+                           : "unable to create path";
+        SerialUSB.println("Error: Bundle aborted after " + String(files) + " files: " + reason);
+        discardInput(4 * FRAME_STALL_TIMEOUT);
+        return err;
+    }
+    SerialUSB.println("\nSynced " + String(files) + " files, " + formatSize(stats.bytes));
+    printTransferStats(stats);
+    return Error::NONE;
+}
+
+// downloaddir protocol: "DIR_BEGIN", then per file "FILE:<relative path>",
+// "<size>", the raw bytes and "FILE_DONE" (or "FILE_ERROR" if the card failed
+// mid-file), and finally "DIR_DONE:<file count>". The tree is walked once, so
+// the count comes as a trailer; when the metadata cache already holds the
+// tree, "DIR_COUNT:<n>" replaces DIR_BEGIN so the host can show progress.
+// With --bundle [--lz4] the tree is packed into a bundle on the fly instead,
+// and a file the card fails to read is followed by a READ_ERROR entry.
+//
+// Each step sends one entry header or up to JOB_SLICE_BYTES of a file; an
+// abort takes effect between files, so the host always sees whole entries.
+struct SendTreeJob : Job {
+    TreeWalker walker;
+    bool bundle, compress;
+    TransferStats stats;
+    uint32_t crc = 0;
+    uint64_t remaining = 0;
+    bool inFile = false, fileFailed = false;
+    Error err = Error::NONE;
+    unsigned long fileCount = 0, failedFiles = 0;
+
+    SendTreeJob(bool bundle, bool compress) : Job("downloaddir", true), bundle(bundle), compress(compress) {
+        stats.startMicros = micros();
+    }
+
+    void sendEntry(BundleEntry type, const char* relative, size_t length, uint64_t size) {
+        uint8_t header[BUNDLE_HEADER_SIZE];
+        packBundleHeader(header, type, length, size);
+        crc = crc32Update(crc, header, sizeof(header));
+        crc = crc32Update(crc, (const uint8_t*)relative, length);
+        PERF_TIMED(PERF_USB_WRITE, SerialUSB.write(header, sizeof(header)));
+        PERF_TIMED(PERF_USB_WRITE, SerialUSB.write((const uint8_t*)relative, length));
+    }
+
+    bool step() override {
+        if (!inFile) {
+            WalkEvent event;
+            if (aborted || !walker.next(event)) return false;
+            size_t length = walker.length - walker.rootLength;
+            if (bundle && event == WalkEvent::ENTER_DIR) sendEntry(BundleEntry::DIRECTORY, walker.relative(), length, 0);
+            if (event != WalkEvent::FILE) return true;
+            remaining = walker.entry.fileSize();
+            if (bundle) {
+                sendEntry(compress ? BundleEntry::COMPRESSED : BundleEntry::FILE_DATA, walker.relative(), length, remaining);
+            } else {
+                SerialUSB.print("FILE:");
+                SerialUSB.println(walker.relative());
+                SerialUSB.println(remaining);
+            }
+            inFile = true;
+            fileFailed = false;
+        }
+
+        uint64_t chunk = min(remaining, (uint64_t)JOB_SLICE_BYTES);
+        Error result = Error::NONE;
+        if (chunk) {
+            result = compress ? sendCompressed(walker.entry, chunk, stats, crc)
+                              : sendStream(walker.entry, chunk, stats, bundle ? &crc : nullptr);
+        }
+        if (result == Error::TIMEOUT) {
+            err = result;
+            return false;
+        }
+        if (result != Error::NONE) fileFailed = true;
+        remaining -= chunk;
+        if (remaining) return true;
+
+        inFile = false;
+        if (bundle && fileFailed) sendEntry(BundleEntry::READ_ERROR, "", 0, 0);
+        if (!bundle) SerialUSB.println(fileFailed ? "FILE_ERROR" : "FILE_DONE");
+        if (fileFailed) failedFiles++;
+        fileCount++;
+        return true;
+    }
+
+    void finish() override {
+        walker.finish();
+        if (err != Error::NONE) {
+            SerialUSB.println("Error: Failed to send directory");
+            return;
+        }
+        if (bundle) {
+            uint8_t header[BUNDLE_HEADER_SIZE];
+            packBundleHeader(header, aborted ? BundleEntry::ABORTED : BundleEntry::END, 0, crc);
+            PERF_TIMED(PERF_USB_WRITE, SerialUSB.write(header, sizeof(header)));
+        } else {
+            SerialUSB.println((aborted ? "DIR_ABORTED:" : "DIR_DONE:") + String(fileCount));
+        }
+        stats.totalMicros = micros() - stats.startMicros;
+        SerialUSB.println((aborted ? "Aborted after " : "Sent ") + String(fileCount) + " files, " + formatSize(stats.bytes) +
+                          (failedFiles ? ", " + String(failedFiles) + " with read errors" : String("")));
+        printTransferStats(stats);
+    }
+};
+
+// Starts downloaddir. Without the bundle the header is DIR_BEGIN, or
+// DIR_COUNT:<n> when the whole tree is already cached.
+Error sendDirectory(const String& path, bool bundle, bool compress) {
+    SendTreeJob* job = new SendTreeJob(bundle, compress);
+    if (!job->walker.begin(path.c_str())) {
+        delete job;
+        return Error::NOT_A_DIRECTORY;
+    }
+    unsigned long cachedFiles = 0;
+    uint32_t cached = cache.entries ? cacheFind(path.c_str(), false) : CACHE_NONE;
+    if (bundle) {
+        SerialUSB.println(compress ? "BUNDLE_BEGIN LZ4 " + String(LZ4_BLOCK_SIZE) : String("BUNDLE_BEGIN"));
+    } else if (cached != CACHE_NONE && cache.entries[cached].isDir && cacheCountFiles(cached, cachedFiles)) {
+        SerialUSB.println("DIR_COUNT:" + String(cachedFiles));
+    } else {
+        SerialUSB.println("DIR_BEGIN");
+    }
+    startJob(job);
+    return Error::NONE;
+}
+
+// Single-file transfers that seek straight to a byte offset, so an
+// interrupted copy resumes where it stopped. `sum` checksums a range in
+// chunks for the host to find how much of a partial copy already matches;
+// `get` streams a range and `put` rewrites a file from an offset on. Each
+// range ends with its CRC-32 so the host can confirm it before moving on.
+
+// Opens `path` for reading and clamps [offset, offset + length) to the file.
+Error openRange(const String& path, uint64_t offset, uint64_t& length, FsFile& file) {
+    file = PERF_TIMED(PERF_SD_OPEN, SD.sdfs.open(path.c_str(), O_RDONLY));
+    if (!file) return Error::FILE_NOT_FOUND;
+    if (file.isDir()) return Error::IS_DIRECTORY;
+    uint64_t size = file.fileSize();
+    if (offset > size || !file.seekSet(offset)) return Error::INVALID_PATH;
+    length = min(length, size - offset);
+    return Error::NONE;
+}
+
+// get: "GET_BEGIN:<file size>:<offset>:<length>", the raw bytes, then
+// "GET_END:<crc32>" over the range, or "GET_ERROR:<crc32>" if the card failed
+// to read part of it (sent as zeros). An abort stops the stream short with
+// "GET_ABORTED:<bytes sent>".
+struct GetJob : Job {
+    FsFile file;
+    TransferStats stats;
+    uint64_t remaining = 0;
+    uint32_t crc = 0;
+    bool readFailed = false;
+    Error err = Error::NONE;
+
+    GetJob() : Job("get", true) {
+        stats.startMicros = micros();
+    }
+
+    bool step() override {
+        if (aborted || !remaining) return false;
+        uint64_t chunk = min(remaining, (uint64_t)JOB_SLICE_BYTES);
+        Error result = sendStream(file, chunk, stats, &crc);
+        if (result == Error::TIMEOUT) {
+            err = result;
+            return false;
+        }
+        if (result != Error::NONE) readFailed = true;
+        remaining -= chunk;
+        return remaining > 0;
+    }
+
+    void finish() override {
+        file.close();
+        if (err != Error::NONE) {
+            SerialUSB.println("Error: Timed out sending file");
+            return;
+        }
+        if (aborted) {
+            SerialUSB.print("GET_ABORTED:");
+            SerialUSB.println(stats.bytes);
+        } else {
+            SerialUSB.printf("%s:%08lx\r\n", readFailed ? "GET_ERROR" : "GET_END", (unsigned long)crc);
+        }
+        stats.totalMicros = micros() - stats.startMicros;
+        printTransferStats(stats);
+    }
+};
+
+Error sendRange(const String& path, uint64_t offset, uint64_t length) {
+    GetJob* job = new GetJob();
+    Error err = openRange(path, offset, length, job->file);
+    if (err != Error::NONE) {
+        delete job;
+        return err;
+    }
+    job->remaining = length;
+    SerialUSB.print("GET_BEGIN:");
+    SerialUSB.print(job->file.fileSize());
+    SerialUSB.print(":");
+    SerialUSB.print(offset);
+    SerialUSB.print(":");
+    SerialUSB.println(length);
+    startJob(job);
+    return Error::NONE;
+}
+
+// sum: one "SUM:<offset>:<length>:<crc32>" line per chunk of the range, then
+// "SUM_END:<file size>". Reads IO_BLOCK_SIZE per step.
+struct SumJob : Job {
+    FsFile file;
+    uint64_t offset = 0, remaining = 0;
+    uint32_t chunkSize = SUM_CHUNK, chunkLength = 0, crc = 0;
+    Error err = Error::NONE;
+
+    SumJob() : Job("sum", true) {}
+
+    void endChunk() {
+        SerialUSB.print("SUM:");
+        SerialUSB.print(offset - chunkLength);
+        SerialUSB.printf(":%lu:%08lx\r\n", (unsigned long)chunkLength, (unsigned long)crc);
+        chunkLength = 0;
+        crc = 0;
+    }
+
+    bool step() override {
+        if (aborted || !remaining) return false;
+        uint32_t want = min((uint64_t)min((uint32_t)IO_BLOCK_SIZE, chunkSize - chunkLength), remaining);
+        int got = PERF_TIMED(PERF_SD_READ, file.read(ioBuffers[0], want));
+        if (got != (int)want) {
+            err = Error::READ_FAILED;
+            return false;
+        }
+        crc = crc32Update(crc, ioBuffers[0], want);
+        chunkLength += want;
+        offset += want;
+        remaining -= want;
+        if (chunkLength == chunkSize || !remaining) endChunk();
+        return remaining > 0;
+    }
+
+    void finish() override {
+        if (err != Error::NONE) SerialUSB.println("Error: Read failed at offset " + String((uint32_t)offset));
+        else if (aborted) SerialUSB.println("SUM_ABORTED");
+        else {
+            SerialUSB.print("SUM_END:");
+            SerialUSB.println(file.fileSize());
+        }
+        file.close();
+    }
+};
+
+Error checksumRange(const String& path, uint64_t offset, uint64_t length, uint32_t chunk) {
+    SumJob* job = new SumJob();
+    Error err = openRange(path, offset, length, job->file);
+    if (err != Error::NONE) {
+        delete job;
+        return err;
+    }
+    job->offset = offset;
+    job->remaining = length;
+    if (chunk) job->chunkSize = chunk;
+    startJob(job);
+    return Error::NONE;
+}
+
+// put: keeps the first `offset` bytes of `path` (which must already hold
+// that many) and replaces the rest. Answers "PUT_READY:<offset>", then takes
+// the range length on a line of its own followed by the data, and reports
+// "PUT_DONE:<bytes>:<crc32>".
+Error receiveRange(const String& path, uint64_t offset) {
+    FsFile existing = PERF_TIMED(PERF_SD_OPEN, SD.sdfs.open(path.c_str(), O_RDONLY));
+    if (existing && existing.isDir()) return Error::IS_DIRECTORY;
+    if (offset > 0 && !existing) return Error::FILE_NOT_FOUND;
+    if (offset > 0 && existing.fileSize() < offset) return Error::INVALID_PATH;
+    existing.close();
+    if (offset == 0 && !ensureParentDirectory(path)) return Error::INVALID_PATH;
+    SerialUSB.print("PUT_READY:");
+    SerialUSB.println(offset);
+
+    uint32_t start = millis();
+    while (!SerialUSB.available()) {
+        if (millis() - start > SERIAL_TIMEOUT) {
+            SerialUSB.println("Error: Timed out waiting for the range length");
+            return Error::TIMEOUT;
+        }
+        yield();
+    }
+    String line = SerialUSB.readStringUntil('\n');
+    uint64_t length = strtoull(line.c_str(), nullptr, 10);
+
+    FsFile file;
+    if (offset == 0) {
+        file = createFile(path, length);
+    } else {
+        file = PERF_TIMED(PERF_SD_OPEN, SD.sdfs.open(path.c_str(), O_WRONLY));
+        uint64_t previous = file ? file.fileSize() : 0;
+        if (file && (!file.truncate(offset) || !file.seekSet(offset))) file.close();
+        if (file) spaceChanged(previous, offset + length);
+    }
+    if (!file) {
+        discardInput(4 * FRAME_STALL_TIMEOUT);
+        return Error::WRITE_FAILED;
+    }
+    cacheInvalidate(path);
+
+    TransferStats stats;
+    stats.startMicros = micros();
+    uint32_t crc = 0;
+    Error err = receiveStream(file, length, stats, &crc);
+    stats.totalMicros = micros() - stats.startMicros;
+    closeReceived(file, path, offset + length);
+    if (err == Error::TIMEOUT) {
+        SerialUSB.println("Error: Timed out after " + String((uint32_t)stats.bytes) + " of " + String((uint32_t)length) + " bytes");
+        return err;
+    }
+    if (err != Error::NONE) {
+        discardInput(4 * FRAME_STALL_TIMEOUT);
+        return err;
+    }
+    SerialUSB.print("PUT_DONE:");
+    SerialUSB.print(stats.bytes);
+    SerialUSB.printf(":%08lx\r\n", (unsigned long)crc);
+    printTransferStats(stats);
+    return Error::NONE;
+}
+
+// record: logs an open-ended stream from the host to the card. The host sends
+// chunks of "<u32 little-endian length><data>" and a zero length to stop.
+// Data lands in a ring buffer (in PSRAM when fitted) that the card drains in
+// RECORD_WRITE_BYTES writes, each issued only once the card has finished
+// programming the last. A write itself blocks, but USB reads carry on into
+// the ring for as long as the card then reports busy, which is where its
+// latency spikes fall, and every write starts on a sector boundary. Files
+// are preallocated to the rotation size; a full one is closed and recording
+// continues in <name>.1.<ext>, <name>.2.<ext> and so on. When the card falls behind for
+// longer than the ring covers, USB holds the host back rather than dropping
+// data, and the event is counted as an overrun. The session answers
+// "RECORD_READY:<ring bytes>:<rotation bytes>" and ends with
+// "RECORD_END:<bytes>:<files>:<overruns>:<worst stall us>:<peak ring bytes>",
+// or RECORD_ERROR with the same fields if the card failed; the rest of the
+// stream is then read and dropped up to its end.
+struct Recorder {
+    uint8_t* ring = nullptr;
+    size_t capacity = 0;  // A multiple of RECORD_WRITE_BYTES
+    bool ownsRing = false;
+    uint64_t received = 0, written = 0;  // Totals; their difference is buffered
+    String path;
+    FsFile file;
+    uint64_t rotateBytes = 0, fileBytes = 0;
+    uint32_t files = 0, overruns = 0, worstStall = 0;
+    size_t peak = 0;
+    uint32_t readySince = 0;  // When a full write became due, while the card is busy
+    bool stalled = false;
+
+    ~Recorder() {
+        if (!ownsRing) return;
+        if (external_psram_size) extmem_free(ring);
+        else free(ring);
+    }
+
+    bool allocate() {
+        size_t budget = external_psram_size ? RECORD_PSRAM_BYTES : RECORD_RAM_BYTES;
+        ring = (uint8_t*)(external_psram_size ? extmem_malloc(budget) : malloc(budget));
+        ownsRing = ring != nullptr;
+        if (!ring) {
+            ring = &ioBuffers[0][0];  // Double buffering at least
+            budget = sizeof(ioBuffers);
+        }
+        capacity = budget / RECORD_WRITE_BYTES * RECORD_WRITE_BYTES;
+        return capacity > 0;
+    }
+
+    String segmentPath(uint32_t index) const {
+        if (index == 0) return path;
+        int slash = path.lastIndexOf('/');
+        int dot = path.lastIndexOf('.');
+        if (dot <= slash + 1) dot = path.length();
+        return path.substring(0, dot) + "." + String(index) + path.substring(dot);
+    }
+
+    bool openSegment() {
+        String name = segmentPath(files);
+        file = createFile(name, rotateBytes);
+        if (!file) return false;
+        cacheInvalidate(name);
+        files++;
+        fileBytes = 0;
+        return true;
+    }
+
+    // Drops the unused part of the preallocation.
+    void closeSegment() {
+        if (!file) return;
+        closeReceived(file, segmentPath(files - 1), rotateBytes);
+    }
+
+    // Writes one block from the ring if a full one is waiting (or, with
+    // `final`, whatever is left) and the card is ready for it.
+    bool drain(bool final) {
+        uint64_t pending = received - written;
+        if (pending == 0 || (pending < RECORD_WRITE_BYTES && !final)) return true;
+        if (!final && file.isBusy()) {
+            if (!stalled) readySince = micros();
+            stalled = true;
+            return true;
+        }
+        if (fileBytes == rotateBytes) {
+            closeSegment();
+            if (!openSegment()) return false;
+        }
+        uint32_t start = stalled ? readySince : micros();
+        size_t count = min(min(pending, (uint64_t)RECORD_WRITE_BYTES), rotateBytes - fileBytes);
+        size_t done = PERF_TIMED(PERF_SD_WRITE, file.write(ring + written % capacity, count));
+        worstStall = max(worstStall, (uint32_t)(micros() - start));
+        stalled = false;
+        written += done;
+        fileBytes += done;
+        return done == count;
+    }
+};
+
+Error recordStream(const String& path, uint64_t rotateBytes) {
+    FsFile existing = PERF_TIMED(PERF_SD_OPEN, SD.sdfs.open(path.c_str(), O_RDONLY));
+    if (existing && existing.isDir()) return Error::IS_DIRECTORY;
+    existing.close();
+    Recorder rec;
+    if (!rec.allocate()) return Error::WRITE_FAILED;
+    // Rotation falls on block boundaries, and FAT files stop short of 4 GB
+    rec.rotateBytes = max(rotateBytes / RECORD_WRITE_BYTES, (uint64_t)1) * RECORD_WRITE_BYTES;
+    if (space.fatType != FAT_TYPE_EXFAT) rec.rotateBytes = min(rec.rotateBytes, (uint64_t)0x100000000ULL - RECORD_WRITE_BYTES);
+    rec.path = path;
+    if (!ensureParentDirectory(path) || !rec.openSegment()) return Error::WRITE_FAILED;
+    SerialUSB.print("RECORD_READY:");
+    SerialUSB.print(rec.capacity);
+    SerialUSB.print(":");
+    SerialUSB.println(rec.rotateBytes);
+
+    Error err = Error::NONE;
+    uint8_t prefix[4];
+    size_t prefixLength = 0;
+    uint32_t chunkLeft = 0;
+    bool ended = false, full = false;
+    uint32_t start = millis(), lastData = millis();
+    while (!ended) {
+        int available = SerialUSB.available();
+        size_t buffered = rec.received - rec.written;
+        if (available > 0 && chunkLeft == 0) {
+            prefix[prefixLength++] = SerialUSB.read();
+            if (prefixLength == sizeof(prefix)) {
+                chunkLeft = readLe32(prefix);
+                prefixLength = 0;
+                ended = chunkLeft == 0;
+            }
+            lastData = millis();
+        } else if (available > 0 && err != Error::NONE) {
+            uint8_t scratch[64];
+            chunkLeft -= SerialUSB.readBytes((char*)scratch, min((size_t)available, min((size_t)chunkLeft, sizeof(scratch))));
+            lastData = millis();
+        } else if (available > 0 && buffered < rec.capacity) {
+            size_t offset = rec.received % rec.capacity;
+            size_t want = min(min((size_t)available, (size_t)chunkLeft), min(rec.capacity - buffered, rec.capacity - offset));
+            size_t got = PERF_TIMED(PERF_USB_READ, SerialUSB.readBytes((char*)rec.ring + offset, want));
+            rec.received += got;
+            chunkLeft -= got;
+            rec.peak = max(rec.peak, buffered + got);
+            full = false;
+            lastData = millis();
+        } else if (available > 0) {
+            if (!full) rec.overruns++;
+            full = true;
+        } else if (millis() - lastData > RECORD_IDLE_TIMEOUT) {
+            if (err == Error::NONE) err = Error::TIMEOUT;
+            break;
+        } else {
+            yield();
+        }
+        if (err == Error::NONE && !rec.drain(false)) err = Error::WRITE_FAILED;
+    }
+    while (err != Error::WRITE_FAILED && rec.written < rec.received) {
+        if (!rec.drain(true)) err = Error::WRITE_FAILED;
+    }
+    rec.closeSegment();
+
+    SerialUSB.print(err == Error::WRITE_FAILED ? "RECORD_ERROR:" : "RECORD_END:");
+    SerialUSB.print(rec.written);
+    SerialUSB.printf(":%lu:%lu:%lu:", (unsigned long)rec.files, (unsigned long)rec.overruns, (unsigned long)rec.worstStall);
+    SerialUSB.println(rec.peak);
+    uint32_t elapsed = max(millis() - start, 1UL);
+    SerialUSB.printf("  %s in %lu file(s), %.2f MB/s, %lu overruns, worst SD stall %.1f ms, ring peak %s of %s\r\n",
+                     formatSize(rec.written).c_str(), (unsigned long)rec.files, (double)rec.written / elapsed / 1000,
+                     (unsigned long)rec.overruns, rec.worstStall / 1000.0, formatSize(rec.peak).c_str(), formatSize(rec.capacity).c_str());
+    if (err == Error::TIMEOUT) SerialUSB.println("Error: Stream stopped without an end marker, recorded what arrived");
+    return err;
+}
+
+// Viewing commands: cat, head, tail and hexdump. Each comes down to a byte
+// range of the file, reached by seeking (tail scans back from the end a block
+// at a time, so it costs the same on any file size), which a ViewJob streams
+// in IO_BLOCK_SIZE reads. `abort` stops a long listing.
+enum class View { TEXT, HEAD, HEXDUMP };
+
+struct ViewJob : Job {
+    FsFile file;
+    View view;
+    uint64_t position = 0, end = 0;
+    uint32_t lines = 0;      // HEAD: newlines still to print
+    bool truncated = false;  // cat stopped short of the end of the file
+    bool readFailed = false;
+
+    ViewJob(const char* name, View view) : Job(name, true), view(view) {}
+
+    void printHex(const uint8_t* data, size_t length) {
+        char line[96];
+        for (size_t i = 0; i < length; i += 16) {
+            size_t count = min(length - i, (size_t)16);
+            int n = snprintf(line, sizeof(line), "%08llx ", (unsigned long long)(position + i));
+            for (size_t j = 0; j < 16; j++) {
+                n += j < count ? snprintf(line + n, sizeof(line) - n, "%s%02x", j == 8 ? "  " : " ", data[i + j])
+                               : snprintf(line + n, sizeof(line) - n, "%s   ", j == 8 ? "  " : "");
+            }
+            n += snprintf(line + n, sizeof(line) - n, "  |");
+            for (size_t j = 0; j < count; j++) line[n++] = data[i + j] >= 0x20 && data[i + j] < 0x7F ? data[i + j] : '.';
+            line[n++] = '|';
+            line[n++] = '\r';
+            line[n++] = '\n';
+            PERF_TIMED(PERF_USB_WRITE, SerialUSB.write((const uint8_t*)line, n));
+        }
+    }
+
+    bool step() override {
+        if (aborted || position >= end) return false;
+        // Hex output is about four times the input, so read less per step
+        size_t want = min(end - position, (uint64_t)(view == View::HEXDUMP ? IO_BLOCK_SIZE / 4 : IO_BLOCK_SIZE));
+        uint8_t* buffer = ioBuffers[0];
+        int got = PERF_TIMED(PERF_SD_READ, file.read(buffer, want));
+        if (got <= 0) {
+            readFailed = true;
+            return false;
+        }
+        size_t length = got;
+        if (view == View::HEAD) {
+            for (const uint8_t* p = buffer; (p = (const uint8_t*)memchr(p, '\n', buffer + length - p)) != nullptr; p++) {
+                if (--lines == 0) {
+                    length = p + 1 - buffer;
+                    end = position + length;
+                    break;
+                }
+            }
+        }
+        if (view == View::HEXDUMP) printHex(buffer, length);
+        else PERF_TIMED(PERF_USB_WRITE, SerialUSB.write(buffer, length));
+        position += length;
+        return position < end;
+    }
+
+    void finish() override {
+        if (readFailed) SerialUSB.println("\nError: Read failed at offset " + String((uint32_t)position));
+        else if (aborted) SerialUSB.println("\n[Aborted at offset " + String((uint32_t)position) + "]");
+        else if (truncated) SerialUSB.println("\n\n[Output truncated... File size: " + formatSize(file.fileSize()) +
+                                              ", use cat <file> <offset> <length>, head or tail for more]");
+        file.close();
+    }
+};
+
+// Offset of the first of the last `lines` lines; a newline that ends the
+// file closes the last line rather than starting another.
+Error findTailStart(FsFile& file, uint32_t lines, uint64_t& start) {
+    uint64_t size = file.fileSize();
+    start = size;
+    uint32_t seen = 0;
+    for (uint64_t block = size; block > 0 && lines > 0;) {
+        size_t length = min(block, (uint64_t)IO_BLOCK_SIZE);
+        block -= length;
+        if (!file.seekSet(block) || PERF_TIMED(PERF_SD_READ, file.read(ioBuffers[0], length)) != (int)length) {
+            return Error::READ_FAILED;
+        }
+        for (size_t i = length; i-- > 0;) {
+            if (ioBuffers[0][i] != '\n' || block + i == size - 1) continue;
+            if (++seen == lines) {
+                start = block + i + 1;
+                return file.seekSet(start) ? Error::NONE : Error::READ_FAILED;
+            }
+        }
+        start = block;
+    }
+    return file.seekSet(start) ? Error::NONE : Error::READ_FAILED;
+}
+
+// Starts a listing of `path`: `length` bytes from `offset` for cat and
+// hexdump (UINT64_MAX for the rest of the file), or `lines` lines from the
+// start or end for head and tail. A `preview` (cat without a range) notes
+// when the file goes on past it.
+Error viewFile(const String& path, const char* command, uint64_t offset, uint64_t length, uint32_t lines = 0,
+               bool preview = false) {
+    bool head = strcmp(command, "head") == 0, tail = strcmp(command, "tail") == 0;
+    ViewJob* job = new ViewJob(command, strcmp(command, "hexdump") == 0 ? View::HEXDUMP : head ? View::HEAD : View::TEXT);
+    Error err = openRange(path, offset, length, job->file);
+    if (err == Error::NONE && tail) {
+        err = findTailStart(job->file, lines, offset);
+        length = job->file.fileSize() - offset;
+    }
+    if (err != Error::NONE) {
+        delete job;
+        return err;
+    }
+    job->lines = lines;
+    job->position = offset;
+    job->end = offset + length;
+    job->truncated = preview && job->end < job->file.fileSize();
+    SerialUSB.println("\n=== File: " + path + " ===");
+    startJob(job);
+    return Error::NONE;
+}
+
+// The sync manifest lists every synced file as "<crc32 hex> <size> </path>",
+// sorted by path (byte order) and relative to the sync root. The host streams
+// its own manifest in the same order, so comparing the two is a single merge
+// pass that never holds either list in memory.
+struct ManifestEntry {
+    uint32_t crc;
+    uint32_t size;
+    char* path;
+};
+
+bool parseManifestEntry(char* line, ManifestEntry& entry) {
+    char* end;
+    entry.crc = strtoul(line, &end, 16);
+    if (*end != ' ') return false;
+    entry.size = strtoul(end + 1, &end, 10);
+    if (*end != ' ') return false;
+    entry.path = end + 1;
+    size_t length = strlen(entry.path);
+    while (length > 0 && (entry.path[length - 1] == '\n' || entry.path[length - 1] == '\r')) entry.path[--length] = 0;
+    return entry.path[0] == '/';
+}
+
+bool readManifestEntry(FsFile& manifest, char* line, ManifestEntry& entry) {
+    while (manifest && manifest.fgets(line, MANIFEST_LINE_MAX) > 0) {
+        if (parseManifestEntry(line, entry)) return true;
+    }
+    return false;
+}
+
+// Cheap guard against changes made on the card outside of sync (rm, clearfolder).
+bool syncedFileMatches(const String& root, const ManifestEntry& entry) {
+    FsFile file = PERF_TIMED(PERF_SD_OPEN, SD.sdfs.open((root + entry.path).c_str(), O_RDONLY));
+    return file && file.isFile() && file.fileSize() == entry.size;
+}
+
+// Reads `count` host manifest lines, answers with the ranges of host entries
+// that must be sent ("NEED:<first>-<last>") and stages the host manifest as
+// the card's next manifest. With prune, files listed only in the card's
+// manifest are deleted.
+Error exchangeManifest(const String& root, unsigned long count, bool prune) {
+    uint8_t* needed = (uint8_t*)calloc(count / 8 + 1, 1);
+    if (!needed) return Error::WRITE_FAILED;
+    FsFile current = SD.sdfs.open((root + SYNC_MANIFEST).c_str(), O_RDONLY);
+    FsFile staged = SD.sdfs.open((root + SYNC_MANIFEST ".new").c_str(), O_WRONLY | O_CREAT | O_TRUNC);
+    if (!staged) {
+        free(needed);
+        return Error::WRITE_FAILED;
+    }
+    static char cardLine[MANIFEST_LINE_MAX];
+    static char hostLine[MANIFEST_LINE_MAX];
+    ManifestEntry card, host;
+    bool haveCard = readManifestEntry(current, cardLine, card);
+    unsigned long neededCount = 0, removed = 0;
+    auto dropCardEntry = [&]() {
+        if (prune && SD.sdfs.remove((root + card.path).c_str())) {
+            indexJournal('-', root + card.path);
+            spaceChanged(card.size, 0);
+            removed++;
+        }
+        haveCard = readManifestEntry(current, cardLine, card);
+    };
+
+    Error err = Error::NONE;
+    for (unsigned long i = 0; i < count && err == Error::NONE; i++) {
+        String line = SerialUSB.readStringUntil('\n');
+        if (line.length() == 0 || line.length() >= MANIFEST_LINE_MAX) {
+            err = line.length() == 0 ? Error::TIMEOUT : Error::PROTOCOL;
+            break;
+        }
+        memcpy(hostLine, line.c_str(), line.length() + 1);
+        if (!parseManifestEntry(hostLine, host)) {
+            err = Error::PROTOCOL;
+            break;
+        }
+        while (haveCard && strcmp(card.path, host.path) < 0) dropCardEntry();
+        bool unchanged = false;
+        if (haveCard && strcmp(card.path, host.path) == 0) {
+            unchanged = card.crc == host.crc && card.size == host.size && syncedFileMatches(root, host);
+            haveCard = readManifestEntry(current, cardLine, card);
+        }
+        if (!unchanged) {
+            needed[i / 8] |= 1 << (i % 8);
+            neededCount++;
+        }
+        staged.printf("%08lx %lu %s\n", (unsigned long)host.crc, (unsigned long)host.size, host.path);
+    }
+    while (err == Error::NONE && haveCard) dropCardEntry();
+    current.close();
+    staged.close();
+
+    if (err == Error::NONE) {
+        for (unsigned long i = 0; i < count; i++) {
+            if (!(needed[i / 8] & 1 << (i % 8))) continue;
+            unsigned long last = i;
+            while (last + 1 < count && (needed[(last + 1) / 8] & 1 << ((last + 1) % 8))) last++;
+            SerialUSB.println("NEED:" + String(i) + "-" + String(last));
+            i = last;
+        }
+        SerialUSB.println("MANIFEST_DONE:" + String(neededCount) + " " + String(removed));
+    } else {
+        SD.sdfs.remove((root + SYNC_MANIFEST ".new").c_str());
+        SerialUSB.println("Error: Invalid manifest");
+    }
+    free(needed);
+    return err;
+}
+
+// A sync that exchanged manifests replaces the card's manifest with the staged
+// one once every needed file has arrived; any other sync leaves the old
+// manifest stale, so it is dropped and the next resync compares against nothing.
+void finishManifest(const String& root, bool staged, bool wroteFiles, Error result) {
+    String manifest = root + SYNC_MANIFEST;
+    String next = manifest + ".new";
+    if (staged && result == Error::NONE) {
+        SD.sdfs.remove(manifest.c_str());
+        SD.sdfs.rename(next.c_str(), manifest.c_str());
+        return;
+    }
+    if (staged) SD.sdfs.remove(next.c_str());
+    if (wroteFiles) SD.sdfs.remove(manifest.c_str());
+}
+
+Error syncDirectory(const String& localPath, const String& remotePath = DEFAULT_SYNC_DIR) {
+    String actualRemotePath = remotePath.length() == 0 ? DEFAULT_SYNC_DIR : remotePath;
+    if (!makeDirectories(actualRemotePath)) {
+        SerialUSB.println("Error: Failed to create sync directory");
+        return Error::INVALID_PATH;
+    }
+    SerialUSB.println("Ready to receive files. Start transfer from host.");
+    unsigned long fileCount = 0, processedFiles = 0;
+    bool manifestStaged = false, wroteFiles = false;
+    Error err = Error::NONE;
+    while (err == Error::NONE) {
+        String command = SerialUSB.readStringUntil('\n');
+        command.trim();
+        if (command == "SYNC_COMPLETE") break;
+        if (command.startsWith("MANIFEST:")) {
+            err = exchangeManifest(actualRemotePath, command.substring(9).toInt(), command.endsWith(" PRUNE"));
+            manifestStaged = err == Error::NONE;
+            continue;
+        }
+        if (command == "MODE:FRAMED") {
+            wroteFiles = true;
+            err = receiveFramed(actualRemotePath);
+            break;
+        }
+        if (command == "MODE:BUNDLE") {
+            wroteFiles = true;
+            err = receiveBundle(actualRemotePath);
+            break;
+        }
+        if (command.startsWith("FILE_COUNT:")) {
+            fileCount = command.substring(11).toInt();
+            continue;
+        }
+        if (command.startsWith("FILE:")) {
+            String filePath = actualRemotePath + "/" + command.substring(5);
+            wroteFiles = true;
+            err = receiveFile(filePath);
+            if (err != Error::NONE) break;
+            processedFiles++;
+            printProgress(processedFiles, fileCount);
+        } else {
+            SerialUSB.println("Error: Invalid sync command");
+            err = Error::INVALID_PATH;
+        }
+    }
+    finishManifest(actualRemotePath, manifestStaged, wroteFiles, err);
+    cacheInvalidate(actualRemotePath);
+    if (err != Error::NONE) return err;
+    SerialUSB.println("\nSync completed");
+    return Error::NONE;
+}
+
+Error receiveFile(const String& path) {
+    uint32_t fileSize = SerialUSB.parseInt();
+    FsFile file = createFile(path, fileSize);
+    if (!file) {
+        SerialUSB.println("Error: Unable to create file");
+        return Error::FILE_NOT_FOUND;
+    }
+    SerialUSB.println("Receiving file: " + String(path));
+    SerialUSB.read(); // Consume newline
+    TransferStats stats;
+    stats.startMicros = micros();
+    Error err = receiveStream(file, fileSize, stats);
+    stats.totalMicros = micros() - stats.startMicros;
+    closeReceived(file, path, fileSize);
+    if (err == Error::TIMEOUT) {
+        SerialUSB.println("Error: Timed out after " + String((uint32_t)stats.bytes) + " of " + String(fileSize) + " bytes");
+        return err;
+    }
+    if (err != Error::NONE) {
+        SerialUSB.println("Error: SD write failed");
+        return err;
+    }
+    SerialUSB.println("Received " + String((uint32_t)stats.bytes) + " bytes");
+    printTransferStats(stats);
+    SerialUSB.println("FILE_RECEIVED");
+    return Error::NONE;
+}
+
+void printProgress(unsigned long current, unsigned long total) {
+    int percent = (current * 100) / total;
+    SerialUSB.print(F("\rProgress: "));
+    SerialUSB.print(percent);
+    SerialUSB.print(F("%"));
+    SerialUSB.flush();
+}
+
+Error folderSummary(const String& path) {
+    File dir = PERF_TIMED(PERF_SD_OPEN, SD.open(path.c_str()));
+    if (!dir || !dir.isDirectory()) return Error::NOT_A_DIRECTORY;
+
+    unsigned long fileCount = 0;
+    uint64_t totalSize = 0;
+
+    uint32_t cached = cacheDirectory(path);
+    if (cached != CACHE_NONE) {
+        const CacheEntry& folder = cache.entries[cached];
+        for (uint32_t i = folder.firstChild; i < folder.firstChild + folder.childCount; i++) {
+            if (cache.entries[i].isDir) continue;
+            fileCount++;
+            totalSize += cache.entries[i].size;
+        }
+    } else {
+        File entry;
+        while (entry = PERF_TIMED(PERF_SD_OPEN_NEXT, dir.openNextFile())) {
+            if (!entry.isDirectory()) {
+                fileCount++;
+                totalSize += entry.size();
+            }
+            entry.close();
+        }
+    }
+
+    SerialUSB.println(F("\nFolder Summary:"));
+    SerialUSB.println(F("---------------"));
+    SerialUSB.println("Total files: " + String(fileCount));
+    SerialUSB.println("Total size: " + formatSize(totalSize));
+
+    dir.close();
+    return Error::NONE;
+}
+
+void printMatch(const char* path, size_t length, bool isDir, uint64_t size) {
+    PERF_TIMED(PERF_USB_WRITE, SerialUSB.write((const uint8_t*)path, length));
+    if (isDir) SerialUSB.println("/");
+    else SerialUSB.println("  (" + formatSize(size) + ")");
+}
+
+// SDPeek's own files (.sdpeek_*) are left out of find, the index, dupes and grep.
+bool isInternalName(const char* name) {
+    return strncmp(name, ".sdpeek_", 8) == 0;
+}
+
+// Prints cached matches below `dir`; `path` holds the directory's path with a
+// trailing '/' and is extended in place for each level. Path patterns are
+// matched from `relative` on.
+void findCached(uint32_t dir, const GlobPattern& glob, char* path, size_t length, size_t relative, bool& foundAny) {
+    const CacheEntry& folder = cache.entries[dir];
+    for (uint32_t i = folder.firstChild; i < folder.firstChild + folder.childCount; i++) {
+        const CacheEntry& entry = cache.entries[i];
+        const char* name = cacheName(i);
+        size_t nameLength = strlen(name);
+        if (isInternalName(name) || length + nameLength + 2 > BUNDLE_PATH_MAX) continue;
+        memcpy(path + length, name, nameLength + 1);
+        const char* subject = glob.pathPattern ? path + relative : path + length;
+        if (glob.matches(subject, path + length + nameLength - subject)) {
+            foundAny = true;
+            printMatch(path, length + nameLength, entry.isDir, entry.size);
+        }
+        if (entry.isDir) {
+            path[length + nameLength] = '/';
+            path[length + nameLength + 1] = '\0';
+            findCached(i, glob, path, length + nameLength + 1, relative, foundAny);
+        }
+    }
+}
+
+// Persistent search index. INDEX_FILE is a header block followed by
+// INDEX_BLOCK_SIZE data blocks of records sorted by lowercased name, then
+// path. A record is
+//   name length(1) flags(1) path length(2) dir index(4) size(8) name path
+// and never straddles a block; the rest of a block is zero padding. `index`
+// rebuilds the file with an external merge sort. The device's own write paths
+// append "F <size> <path>", "D <path>" and "- <path>" lines to INDEX_JOURNAL
+// ("- /dir/" drops everything below /dir), and find overlays the journal on
+// the index until the journal is compacted into it. Files named .sdpeek_*
+// are not indexed.
+struct IndexRecord {
+    const uint8_t* data;
+    uint8_t nameLength;
+    bool isDir;
+    uint16_t pathLength;
+    uint32_t dirIndex;
+    uint64_t size;
+
+    const char* name() const { return (const char*)data + INDEX_RECORD_HEADER; }
+    const char* path() const { return name() + nameLength; }
+    size_t length() const { return INDEX_RECORD_HEADER + nameLength + pathLength; }
+};
+
+static int8_t indexState = -1;  // -1 not checked yet, 0 absent, 1 present
+
+// Journal lines collect in RAM while a command or job runs and are appended
+// to INDEX_JOURNAL in one write once the shell is idle (or sooner, when the
+// buffer fills), so write paths pay nothing per file. Lines still in RAM at a
+// reset are lost and find may show those files stale until the next `index`.
+static char indexPending[INDEX_JOURNAL_MAX];
+static size_t indexPendingLength = 0;
+static uint64_t indexJournalBytes = 0;  // Size of INDEX_JOURNAL after the last append
+
+bool indexAvailable() {
+    if (indexState < 0) indexState = SD.sdfs.exists(INDEX_FILE) ? 1 : 0;
+    return indexState == 1;
+}
+
+size_t encodeIndexRecord(uint8_t* out, const char* name, bool isDir, const char* path, size_t pathLength,
+                         uint32_t dirIndex, uint64_t size) {
+    size_t nameLength = strlen(name);
+    out[0] = nameLength;
+    out[1] = isDir;
+    out[2] = pathLength;
+    out[3] = pathLength >> 8;
+    for (int i = 0; i < 4; i++) out[4 + i] = dirIndex >> (8 * i);
+    for (int i = 0; i < 8; i++) out[8 + i] = size >> (8 * i);
+    for (size_t i = 0; i < nameLength; i++) out[INDEX_RECORD_HEADER + i] = tolower((unsigned char)name[i]);
+    memcpy(out + INDEX_RECORD_HEADER + nameLength, path, pathLength);
+    return INDEX_RECORD_HEADER + nameLength + pathLength;
+}
+
+void decodeIndexRecord(const uint8_t* data, IndexRecord& record) {
+    record.data = data;
+    record.nameLength = data[0];
+    record.isDir = data[1] & 1;
+    record.pathLength = data[2] | data[3] << 8;
+    record.dirIndex = data[4] | data[5] << 8 | data[6] << 16 | (uint32_t)data[7] << 24;
+    record.size = 0;
+    for (int i = 7; i >= 0; i--) record.size = record.size << 8 | data[8 + i];
+}
+
+int compareIndexRecords(const uint8_t* a, const uint8_t* b) {
+    size_t aName = a[0], bName = b[0];
+    int order = memcmp(a + INDEX_RECORD_HEADER, b + INDEX_RECORD_HEADER, min(aName, bName));
+    if (order != 0 || aName != bName) return order != 0 ? order : (aName < bName ? -1 : 1);
+    size_t aPath = a[2] | a[3] << 8, bPath = b[2] | b[3] << 8;
+    order = memcmp(a + INDEX_RECORD_HEADER + aName, b + INDEX_RECORD_HEADER + bName, min(aPath, bPath));
+    return order != 0 ? order : (int)aPath - (int)bPath;
+}
+
+// Sequential record reader over a sorted run or the index itself.
+struct IndexReader {
+    FsFile* file = nullptr;
+    uint8_t* buffer = nullptr;
+    size_t capacity = 0;
+    bool aligned = false;     // Skip block padding (index file, not runs)
+    size_t start = 0, end = 0;
+    uint64_t bufferOffset = 0;  // File offset of buffer[0]
+
+    void begin(FsFile& f, uint8_t* b, size_t c, bool a) {
+        file = &f;
+        buffer = b;
+        capacity = c;
+        aligned = a;
+        start = end = 0;
+        bufferOffset = f.curPosition();
+    }
+
+    bool fill(size_t need) {
+        if (end - start >= need) return true;
+        memmove(buffer, buffer + start, end - start);
+        bufferOffset += start;
+        end -= start;
+        start = 0;
+        int got = file->read(buffer + end, capacity - end);
+        if (got > 0) end += got;
+        return end - start >= need;
+    }
+
+    bool next(IndexRecord& record) {
+        if (!fill(1)) return false;
+        if (buffer[start] == 0) {
+            if (!aligned) return false;
+            size_t skip = INDEX_BLOCK_SIZE - (bufferOffset + start) % INDEX_BLOCK_SIZE;
+            while (skip > 0) {
+                if (!fill(1)) return false;
+                size_t step = min(skip, end - start);
+                start += step;
+                skip -= step;
+            }
+            if (!fill(1) || buffer[start] == 0) return false;
+        }
+        if (!fill(INDEX_RECORD_HEADER)) return false;
+        size_t length = INDEX_RECORD_HEADER + buffer[start] + (buffer[start + 2] | buffer[start + 3] << 8);
+        if (!fill(length)) return false;
+        decodeIndexRecord(buffer + start, record);
+        start += length;
+        return true;
+    }
+};
+
+struct IndexWriter {
+    FsFile& file;
+    uint8_t* buffer;
+    size_t capacity;
+    bool aligned;
+    size_t used = 0;
+    uint64_t offset;  // File offset of buffer[0]
+    bool failed = false;
+
+    IndexWriter(FsFile& f, uint8_t* b, size_t c, bool a) : file(f), buffer(b), capacity(c), aligned(a), offset(f.curPosition()) {}
+
+    bool flush() {
+        if (used && PERF_TIMED(PERF_SD_WRITE, file.write(buffer, used)) != used) failed = true;
+        offset += used;
+        used = 0;
+        return !failed;
+    }
+
+    void pad() {
+        size_t padding = (INDEX_BLOCK_SIZE - (offset + used) % INDEX_BLOCK_SIZE) % INDEX_BLOCK_SIZE;
+        while (padding > 0) {
+            if (used == capacity) flush();
+            size_t step = min(padding, capacity - used);
+            memset(buffer + used, 0, step);
+            used += step;
+            padding -= step;
+        }
+    }
+
+    bool put(const uint8_t* record, size_t length) {
+        if (aligned && (offset + used) % INDEX_BLOCK_SIZE + length > INDEX_BLOCK_SIZE) pad();
+        if (used + length > capacity) flush();
+        memcpy(buffer + used, record, length);
+        used += length;
+        return !failed;
+    }
+};
+
+String indexRunName(uint32_t run) {
+    return INDEX_FILE ".run" + String(run);
+}
+
+// Collects records in RAM and spills them to the card as sorted runs. The
+// arena holds a write buffer, records growing up and their offsets growing
+// down from the end.
+struct IndexRunBuilder {
+    uint8_t* arena;
+    size_t arenaSize;
+    static const size_t writeBufferSize = 8 * 1024;
+    size_t recordEnd = writeBufferSize;
+    uint32_t count = 0;
+    uint32_t runs = 0;
+    unsigned long records = 0;
+
+    uint32_t* offsets() { return (uint32_t*)(arena + arenaSize) - count; }
+
+    bool spill() {
+        if (count == 0) return true;
+        std::sort(offsets(), offsets() + count,
+                  [this](uint32_t a, uint32_t b) { return compareIndexRecords(arena + a, arena + b) < 0; });
+        FsFile run = SD.sdfs.open(indexRunName(runs++).c_str(), O_WRONLY | O_CREAT | O_TRUNC);
+        if (!run) return false;
+        IndexWriter writer(run, arena, writeBufferSize, false);
+        IndexRecord record;
+        for (uint32_t i = 0; i < count; i++) {
+            decodeIndexRecord(arena + offsets()[i], record);
+            writer.put(record.data, record.length());
+        }
+        bool ok = writer.flush();
+        run.close();
+        recordEnd = writeBufferSize;
+        count = 0;
+        return ok;
+    }
+
+    bool add(const uint8_t* record, size_t length) {
+        if (recordEnd + length + (count + 1) * sizeof(uint32_t) > arenaSize && !spill()) return false;
+        memcpy(arena + recordEnd, record, length);
+        count++;
+        offsets()[0] = recordEnd;
+        recordEnd += length;
+        records++;
+        return true;
+    }
+};
+
+// Merges runs [first, last) into `out`, removing them afterwards.
+bool mergeIndexRuns(uint32_t first, uint32_t last, FsFile& out, bool aligned, uint8_t* arena, size_t arenaSize) {
+    const size_t outSize = 16 * 1024;
+    uint32_t inputs = last - first;
+    size_t slice = inputs ? (arenaSize - outSize) / inputs / SD_SECTOR_SIZE * SD_SECTOR_SIZE : 0;
+    FsFile files[INDEX_MERGE_FANIN];
+    IndexReader readers[INDEX_MERGE_FANIN];
+    IndexRecord heads[INDEX_MERGE_FANIN];
+    bool live[INDEX_MERGE_FANIN];
+    for (uint32_t i = 0; i < inputs; i++) {
+        files[i] = SD.sdfs.open(indexRunName(first + i).c_str(), O_RDONLY);
+        if (!files[i]) return false;
+        readers[i].begin(files[i], arena + outSize + i * slice, slice, false);
+        live[i] = readers[i].next(heads[i]);
+    }
+    IndexWriter writer(out, arena, outSize, aligned);
+    while (true) {
+        int smallest = -1;
+        for (uint32_t i = 0; i < inputs; i++) {
+            if (live[i] && (smallest < 0 || compareIndexRecords(heads[i].data, heads[smallest].data) < 0)) smallest = i;
+        }
+        if (smallest < 0) break;
+        if (!writer.put(heads[smallest].data, heads[smallest].length())) return false;
+        live[smallest] = readers[smallest].next(heads[smallest]);
+    }
+    if (aligned) writer.pad();
+    if (!writer.flush()) return false;
+    for (uint32_t i = 0; i < inputs; i++) {
+        files[i].close();
+        SD.sdfs.remove(indexRunName(first + i).c_str());
+    }
+    return true;
+}
+
+// Fills in the header block of a new index once its records are written.
+bool writeIndexHeader(FsFile& out, uint32_t records, uint32_t& blocks) {
+    blocks = out.fileSize() / INDEX_BLOCK_SIZE - 1;
+    uint8_t header[16];
+    memcpy(header, INDEX_MAGIC, 8);
+    for (int i = 0; i < 4; i++) header[8 + i] = records >> (8 * i);
+    for (int i = 0; i < 4; i++) header[12 + i] = blocks >> (8 * i);
+    return out.seekSet(0) && out.write(header, sizeof(header)) == sizeof(header);
+}
+
+// Turns the collected runs into a new INDEX_FILE and swaps it in.
+Error completeIndex(IndexRunBuilder& builder, uint8_t* arena, size_t arenaSize, uint32_t& blocks) {
+    Error err = builder.spill() ? Error::NONE : Error::WRITE_FAILED;
+    uint32_t first = 0, last = builder.runs;
+    while (err == Error::NONE && last - first > INDEX_MERGE_FANIN) {
+        FsFile merged = SD.sdfs.open(indexRunName(last).c_str(), O_WRONLY | O_CREAT | O_TRUNC);
+        if (!merged || !mergeIndexRuns(first, first + INDEX_MERGE_FANIN, merged, false, arena, arenaSize)) {
+            err = Error::WRITE_FAILED;
+        }
+        first += INDEX_MERGE_FANIN;
+        last++;
+    }
+
+    FsFile out = SD.sdfs.open(INDEX_FILE ".new", O_RDWR | O_CREAT | O_TRUNC);
+    if (err == Error::NONE) {
+        memset(arena, 0, INDEX_BLOCK_SIZE);
+        if (!out || PERF_TIMED(PERF_SD_WRITE, out.write(arena, INDEX_BLOCK_SIZE)) != INDEX_BLOCK_SIZE ||
+            !mergeIndexRuns(first, last, out, true, arena, arenaSize)) {
+            err = Error::WRITE_FAILED;
+        }
+    }
+    if (err == Error::NONE && !writeIndexHeader(out, builder.records, blocks)) err = Error::WRITE_FAILED;
+    out.close();
+    for (uint32_t run = 0; run < last; run++) SD.sdfs.remove(indexRunName(run).c_str());
+
+    if (err != Error::NONE) {
+        SD.sdfs.remove(INDEX_FILE ".new");
+        return err;
+    }
+    SD.sdfs.remove(INDEX_FILE);
+    SD.sdfs.rename(INDEX_FILE ".new", INDEX_FILE);
+    SD.sdfs.remove(INDEX_JOURNAL);
+    indexState = 1;
+    indexPendingLength = 0;
+    indexJournalBytes = 0;
+    spaceRecount();
+    return Error::NONE;
+}
+
+// Rebuilds the index: the walk feeds records to the run builder a slice at a
+// time, then the last step merges the runs into the new file.
+struct IndexJob : Job {
+    TreeWalker walker;
+    uint8_t* arena;
+    size_t arenaSize;
+    bool ownArena;
+    IndexRunBuilder builder{nullptr, 0};
+    Error err = Error::NONE;
+    bool complete = false;
+    uint32_t blocks = 0;
+
+    IndexJob() : Job("index", false) {
+        arena = external_psram_size ? (uint8_t*)extmem_malloc(INDEX_SORT_PSRAM_BYTES) : nullptr;
+        ownArena = arena != nullptr;
+        arenaSize = ownArena ? INDEX_SORT_PSRAM_BYTES : sizeof(ioBuffers);
+        if (!arena) arena = &ioBuffers[0][0];
+        builder = IndexRunBuilder{arena, arenaSize};
+    }
+    ~IndexJob() {
+        if (ownArena) extmem_free(arena);
+    }
+
+    bool step() override {
+        static uint8_t record[INDEX_RECORD_MAX];
+        WalkEvent event;
+        if (aborted || err != Error::NONE) return false;
+        if (!walker.next(event)) {
+            err = completeIndex(builder, arena, arenaSize, blocks);
+            complete = true;
+            return false;
+        }
+        if (event == WalkEvent::LEAVE_DIR) return true;
+        bool isDir = event == WalkEvent::ENTER_DIR;
+        if (isInternalName(walker.name())) {
+            if (isDir) walker.skipChildren();
+            return true;
+        }
+        size_t recordLength = encodeIndexRecord(record, walker.name(), isDir, walker.path, walker.length,
+                                                walker.entry.dirIndex(), isDir ? 0 : walker.entry.fileSize());
+        if (!builder.add(record, recordLength)) err = Error::WRITE_FAILED;
+        return true;
+    }
+
+    void progress() override {
+        SerialUSB.println("Indexed " + String(builder.records) + " entries (" + rate(builder.records) + ")");
+    }
+
+    void finish() override {
+        walker.finish();
+        if (!complete) {
+            for (uint32_t run = 0; run < builder.runs; run++) SD.sdfs.remove(indexRunName(run).c_str());
+        }
+        if (err != Error::NONE) SerialUSB.println("Error: Failed to write search index");
+        else if (aborted) SerialUSB.println("Aborted, index left as it was");
+        else SerialUSB.println("Indexed " + String(builder.records) + " entries into " + String(blocks) + " blocks in " +
+                               String(elapsed()) + " ms");
+    }
+};
+
+// Forgets the index when it can no longer be kept up to date; find falls
+// back to the cache and the card until the next rebuild.
+void indexDrop() {
+    SD.sdfs.remove(INDEX_FILE);
+    SD.sdfs.remove(INDEX_JOURNAL);
+    indexState = 0;
+    indexPendingLength = 0;
+    indexJournalBytes = 0;
+}
+
+bool indexAppendPending() {
+    if (indexPendingLength == 0) return true;
+    FsFile journal = SD.sdfs.open(INDEX_JOURNAL, O_WRONLY | O_CREAT | O_APPEND);
+    if (!journal || PERF_TIMED(PERF_SD_WRITE, journal.write(indexPending, indexPendingLength)) != indexPendingLength) {
+        return false;
+    }
+    indexJournalBytes = journal.fileSize();
+    indexPendingLength = 0;
+    return true;
+}
+
+void indexJournal(char op, const String& path, uint64_t size) {
+    if (!indexAvailable() || path.indexOf("/.sdpeek_") >= 0) return;
+    char normalized[BUNDLE_PATH_MAX];
+    size_t length = 0;
+    for (size_t i = 0; i < path.length() && length + 1 < sizeof(normalized); i++) {
+        if (path[i] == '/' && length > 0 && normalized[length - 1] == '/') continue;
+        normalized[length++] = path[i];
+    }
+    if (op != '-' && length > 1 && normalized[length - 1] == '/') length--;
+    normalized[length] = '\0';
+
+    char line[BUNDLE_PATH_MAX + 32];
+    size_t lineLength = op == 'F' ? snprintf(line, sizeof(line), "F %llu %s\n", (unsigned long long)size, normalized)
+                                  : snprintf(line, sizeof(line), "%c %s\n", op, normalized);
+    if (indexPendingLength + lineLength > sizeof(indexPending) && !indexAppendPending()) {
+        indexDrop();
+        return;
+    }
+    memcpy(indexPending + indexPendingLength, line, lineLength);
+    indexPendingLength += lineLength;
+}
+
+struct JournalEntry {
+    uint32_t hash;
+    uint16_t line;         // Offset of the entry's line in the journal text
+    uint16_t length : 15;  // Of the path
+    uint16_t live : 1;
+};
+
+// The shortest line, "- /\n", bounds how many entries a journal can hold
+static_assert(INDEX_JOURNAL_MAX < 65536, "Journal lines are addressed with 16-bit offsets");
+static_assert(INDEX_JOURNAL_MAX + 8 + (INDEX_JOURNAL_MAX / 4 + 1) * sizeof(JournalEntry) + 2 * INDEX_RECORD_MAX <=
+                  sizeof(ioBuffers),
+              "INDEX_JOURNAL_MAX of text and its entries must leave room in ioBuffers to read and write the index");
+
+uint32_t hashPath(const char* path, size_t length) {
+    uint32_t hash = 2166136261UL;
+    while (length--) hash = (hash ^ (uint8_t)*path++) * 16777619UL;
+    return hash;
+}
+
+// Up to INDEX_JOURNAL_MAX bytes of the journal, parsed in place at the start
+// of ioBuffers: the text, then an entry per line with "- /dir/" entries
+// first. find sorts the rest by path hash for lookups against index
+// records; compaction sorts them into index record order.
+struct IndexJournal {
+    char* text = (char*)&ioBuffers[0][0];
+    JournalEntry* entries = nullptr;
+    size_t count = 0;
+    size_t prefixCount = 0;
+    size_t used = 0;  // Bytes of ioBuffers taken
+
+    char op(const JournalEntry& entry) const { return text[entry.line]; }
+    const char* path(const JournalEntry& entry) const {
+        const char* rest = text + entry.line + 2;
+        return op(entry) == 'F' ? strchr(rest, ' ') + 1 : rest;
+    }
+    uint64_t size(const JournalEntry& entry) const {
+        return op(entry) == 'F' ? strtoull(text + entry.line + 2, nullptr, 10) : 0;
+    }
+
+    // Parses the whole lines among INDEX_JOURNAL_MAX bytes from `offset`;
+    // `consumed` is how many bytes they span.
+    bool load(FsFile& file, uint64_t offset, size_t& consumed) {
+        uint64_t remaining = file.fileSize() - offset;
+        size_t want = min(remaining, (uint64_t)INDEX_JOURNAL_MAX);
+        if (!file.seekSet(offset) || PERF_TIMED(PERF_SD_READ, file.read(text, want)) != (int)want) return false;
+        size_t length = want;
+        if (want < remaining) {
+            while (length > 0 && text[length - 1] != '\n') length--;
+            if (length == 0) return false;
+        }
+        consumed = length;
+        text[length] = '\0';
+        entries = (JournalEntry*)(text + (length + 8) / 8 * 8);
+        for (char* line = text; *line;) {
+            char* eol = strchr(line, '\n');
+            if (eol) *eol = '\0';
+            char* rest = line + 2;
+            if (line[0] == 'F') {
+                strtoull(rest, &rest, 10);
+                rest++;
+            }
+            if (line[1] == ' ' && *rest == '/') {
+                JournalEntry& entry = entries[count++];
+                entry.line = line - text;
+                entry.length = strlen(rest);
+                entry.hash = hashPath(rest, entry.length);
+            }
+            line = eol ? eol + 1 : line + strlen(line);
+        }
+        used = (char*)(entries + count) - text;
+        // The last operation on a path wins, and removing a directory's
+        // contents cancels earlier additions below it
+        for (size_t i = 0; i < count; i++) {
+            entries[i].live = op(entries[i]) != '-';
+            for (size_t j = i + 1; j < count && entries[i].live; j++) {
+                const char* later = path(entries[j]);
+                bool samePath = entries[j].hash == entries[i].hash && strcmp(later, path(entries[i])) == 0;
+                bool below = isPrefix(entries[j]) && strncmp(path(entries[i]), later, entries[j].length) == 0;
+                if (samePath || below) entries[i].live = false;
+            }
+        }
+        prefixCount = std::partition(entries, entries + count,
+                                     [this](const JournalEntry& entry) { return isPrefix(entry); }) - entries;
+        return true;
+    }
+
+    bool isPrefix(const JournalEntry& entry) const {
+        return op(entry) == '-' && path(entry)[entry.length - 1] == '/';
+    }
+
+    void sortByHash() {
+        std::sort(entries + prefixCount, entries + count,
+                  [](const JournalEntry& a, const JournalEntry& b) { return a.hash < b.hash; });
+    }
+
+    // The index record a non-prefix entry stands for; a removal is encoded
+    // too, so compaction can match it against the record it removes.
+    size_t encode(const JournalEntry& entry, uint8_t* record) const {
+        const char* entryPath = path(entry);
+        return encodeIndexRecord(record, strrchr(entryPath, '/') + 1, op(entry) == 'D', entryPath, entry.length, 0,
+                                 size(entry));
+    }
+
+    // At most one entry per path is live, so the order among them does not matter
+    void sortByRecord() {
+        static uint8_t a[INDEX_RECORD_MAX], b[INDEX_RECORD_MAX];
+        std::sort(entries + prefixCount, entries + count, [this](const JournalEntry& x, const JournalEntry& y) {
+            encode(x, a);
+            encode(y, b);
+            return compareIndexRecords(a, b) < 0;
+        });
+    }
+
+    bool belowPrefix(const char* path, size_t length) const {
+        for (size_t i = 0; i < prefixCount; i++) {
+            size_t prefixLength = entries[i].length;
+            if (length > prefixLength && memcmp(path, this->path(entries[i]), prefixLength) == 0) return true;
+        }
+        return false;
+    }
+
+    // True if the journal supersedes an index record for `path`; needs sortByHash().
+    bool shadows(const char* path, size_t length) const {
+        uint32_t hash = hashPath(path, length);
+        const JournalEntry* entry = std::lower_bound(entries + prefixCount, entries + count, hash,
+                                                     [](const JournalEntry& e, uint32_t h) { return e.hash < h; });
+        for (; entry < entries + count && entry->hash == hash; entry++) {
+            if (entry->length == length && memcmp(this->path(*entry), path, length) == 0) return true;
+        }
+        return belowPrefix(path, length);
+    }
+};
+
+// Merges one loaded piece of the journal into the index, writing the result
+// to INDEX_FILE ".new" and swapping it in. Both files are streamed through
+// what the journal leaves of ioBuffers.
+bool applyIndexJournal(const IndexJournal& journal) {
+    FsFile in = SD.sdfs.open(INDEX_FILE, O_RDONLY);
+    uint8_t header[16];
+    if (!in || in.read(header, sizeof(header)) != sizeof(header) || memcmp(header, INDEX_MAGIC, 8) != 0) return false;
+    FsFile out = SD.sdfs.open(INDEX_FILE ".new", O_RDWR | O_CREAT | O_TRUNC);
+    if (!out) return false;
+    uint8_t* spare = &ioBuffers[0][0] + (journal.used + 7) / 8 * 8;
+    size_t room = &ioBuffers[0][0] + sizeof(ioBuffers) - spare;
+    size_t readSize = room / 2, writeSize = room - readSize;
+    uint8_t* readBuffer = spare;
+    uint8_t* writeBuffer = spare + readSize;
+    memset(writeBuffer, 0, writeSize);
+    for (size_t done = 0; done < INDEX_BLOCK_SIZE;) {
+        size_t step = min(writeSize, INDEX_BLOCK_SIZE - done);
+        if (PERF_TIMED(PERF_SD_WRITE, out.write(writeBuffer, step)) != step) return false;
+        done += step;
+    }
+    in.seekSet(INDEX_BLOCK_SIZE);
+    IndexReader reader;
+    reader.begin(in, readBuffer, readSize, true);
+    IndexWriter writer(out, writeBuffer, writeSize, true);
+
+    static uint8_t added[INDEX_RECORD_MAX];
+    size_t next = journal.prefixCount, addedLength = 0;
+    if (next < journal.count) addedLength = journal.encode(journal.entries[next], added);
+    uint32_t records = 0;
+    IndexRecord record;
+    bool have = reader.next(record);
+    while (have || next < journal.count) {
+        int order = !have ? 1 : next == journal.count ? -1 : compareIndexRecords(record.data, added);
+        if (order <= 0) {
+            // A journal entry for the same path replaces the record
+            if (order < 0 && !journal.belowPrefix(record.path(), record.pathLength)) {
+                writer.put(record.data, record.length());
+                records++;
+            }
+            have = reader.next(record);
+            continue;
+        }
+        if (journal.entries[next].live) {
+            writer.put(added, addedLength);
+            records++;
+        }
+        if (++next < journal.count) addedLength = journal.encode(journal.entries[next], added);
+    }
+    writer.pad();
+    if (!writer.flush()) return false;
+    in.close();
+    uint32_t blocks;
+    if (!writeIndexHeader(out, records, blocks)) return false;
+    out.close();
+    SD.sdfs.remove(INDEX_FILE);
+    return SD.sdfs.rename(INDEX_FILE ".new", INDEX_FILE);
+}
+
+// Folds a full journal into the index, a loadable piece at a time, so the
+// journal stays within what find can load. Borrows ioBuffers, so it only
+// runs from the shell between commands and jobs.
+bool indexCompact() {
+    FsFile file = SD.sdfs.open(INDEX_JOURNAL, O_RDONLY);
+    if (!file) return false;
+    for (uint64_t offset = 0; offset < file.fileSize();) {
+        IndexJournal journal;
+        size_t consumed;
+        if (!journal.load(file, offset, consumed)) return false;
+        journal.sortByRecord();
+        if (!applyIndexJournal(journal)) {
+            SD.sdfs.remove(INDEX_FILE ".new");
+            return false;
+        }
+        offset += consumed;
+    }
+    file.close();
+    SD.sdfs.remove(INDEX_JOURNAL);
+    indexJournalBytes = 0;
+    spaceRecount();
+    return true;
+}
+
+// Appends the pending journal lines, compacting the journal into the index
+// once it outgrows INDEX_JOURNAL_MAX; called from loop() when idle.
+void indexFlush() {
+    if (!indexAvailable() || (indexPendingLength == 0 && indexJournalBytes <= INDEX_JOURNAL_MAX)) return;
+    if (!indexAppendPending() || (indexJournalBytes > INDEX_JOURNAL_MAX && !indexCompact())) indexDrop();
+}
+
+// Answers find from the index: a pattern with a literal name prefix
+// binary-searches the sorted blocks and stops once names pass the prefix,
+// anything else is a sequential scan. Returns false if there is no usable
+// index.
+bool findIndexed(const GlobPattern& glob, const String& base, bool& foundAny) {
+    indexFlush();
+    if (!indexAvailable()) return false;
+    FsFile file = SD.sdfs.open(INDEX_FILE, O_RDONLY);
+    uint8_t header[16];
+    if (!file || file.read(header, sizeof(header)) != sizeof(header) || memcmp(header, INDEX_MAGIC, 8) != 0) return false;
+    uint32_t blocks = header[12] | header[13] << 8 | header[14] << 16 | (uint32_t)header[15] << 24;
+    IndexJournal journal;
+    FsFile journalFile = SD.sdfs.open(INDEX_JOURNAL, O_RDONLY);
+    if (journalFile) {
+        size_t consumed;
+        if (!journal.load(journalFile, 0, consumed) || consumed != journalFile.fileSize()) return false;
+        journal.sortByHash();
+        journalFile.close();
+    }
+
+    const char* prefix = nullptr;
+    size_t prefixLength = glob.prefix(prefix);
+    auto matches = [&](const char* name, size_t nameLength, const char* path, size_t pathLength) {
+        if (!glob.pathPattern) return glob.matches(name, nameLength);
+        return glob.matches(path + base.length(), pathLength - base.length());
+    };
+
+    uint32_t startBlock = 1;
+    if (prefixLength && blocks > 0) {
+        // Last block whose first name sorts before the prefix
+        uint8_t first[INDEX_RECORD_HEADER + 255];
+        uint32_t low = 1, high = blocks;
+        while (low < high) {
+            uint32_t mid = (low + high + 1) / 2;
+            if (!file.seekSet((uint64_t)mid * INDEX_BLOCK_SIZE) || PERF_TIMED(PERF_SD_READ, file.read(first, sizeof(first))) != (int)sizeof(first)) break;
+            size_t compared = min((size_t)first[0], prefixLength);
+            int order = memcmp(first + INDEX_RECORD_HEADER, prefix, compared);
+            if (order < 0 || (order == 0 && first[0] < prefixLength)) low = mid;
+            else high = mid - 1;
+        }
+        startBlock = low;
+    }
+
+    auto belowBase = [&](const char* path, size_t length) {
+        return length > base.length() && memcmp(path, base.c_str(), base.length()) == 0;
+    };
+
+    file.seekSet((uint64_t)startBlock * INDEX_BLOCK_SIZE);
+    IndexReader reader;
+    size_t skip = (journal.used + 7) / 8 * 8;
+    reader.begin(file, &ioBuffers[0][0] + skip, sizeof(ioBuffers) - skip, true);
+    IndexRecord record;
+    while (reader.next(record)) {
+        if (prefixLength && memcmp(record.name(), prefix, min((size_t)record.nameLength, prefixLength)) > 0) break;
+        if (!belowBase(record.path(), record.pathLength) ||
+            !matches(record.name(), record.nameLength, record.path(), record.pathLength) ||
+            journal.shadows(record.path(), record.pathLength)) {
+            continue;
+        }
+        foundAny = true;
+        printMatch(record.path(), record.pathLength, record.isDir, record.size);
+    }
+
+    for (size_t i = 0; i < journal.count; i++) {
+        const JournalEntry& entry = journal.entries[i];
+        const char* path = journal.path(entry);
+        if (!entry.live || !belowBase(path, entry.length)) continue;
+        const char* name = strrchr(path, '/') + 1;
+        if (matches(name, path + entry.length - name, path, entry.length)) {
+            foundAny = true;
+            printMatch(path, entry.length, journal.op(entry) == 'D', journal.size(entry));
+        }
+    }
+    return true;
+}
+
+// Searches the card itself when neither the index nor the cache can answer.
+struct FindJob : Job {
+    TreeWalker walker;
+    GlobPattern glob;
+    String pattern;
+    unsigned long matches = 0;
+
+    FindJob(const GlobPattern& glob, const String& pattern) : Job("find", false), glob(glob), pattern(pattern) {}
+
+    bool step() override {
+        WalkEvent event;
+        if (aborted || !walker.next(event)) return false;
+        if (event == WalkEvent::LEAVE_DIR) return true;
+        if (isInternalName(walker.name())) {
+            if (event == WalkEvent::ENTER_DIR) walker.skipChildren();
+            return true;
+        }
+        const char* subject = glob.pathPattern ? walker.relative() + 1 : walker.name();
+        if (glob.matches(subject, walker.path + walker.length - subject)) {
+            matches++;
+            bool isDir = event == WalkEvent::ENTER_DIR;
+            printMatch(walker.path, walker.length, isDir, isDir ? 0 : walker.entry.fileSize());
+        }
+        return true;
+    }
+
+    void progress() override {
+        SerialUSB.println("Searched " + String(walker.stats.entries) + " entries (" + rate(walker.stats.entries) + ")");
+    }
+
+    void finish() override {
+        walker.finish();
+        if (aborted) SerialUSB.println("Search aborted after " + String(lastWalk.entries) + " entries");
+        else if (!matches) SerialUSB.println("No matches found for '" + pattern + "'");
+    }
+};
+
+// Searches below the current directory using the index, then the metadata
+// cache, then a walk of the card run as a job.
+Error findFiles(const String& pattern) {
+    GlobPattern glob;
+    if (!glob.compile(pattern.c_str())) {
+        SerialUSB.println("Error: Pattern too long");
+        return Error::NONE;
+    }
+    bool foundAny = false;
+    if (!findIndexed(glob, currentPath, foundAny)) {
+        uint32_t cached = cacheDirectory(currentPath);
+        if (cached != CACHE_NONE && cacheLoadTree(cached)) {
+            char path[BUNDLE_PATH_MAX];
+            size_t length = min((size_t)currentPath.length(), sizeof(path) - 1);
+            memcpy(path, currentPath.c_str(), length);
+            path[length] = '\0';
+            findCached(cached, glob, path, length, length, foundAny);
+        } else {
+            FindJob* job = new FindJob(glob, pattern);
+            if (!job->walker.begin(currentPath.c_str())) {
+                delete job;
+                return Error::NOT_A_DIRECTORY;
+            }
+            startJob(job);
+            return Error::NONE;
+        }
+    }
+    if (!foundAny) SerialUSB.println("No matches found for '" + pattern + "'");
+    return Error::NONE;
+}
+
+// Boyer-Moore-Horspool substring search: the window advances by how far the
+// byte under its last position sits from the end of the pattern, so most of
+// the text is skipped without being compared. One-byte patterns use memchr.
+struct SubstringSearch {
+    uint8_t pattern[GREP_PATTERN_MAX];
+    uint8_t length = 0;
+    uint8_t shift[256];
+
+    bool compile(const char* text, size_t n) {
+        if (n == 0 || n > GREP_PATTERN_MAX) return false;
+        memcpy(pattern, text, n);
+        length = n;
+        memset(shift, length, sizeof(shift));
+        for (size_t i = 0; i + 1 < n; i++) shift[pattern[i]] = n - 1 - i;
+        return true;
+    }
+
+    const uint8_t* find(const uint8_t* from, const uint8_t* end) const {
+        if (length == 1) return (const uint8_t*)memchr(from, pattern[0], end - from);
+        uint8_t last = pattern[length - 1];
+        for (const uint8_t* p = from; end - p >= length; p += shift[p[length - 1]]) {
+            if (p[length - 1] == last && memcmp(p, pattern, length - 1) == 0) return p;
+        }
+        return nullptr;
+    }
+};
+
+// Searches file contents below a directory (or one file) for a fixed string,
+// printing "<path>:<line>:<text>" once per matching line. Files are read in
+// IO_BLOCK_SIZE blocks into ioBuffers, which are used as one buffer: the
+// unfinished last line of each block is moved to the front and searched again
+// with the next block, so matches across block boundaries are found and every
+// match comes with its whole line. Lines longer than a block are searched in
+// pieces and printed around the match.
+struct GrepJob : Job {
+    TreeWalker walker;
+    FsFile single;            // The file, when grepping just one
+    String singlePath;
+    FsFile* file = nullptr;   // File being scanned, if any
+    SubstringSearch search;
+    size_t carry = 0;         // Unfinished line kept at the front of the buffer
+    bool midLine = false;     // The buffer starts inside an over-long line
+    uint32_t lineNumber = 1;
+    uint32_t reportedLine = 0;  // Last line printed, so a line spanning blocks is printed once
+    unsigned long files = 0, matches = 0;
+    uint64_t bytes = 0;
+
+    GrepJob() : Job("grep", false) {}
+
+    void printLine(const uint8_t* lineStart, const uint8_t* lineEnd, const uint8_t* match, bool cut) {
+        if (lineEnd > lineStart && lineEnd[-1] == '\r') lineEnd--;
+        const uint8_t* from = match - lineStart > GREP_CONTEXT ? match - GREP_CONTEXT : lineStart;
+        const uint8_t* to = lineEnd - match > GREP_CONTEXT ? match + GREP_CONTEXT : lineEnd;
+        if (file == &single) SerialUSB.print(singlePath);
+        else PERF_TIMED(PERF_USB_WRITE, SerialUSB.write((const uint8_t*)walker.path, walker.length));
+        SerialUSB.printf(":%lu:%s", (unsigned long)lineNumber, cut || from > lineStart ? "..." : "");
+        PERF_TIMED(PERF_USB_WRITE, SerialUSB.write(from, to - from));
+        SerialUSB.println(to < lineEnd ? "..." : "");
+    }
+
+    // Searches buffer[0, length), which starts at a line start unless
+    // midLine; `atEnd` when it holds the rest of the file. Returns how many
+    // bytes at the end to carry over into the next block.
+    size_t scan(uint8_t* buffer, size_t length, bool atEnd) {
+        const uint8_t* end = buffer + length;
+        const uint8_t* searchEnd = end;  // Matches lie wholly before this
+        const uint8_t* carryFrom = end;
+        if (!atEnd) {
+            const uint8_t* newline = end;
+            while (newline > buffer && newline[-1] != '\n') newline--;
+            if (newline > buffer && end - newline <= IO_BLOCK_SIZE) {
+                searchEnd = carryFrom = newline;
+            } else {
+                carryFrom = end - (search.length - 1);  // Too long to keep; only a match's head can straddle
+            }
+        }
+        const uint8_t* lineStart = buffer;
+        const uint8_t* counted = buffer;
+        bool cut = midLine;
+        for (const uint8_t* p = buffer; p < searchEnd && (p = search.find(p, searchEnd)) != nullptr;) {
+            while (const uint8_t* newline = (const uint8_t*)memchr(counted, '\n', p - counted)) {
+                lineNumber++;
+                lineStart = counted = newline + 1;
+                cut = false;
+            }
+            counted = p;
+            const uint8_t* lineEnd = (const uint8_t*)memchr(p, '\n', end - p);
+            if (lineNumber != reportedLine) {
+                printLine(lineStart, lineEnd ? lineEnd : end, p, cut);
+                matches++;
+                reportedLine = lineNumber;
+            }
+            p = lineEnd ? lineEnd + 1 : searchEnd;
+        }
+        while (const uint8_t* newline = (const uint8_t*)memchr(counted, '\n', carryFrom - counted)) {
+            lineNumber++;
+            counted = newline + 1;
+        }
+        midLine = !atEnd && carryFrom != searchEnd;
+        return end - carryFrom;
+    }
+
+    bool step() override {
+        if (aborted) return false;
+        if (!file) {
+            if (single) {
+                if (files) return false;
+                file = &single;
+            } else {
+                WalkEvent event;
+                if (!walker.next(event)) return false;
+                if (isInternalName(walker.name())) {
+                    if (event == WalkEvent::ENTER_DIR) walker.skipChildren();
+                    return true;
+                }
+                if (event != WalkEvent::FILE) return true;
+                file = &walker.entry;
+            }
+            carry = 0;
+            midLine = false;
+            lineNumber = 1;
+            reportedLine = 0;
+        }
+        uint8_t* buffer = &ioBuffers[0][0];
+        int got = PERF_TIMED(PERF_SD_READ, file->read(buffer + carry, IO_BLOCK_SIZE));
+        got = max(got, 0);
+        bytes += got;
+        bool atEnd = got < IO_BLOCK_SIZE || file->curPosition() >= file->fileSize();
+        size_t keep = scan(buffer, carry + got, atEnd);
+        memmove(buffer, buffer + carry + got - keep, keep);
+        carry = keep;
+        if (atEnd) {
+            file = nullptr;
+            files++;
+        }
+        return true;
+    }
+
+    void progress() override {
+        SerialUSB.println("Searched " + String(files) + " files, " + formatSize(bytes) + " (" +
+                          String((double)bytes / max(elapsed(), 1UL) / 1000.0, 2) + " MB/s)");
+    }
+
+    void finish() override {
+        walker.finish();
+        single.close();
+        if (aborted) SerialUSB.println("Search aborted after " + String(files) + " files");
+        else if (!matches) SerialUSB.println("No matches in " + String(files) + " files");
+    }
+};
+
+// grep <pattern> [path]: the pattern is a fixed string, in double quotes if
+// it contains spaces; the path defaults to the current directory.
+Error grepFiles(const String& args) {
+    String pattern, path;
+    if (args.startsWith("\"") && args.indexOf('"', 1) > 0) {
+        pattern = args.substring(1, args.indexOf('"', 1));
+        path = args.substring(args.indexOf('"', 1) + 1);
+    } else {
+        int space = args.indexOf(' ');
+        pattern = space < 0 ? args : args.substring(0, space);
+        path = space < 0 ? "" : args.substring(space + 1);
+    }
+    path.trim();
+    if (path.length() == 0) path = currentPath;
+    else if (!path.startsWith("/")) path = currentPath + path;
+
+    GrepJob* job = new GrepJob();
+    if (!job->search.compile(pattern.c_str(), pattern.length())) {
+        delete job;
+        return Error::INVALID_PATH;
+    }
+    if (!job->walker.begin(path.c_str())) {
+        job->single = PERF_TIMED(PERF_SD_OPEN, SD.sdfs.open(path.c_str(), O_RDONLY));
+        if (!job->single || job->single.isDir()) {
+            delete job;
+            return Error::FILE_NOT_FOUND;
+        }
+        job->singlePath = path;
+    }
+    startJob(job);
+    return Error::NONE;
+}
+
+// Duplicate files by content (dupes). A walk lists each non-empty file's
+// size and path in DEDUPE_FILE and marks its size in two bit filters, seen
+// once and seen again. Files whose size was seen again are loaded into a
+// table in a fixed arena; if they do not all fit, the largest are kept and
+// smaller sizes are left out of the report. The table is then narrowed in
+// stages, keeping only records that still share their size and CRC-32 with
+// another: first the CRC covers the first DEDUPE_HEAD_BYTES, then it is
+// extended over the rest of the file. So most files are never opened, and
+// only files whose size and first block match another's are read in full.
+struct DedupeRecord {
+    uint64_t size;
+    uint32_t path;  // Offset of the file's entry in DEDUPE_FILE
+    uint32_t crc;   // Of the first block, then of the whole file
+};
+
+struct DedupeJob : Job {
+    enum Phase { WALK, SELECT, HEAD, FULL, REPORT } phase = WALK;
+    TreeWalker walker;
+    FsFile list;               // DEDUPE_FILE: size (8), path length (2) and path per file
+    FsFile file;               // File being hashed
+    uint8_t* arena = nullptr;
+    bool arenaInPsram = false;  // Which allocator the arena came from
+    uint8_t* seenOnce = nullptr;
+    uint8_t* seenTwice = nullptr;
+    uint8_t filterShift = 64;  // 64 - log2 of the bits per filter
+    DedupeRecord* records = nullptr;
+    uint32_t capacity = 0, count = 0, next = 0;
+    uint64_t cutoff = 0;       // Files this size or smaller did not fit in the table
+    bool heaped = false;
+    uint64_t remaining = 0;    // Bytes left to hash in `file`
+    unsigned long files = 0, unreadable = 0, groups = 0, copies = 0;
+    uint64_t hashedBytes = 0, reclaimable = 0;
+    Error err = Error::NONE;
+
+    DedupeJob() : Job("dupes", false) {
+        arenaInPsram = external_psram_size;
+        size_t budget = arenaInPsram ? DEDUPE_PSRAM_BYTES : DEDUPE_RAM_BYTES;
+        arena = (uint8_t*)(arenaInPsram ? extmem_malloc(budget) : malloc(budget));
+        if (!arena) return;
+        size_t filterBytes = 1;
+        while (filterBytes * 2 <= budget / 8) filterBytes *= 2;
+        filterShift = 64 - (__builtin_ctz(filterBytes) + 3);
+        seenOnce = arena;
+        seenTwice = arena + filterBytes;
+        memset(arena, 0, 2 * filterBytes);
+        records = (DedupeRecord*)(arena + 2 * filterBytes);
+        capacity = (budget - 2 * filterBytes) / sizeof(DedupeRecord);
+    }
+    ~DedupeJob() {
+        if (arena && arenaInPsram) extmem_free(arena);
+        else free(arena);
+    }
+
+    uint32_t filterBit(uint64_t size) const { return (size * 0x9E3779B97F4A7C15ULL) >> filterShift; }
+    static bool testBit(const uint8_t* bits, uint32_t bit) { return bits[bit >> 3] & (1 << (bit & 7)); }
+    static void setBit(uint8_t* bits, uint32_t bit) { bits[bit >> 3] |= 1 << (bit & 7); }
+
+    static bool sameGroup(const DedupeRecord& a, const DedupeRecord& b) { return a.size == b.size && a.crc == b.crc; }
+
+    // Sorts by size and CRC and keeps only records that share both with a neighbour.
+    void keepGroups() {
+        std::sort(records, records + count, [](const DedupeRecord& a, const DedupeRecord& b) {
+            return a.size != b.size ? a.size < b.size : a.crc < b.crc;
+        });
+        uint32_t kept = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            if ((i > 0 && sameGroup(records[i - 1], records[i])) || (i + 1 < count && sameGroup(records[i], records[i + 1]))) {
+                records[kept++] = records[i];
+            }
+        }
+        count = kept;
+        next = 0;
+    }
+
+    // Adds a candidate; once the table is full it becomes a min-heap on size
+    // and the smallest file makes way, raising the cutoff.
+    void addCandidate(uint64_t size, uint32_t path) {
+        auto larger = [](const DedupeRecord& a, const DedupeRecord& b) { return a.size > b.size; };
+        if (size <= cutoff || !capacity) {
+            cutoff = max(cutoff, size);
+            return;
+        }
+        if (count < capacity) {
+            records[count++] = {size, path, 0};
+            return;
+        }
+        if (!heaped) {
+            std::make_heap(records, records + count, larger);
+            heaped = true;
+        }
+        if (size <= records[0].size) {
+            cutoff = max(cutoff, size);
+            return;
+        }
+        cutoff = max(cutoff, records[0].size);
+        std::pop_heap(records, records + count, larger);
+        records[count - 1] = {size, path, 0};
+        std::push_heap(records, records + count, larger);
+    }
+
+    bool readListEntry(uint32_t offset, char* path, uint64_t& size) {
+        uint8_t header[10];
+        if (!list.seekSet(offset) || list.read(header, sizeof(header)) != (int)sizeof(header)) return false;
+        memcpy(&size, header, 8);
+        uint16_t length = header[8] | header[9] << 8;
+        if (length >= BUNDLE_PATH_MAX || list.read(path, length) != length) return false;
+        path[length] = '\0';
+        return true;
+    }
+
+    // Opens the file behind records[next] for hashing; an unreadable file
+    // is swapped out of the table.
+    bool openRecord() {
+        char path[BUNDLE_PATH_MAX];
+        uint64_t size;
+        if (readListEntry(records[next].path, path, size)) {
+            file = PERF_TIMED(PERF_SD_OPEN, SD.sdfs.open(path, O_RDONLY));
+            if (file && file.fileSize() == size) return true;
+            file.close();
+        }
+        unreadable++;
+        records[next] = records[--count];
+        return false;
+    }
+
+    bool hashBlock(DedupeRecord& record, size_t length) {
+        int got = PERF_TIMED(PERF_SD_READ, file.read(ioBuffers[0], length));
+        if (got != (int)length) {
+            file.close();
+            unreadable++;
+            record = records[--count];
+            return false;
+        }
+        record.crc = crc32Update(record.crc, ioBuffers[0], length);
+        hashedBytes += length;
+        return true;
+    }
+
+    bool step() override {
+        if (aborted || err != Error::NONE) return false;
+        switch (phase) {
+        case WALK: {
+            WalkEvent event;
+            if (!walker.next(event)) {
+                phase = SELECT;
+                if (!list.seekSet(0)) err = Error::READ_FAILED;
+                return true;
+            }
+            if (isInternalName(walker.name())) {
+                if (event == WalkEvent::ENTER_DIR) walker.skipChildren();
+                return true;
+            }
+            if (event != WalkEvent::FILE || walker.entry.fileSize() == 0) return true;
+            uint64_t size = walker.entry.fileSize();
+            uint16_t length = walker.length;
+            uint8_t header[10];
+            memcpy(header, &size, 8);
+            header[8] = length;
+            header[9] = length >> 8;
+            if (list.write(header, sizeof(header)) != sizeof(header) || list.write(walker.path, length) != length) {
+                err = Error::WRITE_FAILED;
+                return false;
+            }
+            uint32_t bit = filterBit(size);
+            if (testBit(seenOnce, bit)) setBit(seenTwice, bit);
+            setBit(seenOnce, bit);
+            files++;
+            return true;
+        }
+        case SELECT: {
+            uint8_t header[10];
+            uint32_t offset = list.curPosition();
+            if (list.read(header, sizeof(header)) != (int)sizeof(header)) {
+                uint32_t kept = 0;
+                for (uint32_t i = 0; i < count; i++) {
+                    if (records[i].size > cutoff) records[kept++] = records[i];
+                }
+                count = kept;
+                keepGroups();
+                phase = HEAD;
+                return true;
+            }
+            uint64_t size;
+            memcpy(&size, header, 8);
+            list.seekCur(header[8] | header[9] << 8);
+            if (testBit(seenTwice, filterBit(size))) addCandidate(size, offset);
+            return true;
+        }
+        case HEAD: {
+            if (next >= count) {
+                keepGroups();
+                phase = FULL;
+                return true;
+            }
+            if (!openRecord()) return true;
+            DedupeRecord& record = records[next];
+            record.crc = 0;
+            if (hashBlock(record, min(record.size, (uint64_t)DEDUPE_HEAD_BYTES))) next++;
+            file.close();
+            return true;
+        }
+        case FULL: {
+            if (!file) {
+                while (next < count && records[next].size <= DEDUPE_HEAD_BYTES) next++;
+                if (next >= count) {
+                    keepGroups();
+                    phase = REPORT;
+                    return true;
+                }
+                if (!openRecord()) return true;
+                if (!file.seekSet(DEDUPE_HEAD_BYTES)) {
+                    file.close();
+                    unreadable++;
+                    records[next] = records[--count];
+                    return true;
+                }
+                remaining = records[next].size - DEDUPE_HEAD_BYTES;
+            }
+            size_t length = min(remaining, (uint64_t)IO_BLOCK_SIZE);
+            if (!hashBlock(records[next], length)) return true;
+            remaining -= length;
+            if (!remaining) {
+                file.close();
+                next++;
+            }
+            return true;
+        }
+        case REPORT: {
+            if (next >= count) return false;
+            uint32_t end = next + 1;
+            while (end < count && sameGroup(records[next], records[end])) end++;
+            SerialUSB.println(String(end - next) + " copies of " + formatSize(records[next].size) + ":");
+            char path[BUNDLE_PATH_MAX];
+            uint64_t size;
+            for (uint32_t i = next; i < end; i++) {
+                if (readListEntry(records[i].path, path, size)) SerialUSB.println("  " + String(path));
+            }
+            groups++;
+            copies += end - next - 1;
+            reclaimable += (end - next - 1) * records[next].size;
+            next = end;
+            return true;
+        }
+        }
+        return false;
+    }
+
+    void progress() override {
+        if (phase == WALK) SerialUSB.println("Listed " + String(files) + " files (" + rate(files) + ")");
+        else if (phase == HEAD) SerialUSB.println("Checked first blocks of " + String(next) + " of " + String(count) + " files");
+        else if (phase == FULL) SerialUSB.println("Hashed " + formatSize(hashedBytes) + ", file " + String(next + 1) + " of " + String(count));
+    }
+
+    void finish() override {
+        walker.finish();
+        file.close();
+        list.close();
+        SD.sdfs.remove(DEDUPE_FILE);
+        if (err != Error::NONE) {
+            SerialUSB.println("Error: Failed to write " DEDUPE_FILE);
+            return;
+        }
+        if (aborted) {
+            SerialUSB.println("Duplicate search aborted");
+            return;
+        }
+        SerialUSB.println("\n" + String(groups) + " groups of duplicates among " + String(files) + " files, " +
+                          String(copies) + " redundant copies, " + formatSize(reclaimable) + " reclaimable (read " +
+                          formatSize(hashedBytes) + ")");
+        if (cutoff) SerialUSB.println("Files of " + formatSize(cutoff) + " or less were not compared, too many candidates for memory");
+        if (unreadable) SerialUSB.println(String(unreadable) + " files could not be read");
+    }
+};
+
+Error findDuplicates(const String& path) {
+    DedupeJob* job = new DedupeJob();
+    if (!job->arena) {
+        delete job;
+        SerialUSB.println("Error: Not enough memory");
+        return Error::NONE;
+    }
+    if (!job->walker.begin(path.c_str())) {
+        delete job;
+        return Error::NOT_A_DIRECTORY;
+    }
+    job->list = SD.sdfs.open(DEDUPE_FILE, O_RDWR | O_CREAT | O_TRUNC);
+    if (!job->list) {
+        delete job;
+        return Error::WRITE_FAILED;
+    }
+    startJob(job);
+    return Error::NONE;
+}
+
+// Directory listings (ls). Entries come from the metadata cache when the
+// directory fits, otherwise from the card. Unsorted output follows the
+// directory's own order. Sorted output is selected in passes over the
+// directory: each pass keeps, in a heap the size of ioBuffers, the entries
+// that come first among those after the last one already printed, so memory
+// stays fixed however large the directory is; a deep page costs more passes,
+// not more RAM. Sizes and dates are formatted into stack buffers.
+enum class LsSort { NONE, NAME, SIZE, DATE };
+
+struct LsEntry {
+    uint64_t size;
+    uint32_t stamp;  // FAT date << 16 | time, so later compares greater
+    bool isDir;
+    char name[256];
+};
+
+struct LsOptions {
+    LsSort sort = LsSort::NONE;
+    uint32_t top = 0, page = 0;  // 0 when not given
+    bool summary = false;
+};
+
+// Calls `visit(entry)` for each entry of a directory until it returns false.
+template <typename Visitor>
+Error lsEntries(const String& path, Visitor visit) {
+    LsEntry entry;
+    uint32_t cached = cacheDirectory(path);
+    if (cached != CACHE_NONE) {
+        const CacheEntry& dir = cache.entries[cached];
+        for (uint32_t i = dir.firstChild; i < dir.firstChild + dir.childCount; i++) {
+            const CacheEntry& child = cache.entries[i];
+            const char* name = cacheName(i);
+            size_t length = min(strlen(name), sizeof(entry.name) - 1);
+            memcpy(entry.name, name, length);
+            entry.name[length] = '\0';
+            entry.isDir = child.isDir;
+            entry.size = child.size;
+            entry.stamp = (uint32_t)child.date << 16 | child.time;
+            if (!visit(entry)) break;
+        }
+        return Error::NONE;
+    }
+    FsFile dir = PERF_TIMED(PERF_SD_OPEN, SD.sdfs.open(path.c_str(), O_RDONLY));
+    if (!dir) return Error::FILE_NOT_FOUND;
+    if (!dir.isDir()) return Error::NOT_A_DIRECTORY;
+    FsFile child;
+    while (PERF_TIMED(PERF_SD_OPEN_NEXT, child.openNext(&dir, O_RDONLY))) {
+        uint16_t date = 0, time = 0;
+        child.getName(entry.name, sizeof(entry.name));
+        child.getModifyDateTime(&date, &time);
+        entry.isDir = child.isDir();
+        entry.size = entry.isDir ? 0 : child.fileSize();
+        entry.stamp = (uint32_t)date << 16 | time;
+        child.close();
+        if (!visit(entry)) break;
+    }
+    return Error::NONE;
+}
+
+// Largest first by size, newest first by date, then by name.
+bool lsBefore(LsSort sort, const LsEntry& a, const LsEntry& b) {
+    if (sort == LsSort::SIZE && a.size != b.size) return a.size > b.size;
+    if (sort == LsSort::DATE && a.stamp != b.stamp) return a.stamp > b.stamp;
+    int order = strcasecmp(a.name, b.name);
+    return order ? order < 0 : strcmp(a.name, b.name) < 0;
+}
+
+const char* formatStamp(char* out, size_t length, uint32_t stamp) {
+    uint16_t date = stamp >> 16, time = stamp & 0xFFFF;
+    snprintf(out, length, "%04u-%02u-%02u %02u:%02u", FAT_YEAR(date), FAT_MONTH(date), FAT_DAY(date), FAT_HOUR(time),
+             FAT_MINUTE(time));
+    return out;
+}
+
+void printEntry(const LsEntry& entry, bool withDate) {
+    char text[24];
+    if (entry.isDir) SerialUSB.printf("+ %s/", entry.name);
+    else SerialUSB.printf("  %s  %s", entry.name, formatSize(text, sizeof(text), entry.size));
+    if (withDate) SerialUSB.printf("  %s", formatStamp(text, sizeof(text), entry.stamp));
+    SerialUSB.print("\r\n");
+}
+
+Error listSummary(const String& path) {
+    unsigned long files = 0, dirs = 0;
+    uint64_t total = 0, allocated = 0;
+    LsEntry largest, newest, oldest;
+    largest.size = 0;
+    newest.stamp = 0;
+    oldest.stamp = UINT32_MAX;
+    Error err = lsEntries(path, [&](const LsEntry& entry) {
+        if (entry.isDir) {
+            dirs++;
+            return true;
+        }
+        files++;
+        total += entry.size;
+        allocated += (uint64_t)clustersFor(entry.size) * space.bytesPerCluster;
+        if (entry.size > largest.size) largest = entry;
+        if (entry.stamp > newest.stamp) newest = entry;
+        if (entry.stamp < oldest.stamp) oldest = entry;
+        return true;
+    });
+    if (err != Error::NONE) return err;
+    char size[24], stamp[24];
+    SerialUSB.printf("%lu files, %lu directories, %s", files, dirs, formatSize(size, sizeof(size), total));
+    SerialUSB.printf(" (%s allocated)\r\n", formatSize(size, sizeof(size), allocated));
+    if (!files) return Error::NONE;
+    SerialUSB.printf("Largest: %s (%s)\r\n", largest.name, formatSize(size, sizeof(size), largest.size));
+    SerialUSB.printf("Newest:  %s (%s)\r\n", newest.name, formatStamp(stamp, sizeof(stamp), newest.stamp));
+    SerialUSB.printf("Oldest:  %s (%s)\r\n", oldest.name, formatStamp(stamp, sizeof(stamp), oldest.stamp));
+    return Error::NONE;
+}
+
+Error listDirectory(const String& path, const LsOptions& options) {
+    if (options.summary) return listSummary(path);
+    uint64_t first = options.page ? (uint64_t)(options.page - 1) * LS_PAGE_SIZE : 0;
+    uint64_t count = options.top ? options.top : options.page ? LS_PAGE_SIZE : UINT64_MAX;
+    bool withDate = options.sort == LsSort::DATE;
+    uint64_t total = 0, shown = 0;
+
+    if (options.sort == LsSort::NONE) {
+        Error err = lsEntries(path, [&](const LsEntry& entry) {
+            if (total++ >= first && shown < count) {
+                printEntry(entry, withDate);
+                shown++;
+            }
+            return options.page > 0 || shown < count;  // A page reports the total
+        });
+        if (err != Error::NONE) return err;
+    } else {
+        LsEntry* heap = (LsEntry*)ioBuffers;
+        size_t capacity = sizeof(ioBuffers) / sizeof(LsEntry);
+        auto before = [&](const LsEntry& a, const LsEntry& b) { return lsBefore(options.sort, a, b); };
+        LsEntry cursor;  // Last entry placed by the previous pass
+        bool haveCursor = false;
+        for (uint64_t placed = 0; placed < first + count;) {
+            size_t want = min((uint64_t)capacity, first + count - placed);
+            size_t held = 0;
+            total = 0;
+            Error err = lsEntries(path, [&](const LsEntry& entry) {
+                total++;
+                if (haveCursor && !lsBefore(options.sort, cursor, entry)) return true;
+                if (held == want) {
+                    if (!lsBefore(options.sort, entry, heap[0])) return true;
+                    std::pop_heap(heap, heap + held--, before);
+                }
+                heap[held++] = entry;
+                std::push_heap(heap, heap + held, before);
+                return true;
+            });
+            if (err != Error::NONE) return err;
+            std::sort_heap(heap, heap + held, before);
+            for (size_t i = 0; i < held; i++, placed++) {
+                if (placed < first) continue;
+                printEntry(heap[i], withDate);
+                shown++;
+            }
+            if (held < want) break;
+            cursor = heap[held - 1];
+            haveCursor = true;
+        }
+    }
+
+    if (options.page) {
+        uint64_t pages = max((total + LS_PAGE_SIZE - 1) / LS_PAGE_SIZE, (uint64_t)1);
+        if (!shown) SerialUSB.printf("No entries on page %lu\r\n", (unsigned long)options.page);
+        SerialUSB.printf("Page %lu of %lu (%lu entries)\r\n", (unsigned long)options.page, (unsigned long)pages,
+                         (unsigned long)total);
+    } else if (options.top && options.sort != LsSort::NONE) {
+        SerialUSB.printf("Top %lu of %lu entries\r\n", (unsigned long)shown, (unsigned long)total);
+    }
+    return Error::NONE;
+}
+
+// Disk usage (du). Totals are kept on a stack with one level per open
+// directory: a file adds to the innermost level, and a directory's totals are
+// final when it is left, at which point they fold into its parent. Only the
+// largest directories and files are kept, in two fixed top-N heaps, so memory
+// does not grow with the tree. Allocated sizes round every file up to whole
+// clusters and count one cluster per directory. When the tree fits in the
+// metadata cache the totals come from there, so a repeat run only rereads the
+// directories that changed since; otherwise the card is walked as a job.
+struct DuTotals {
+    uint64_t logical = 0, allocated = 0;
+    uint32_t files = 0;
+
+    void add(const DuTotals& other) {
+        logical += other.logical;
+        allocated += other.allocated;
+        files += other.files;
+    }
+};
+
+struct DuTop {
+    struct Item {
+        DuTotals totals;
+        char path[BUNDLE_PATH_MAX];
+    };
+    Item items[DU_TOP_MAX];
+    uint8_t count = 0, limit = DU_TOP_DEFAULT;
+
+    static bool larger(const Item& a, const Item& b) { return a.totals.allocated > b.totals.allocated; }
+
+    // A min-heap on allocated size once full, so the smallest makes way.
+    void offer(const char* path, size_t length, const DuTotals& totals) {
+        if (count == limit && totals.allocated <= items[0].totals.allocated) return;
+        if (count == limit) std::pop_heap(items, items + count--, larger);
+        Item& item = items[count++];
+        item.totals = totals;
+        length = min(length, sizeof(item.path) - 1);
+        memcpy(item.path, path, length);
+        item.path[length] = '\0';
+        std::push_heap(items, items + count, larger);
+    }
+
+    void print(const char* title) {
+        if (!count) return;
+        std::sort_heap(items, items + count, larger);
+        SerialUSB.println(title);
+        for (uint8_t i = 0; i < count; i++) {
+            SerialUSB.printf("  %10s %10s %8lu  %s\r\n", formatSize(items[i].totals.allocated).c_str(),
+                             formatSize(items[i].totals.logical).c_str(), (unsigned long)items[i].totals.files, items[i].path);
+        }
+    }
+};
+
+struct DuTally {
+    DuTotals levels[WALK_MAX_DEPTH + 1];  // levels[0] is the root
+    int depth = 0;
+    uint32_t dirs = 0, skipped = 0;
+    DuTop topDirs, topFiles;
+
+    uint64_t allocated(uint64_t size) const {
+        return space.bytesPerCluster ? (uint64_t)clustersFor(size) * space.bytesPerCluster : size;
+    }
+
+    // Returns false when the directory is too deep to keep its own level;
+    // its contents are then counted in the deepest one.
+    bool enter() {
+        dirs++;
+        if (depth == WALK_MAX_DEPTH) {
+            skipped++;
+            return false;
+        }
+        levels[++depth] = DuTotals();
+        levels[depth].allocated = allocated(1);
+        return true;
+    }
+
+    void leave(const char* path, size_t length) {
+        DuTotals totals = levels[depth--];
+        topDirs.offer(path, length, totals);
+        levels[depth].add(totals);
+    }
+
+    void file(const char* path, size_t length, uint64_t size) {
+        DuTotals totals;
+        totals.logical = size;
+        totals.allocated = allocated(size);
+        totals.files = 1;
+        levels[depth].add(totals);
+        topFiles.offer(path, length, totals);
+    }
+
+    void print(const String& path, uint32_t micros) {
+        const DuTotals& total = levels[0];
+        SerialUSB.println("\nDisk usage of " + path + ": " + formatSize(total.logical) + " in " + String(total.files) +
+                          " files and " + String(dirs) + " directories, " + formatSize(total.allocated) + " allocated (" +
+                          String(micros / 1000.0, 1) + " ms)");
+        topDirs.print("\nLargest directories:   allocated    logical    files");
+        topFiles.print("\nLargest files:         allocated    logical    files");
+    }
+};
+
+// Tallies a cached tree; `path` holds the directory's path and is extended
+// in place for each level.
+void duCached(uint32_t dir, char* path, size_t length, DuTally& tally) {
+    const CacheEntry& folder = cache.entries[dir];
+    for (uint32_t i = folder.firstChild; i < folder.firstChild + folder.childCount; i++) {
+        const char* name = cacheName(i);
+        size_t nameLength = strlen(name);
+        if (length + nameLength + 2 > BUNDLE_PATH_MAX) continue;
+        path[length] = '/';
+        memcpy(path + length + 1, name, nameLength + 1);
+        size_t childLength = length + 1 + nameLength;
+        if (!cache.entries[i].isDir) {
+            tally.file(path, childLength, cache.entries[i].size);
+        } else if (tally.enter()) {
+            duCached(i, path, childLength, tally);
+            tally.leave(path, childLength);
+        } else {
+            duCached(i, path, childLength, tally);
+        }
+    }
+    path[length] = '\0';
 }
 
-Error listDirectory(File& dir) {
-    if (!dir) return Error::FILE_NOT_FOUND;
-    File entry;
-    while (entry = dir.openNextFile()) {
-        SerialUSB.print(entry.isDirectory() ? "+ " : "  ");
-        SerialUSB.print(entry.name());
-        if (entry.isDirectory()) SerialUSB.println("/");
-        else SerialUSB.println("  " + formatSize(entry.size()));
-        entry.close();
+struct DuJob : Job {
+    TreeWalker walker;
+    DuTally tally;
+    String path;
+    // Whether each open directory got a level of its own
+    bool levels[WALK_MAX_DEPTH + 1];
+    int open = 0;
+
+    DuJob(const String& path) : Job("du", false), path(path) {}
+
+    bool step() override {
+        WalkEvent event;
+        if (aborted || !walker.next(event)) return false;
+        if (event == WalkEvent::FILE) {
+            tally.file(walker.path, walker.length, walker.entry.fileSize());
+        } else if (event == WalkEvent::ENTER_DIR) {
+            levels[open++] = tally.enter();
+        } else if (levels[--open]) {
+            tally.leave(walker.path, walker.length);
+        }
+        return true;
     }
-    return Error::NONE;
-}
 
-Error printFile(const String& path) {
-    File file = SD.open(path.c_str());
-    if (!file) return Error::FILE_NOT_FOUND;
-    if (file.isDirectory()) {
-        file.close();
-        return Error::NOT_A_DIRECTORY;
+    void progress() override {
+        SerialUSB.println("Walked " + String(walker.stats.entries) + " entries (" + rate(walker.stats.entries) + ")");
     }
-    SerialUSB.println("\n=== File: " + path + " ===");
-    uint32_t bytesRead = 0;
-    while (file.available() && bytesRead < MAX_FILE_PREVIEW) {
-        SerialUSB.write(file.read());
-        bytesRead++;
+
+    void finish() override {
+        walker.finish();
+        if (aborted) SerialUSB.println("du aborted after " + String(lastWalk.entries) + " entries");
+        else tally.print(path, lastWalk.micros);
+    }
+};
+
+Error diskUsage(const String& path, uint8_t top) {
+    uint32_t start = micros();
+    uint32_t cached = cacheDirectory(path);
+    if (cached != CACHE_NONE && cacheLoadTree(cached)) {
+        DuTally* tally = new DuTally();
+        tally->topDirs.limit = tally->topFiles.limit = top;
+        char buffer[BUNDLE_PATH_MAX];
+        size_t length = min((size_t)path.length(), sizeof(buffer) - 1);
+        while (length > 0 && path[length - 1] == '/') length--;
+        memcpy(buffer, path.c_str(), length);
+        buffer[length] = '\0';
+        duCached(cached, buffer, length, *tally);
+        tally->print(path, micros() - start);
+        delete tally;
+        return Error::NONE;
     }
-    if (file.available()) {
-        SerialUSB.println("\n\n[Output truncated... File size: " + formatSize(file.size()) + "]");
+    DuJob* job = new DuJob(path);
+    job->tally.topDirs.limit = job->tally.topFiles.limit = top;
+    if (!job->walker.begin(path.c_str())) {
+        delete job;
+        return Error::NOT_A_DIRECTORY;
     }
-    file.close();
+    startJob(job);
     return Error::NONE;
 }
-Error sendDirectory(const String& path) {
-    File dir = SD.open(path.c_str());
-    if (!dir || !dir.isDirectory()) return Error::NOT_A_DIRECTORY;
 
-    // First, count all files recursively
-    unsigned long fileCount = countFilesRecursive(dir);
-    dir.close();
+Error countItems(const String& path, unsigned long& fileCount, unsigned long& dirCount) {
+    File dir = PERF_TIMED(PERF_SD_OPEN, SD.open(path.c_str()));
+    if (!dir || !dir.isDirectory()) return Error::NOT_A_DIRECTORY;
 
-    // Send total file count
-    SerialUSB.println(String("DIR_COUNT:") + fileCount);
-    
-    // If no files found, end early
-    if (fileCount == 0) {
-        SerialUSB.println("DIR_DONE");
-        return Error::NONE;
-    }
+    fileCount = 0;
+    dirCount = 0;
+    uint64_t totalSize = 0;
 
-    // Reopen directory for sending files
-    dir = SD.open(path.c_str());
-    
-    // Helper function to process directory recursively
-    std::function<void(File&, const String&)> processDirectory = [&](File& dir, const String& currentPath) {
-        File entry = dir.openNextFile();
-        while (entry) {
-            String entryPath = currentPath + "/" + entry.name();
-            
+    uint32_t cached = cacheDirectory(path);
+    if (cached != CACHE_NONE) {
+        const CacheEntry& folder = cache.entries[cached];
+        for (uint32_t i = folder.firstChild; i < folder.firstChild + folder.childCount; i++) {
+            if (cache.entries[i].isDir) {
+                dirCount++;
+            } else {
+                fileCount++;
+                totalSize += cache.entries[i].size;
+            }
+        }
+    } else {
+        File entry;
+        while (entry = PERF_TIMED(PERF_SD_OPEN_NEXT, dir.openNextFile())) {
             if (entry.isDirectory()) {
-                processDirectory(entry, entryPath);
+                dirCount++;
             } else {
-                // Send file info with full relative path
-                SerialUSB.println(String("FILE:") + entryPath);
-                SerialUSB.println(entry.size());
-                
-                // Send file contents
-                uint32_t remaining = entry.size();
-                while (remaining > 0) {
-                    uint32_t chunk = min(512UL, remaining);
-                    uint8_t buffer[512];
-                    entry.read(buffer, chunk);
-                    SerialUSB.write(buffer, chunk);
-                    remaining -= chunk;
-                }
-                SerialUSB.println("FILE_DONE");
+                fileCount++;
+                totalSize += entry.size();
             }
             entry.close();
-            entry = dir.openNextFile();
         }
-    };
-
-    // Start recursive processing from root
-    processDirectory(dir, "");
+    }
     
     dir.close();
-    SerialUSB.println("DIR_DONE");
+    
+    SerialUSB.println("\nDirectory Count Summary:");
+    SerialUSB.println("----------------------");
+    SerialUSB.println("Files: " + String(fileCount));
+    SerialUSB.println("Directories: " + String(dirCount));
+    SerialUSB.println("Total Size: " + formatSize(totalSize));
+    
     return Error::NONE;
 }
 
+// Deletes everything below a directory: files as the walk reaches them,
+// directories once it has left them. Each entry is reopened for writing by
+// its index in the directory the walk already holds open, so a deletion never
+// resolves a path from the root or scans a large directory for a name. The
+// free space figure is settled once per progress line rather than per entry.
+// With `removeRoot` (rm -r) the directory itself goes last. Every deletion
+// leaves the card consistent, so an abort keeps whatever was not reached.
+struct ClearJob : Job {
+    TreeWalker walker;
+    String path;
+    bool removeRoot;
+    Error err = Error::NONE;
+    unsigned long files = 0, folders = 0;
+    uint64_t freed = 0, unsettled = 0;      // Bytes of whole clusters released
+    uint32_t dirIndex[WALK_MAX_DEPTH + 1];  // Of each directory entered, in its parent
+    int open = 0;
 
+    ClearJob(const String& path, bool removeRoot)
+        : Job(removeRoot ? "rm -r" : "clearfolder", false), path(path), removeRoot(removeRoot) {}
 
-void showFreeSpace() {
-    File root = SD.open("/");
-    if (root) {
-        uint64_t totalSpace = root.size();
-        uint64_t usedSpace = 0;
-        File file = root.openNextFile();
-        while (file) {
-            if (!file.isDirectory()) usedSpace += file.size();
-            file = root.openNextFile();
-        }
-        SerialUSB.println("\nSD Card Information:");
-        SerialUSB.println("-------------------");
-        SerialUSB.println("Total Size: " + formatSize(totalSpace));
-        SerialUSB.println("Used Space: " + formatSize(usedSpace));
-        SerialUSB.println("Free Space: " + formatSize(totalSpace - usedSpace));
-        root.close();
+    // The walk's current directory is the parent of the entry at `index`.
+    bool removeAt(uint32_t index, bool directory) {
+        FsFile victim;
+        if (!PERF_TIMED(PERF_SD_OPEN, victim.open(&walker.dirs[walker.depth], index, directory ? O_RDONLY : O_WRONLY))) return false;
+        return directory ? victim.rmdir() : victim.remove();
     }
-}
 
-Error syncDirectory(const String& localPath, const String& remotePath = DEFAULT_SYNC_DIR) {
-    String actualRemotePath = remotePath.length() == 0 ? DEFAULT_SYNC_DIR : remotePath;
-    if (!SD.exists(actualRemotePath.c_str()) && !SD.mkdir(actualRemotePath.c_str())) {
-        SerialUSB.println("Error: Failed to create sync directory");
-        return Error::INVALID_PATH;
+    void released(uint64_t bytes) {
+        bytes = (uint64_t)clustersFor(bytes) * space.bytesPerCluster;
+        freed += bytes;
+        unsettled += bytes;
     }
-    SerialUSB.println("Ready to receive files. Start transfer from host.");
-    unsigned long fileCount = 0, processedFiles = 0;
-    while (true) {
-        String command = SerialUSB.readStringUntil('\n');
-        command.trim();
-        if (command == "SYNC_COMPLETE") break;
-        if (command.startsWith("FILE_COUNT:")) {
-            fileCount = command.substring(11).toInt();
-            continue;
-        }
-        if (command.startsWith("FILE:")) {
-            String filePath = actualRemotePath + "/" + command.substring(5);
-            Error err = receiveFile(filePath);
-            if (err != Error::NONE) return err;
-            processedFiles++;
-            printProgress(processedFiles, fileCount);
+
+    void settle() {
+        if (unsettled) spaceChanged(unsettled, 0);
+        unsettled = 0;
+    }
+
+    bool step() override {
+        WalkEvent event;
+        if (aborted || err != Error::NONE || !walker.next(event)) return false;
+        if (event == WalkEvent::FILE) {
+            uint64_t size = walker.entry.fileSize();
+            uint32_t index = walker.entry.dirIndex();
+            walker.entry.close();
+            if (!removeAt(index, false)) {
+                err = Error::REMOVE_FAILED;
+            } else {
+                files++;
+                released(size);
+            }
+        } else if (event == WalkEvent::ENTER_DIR) {
+            dirIndex[open++] = walker.entry.dirIndex();
         } else {
-            SerialUSB.println("Error: Invalid sync command");
-            return Error::INVALID_PATH;
+            if (!removeAt(dirIndex[--open], true)) {
+                err = Error::REMOVE_FAILED;
+            } else {
+                folders++;
+                released(space.bytesPerCluster);
+            }
         }
+        return true;
     }
-    SerialUSB.println("\nSync completed");
-    return Error::NONE;
-}
 
-Error receiveFile(const String& path) {
-    File file = SD.open(path.c_str(), FILE_WRITE);
-    if (!file) {
-        SerialUSB.println("Error: Unable to create file");
-        return Error::FILE_NOT_FOUND;
+    void progress() override {
+        settle();
+        SerialUSB.println("Removed " + String(files) + " files, " + String(folders) + " folders, " + formatSize(freed) +
+                          " (" + rate(files) + ")");
     }
-    uint32_t fileSize = SerialUSB.parseInt();
-    SerialUSB.println("Receiving file: " + String(path));
-    SerialUSB.read(); // Consume newline
-    uint32_t bytesReceived = 0;
-    while (bytesReceived < fileSize) {
-        if (SerialUSB.available()) {
-            file.write(SerialUSB.read());
-            bytesReceived++;
+
+    void finish() override {
+        walker.finish();
+        if (removeRoot && !aborted && err == Error::NONE) {
+            if (!SD.sdfs.rmdir(path.c_str())) err = Error::REMOVE_FAILED;
+            else released(space.bytesPerCluster);
         }
+        settle();
+        cacheInvalidate(path);
+        // The journal already records the whole folder as gone
+        if (aborted || err != Error::NONE) indexDrop();
+        String counts = String(files) + " files, " + String(folders) + " folders, " + formatSize(freed);
+        if (err != Error::NONE) SerialUSB.println("Error: Failed to remove files or subdirectories (" + counts + " removed)");
+        else if (aborted) SerialUSB.println("Aborted, " + counts + " removed");
+        else SerialUSB.println(String(removeRoot ? "Directory removed" : "Directory cleared") + " successfully (" + counts +
+                               " in " + String(elapsed()) + " ms, " + rate(files) + ")");
     }
-    SerialUSB.println("Received " + String(bytesReceived) + " bytes");
+};
 
+// Empties a directory, or with `removeRoot` deletes it as well, after one
+// confirmation.
+Error clearFolder(const String& path, bool removeRoot) {
+    FsFile dir = PERF_TIMED(PERF_SD_OPEN, SD.sdfs.open(path.c_str(), O_RDONLY));
+    if (!dir || !dir.isDir()) return Error::NOT_A_DIRECTORY;
+    dir.close();
 
-    file.close();
-    SerialUSB.println("FILE_RECEIVED");
+    String action = removeRoot ? "delete the directory " + path + " and everything in it"
+                               : "clear (delete everything in) the directory " + path;
+    confirmAction(action, [path, removeRoot]() {
+        ClearJob* job = new ClearJob(path, removeRoot);
+        if (!job->walker.begin(path.c_str())) {
+            delete job;
+            SerialUSB.println("Error: Not a directory");
+            return;
+        }
+        cacheInvalidate(path);
+        indexJournal('-', path + "/");
+        if (removeRoot) indexJournal('-', path);
+        startJob(job);
+    });
     return Error::NONE;
 }
 
-void printProgress(unsigned long current, unsigned long total) {
-    int percent = (current * 100) / total;
-    SerialUSB.print(F("\rProgress: "));
-    SerialUSB.print(percent);
-    SerialUSB.print(F("%"));
-    SerialUSB.flush();
+// `bench` measures the card and the link at the block sizes transfers use.
+// Every call is timed with the cycle counter; totals count every call and a
+// reservoir of BENCH_SAMPLES of them gives the percentiles. Block sizes
+// beyond the staging buffers (IO_BLOCK_SIZE overrides) are left out.
+const uint32_t benchBlockSizes[] = {512, 4096, 16384, 65536};
+
+size_t benchBlockCount() {
+    size_t count = 0;
+    while (count < sizeof(benchBlockSizes) / sizeof(benchBlockSizes[0]) && benchBlockSizes[count] <= sizeof(ioBuffers)) count++;
+    return count;
 }
 
-Error folderSummary(const String& path) {
-    File dir = SD.open(path.c_str());
-    if (!dir || !dir.isDirectory()) return Error::NOT_A_DIRECTORY;
+struct BenchLatency {
+    uint32_t count = 0, maxCycles = 0;
+    uint32_t samples[BENCH_SAMPLES];
 
-    unsigned long fileCount = 0;
-    uint64_t totalSize = 0;
-    std::map<String, unsigned long> fileNames;
+    void reset() { count = maxCycles = 0; }
 
-    File entry;
-    while (entry = dir.openNextFile()) {
-        if (!entry.isDirectory()) {
-            String fileName = entry.name();
-            fileCount++;
-            totalSize += entry.size();
-            fileNames[fileName]++;
-        }
-        entry.close();
+    void add(uint32_t cycles) {
+        uint32_t slot = count < BENCH_SAMPLES ? count : random(count + 1);
+        if (slot < BENCH_SAMPLES) samples[slot] = cycles;
+        if (cycles > maxCycles) maxCycles = cycles;
+        count++;
     }
 
-    SerialUSB.println(F("\nFolder Summary:"));
-    SerialUSB.println(F("---------------"));
-    SerialUSB.println("Total files: " + String(fileCount));
-    SerialUSB.println("Total size: " + formatSize(totalSize));
+    // Sorts the samples; call once the test is over, before percentile().
+    void sort() { std::sort(samples, samples + min(count, (uint32_t)BENCH_SAMPLES)); }
 
-    unsigned long duplicates = 0;
-    for (const auto& pair : fileNames) {
-        if (pair.second > 1) duplicates++;
+    double percentile(double fraction) const {
+        uint32_t n = min(count, (uint32_t)BENCH_SAMPLES);
+        return n ? samples[min((uint32_t)(n * fraction), n - 1)] / (F_CPU_ACTUAL / 1e6) : 0;
     }
-    SerialUSB.println("Duplicate files: " + String(duplicates));
+    double maxMicros() const { return maxCycles / (F_CPU_ACTUAL / 1e6); }
+};
 
-    dir.close();
-    return Error::NONE;
-}
+struct BenchJob : Job {
+    enum Test { WRITE_GROW, WRITE_PREALLOC, READ_SEQ, READ_RANDOM, WRITE_RANDOM, TESTS };
+    const char* const names[TESTS] = {"write, growing", "write, prealloc", "read, sequential", "read, random", "write, random"};
+    uint64_t size;
+    size_t blockIndex = 0, blockCount;
+    int test = -1;
+    uint32_t ops = 0, done = 0;
+    uint32_t testStart = 0;
+    uint8_t* buffer = &ioBuffers[0][0];
+    FsFile file;
+    BenchLatency latency;
+    Error err = Error::NONE;
 
-Error findFiles(const String& pattern, const String& currentDir) {
-    File dir = SD.open(currentDir.length() > 0 ? currentDir.c_str() : currentPath.c_str());
-    if (!dir || !dir.isDirectory()) return Error::NOT_A_DIRECTORY;
+    BenchJob(uint64_t size) : Job("bench", false), size(size), blockCount(benchBlockCount()) {
+        for (size_t i = 0; i < sizeof(ioBuffers); i++) buffer[i] = i * 7 + (i >> 9);
+    }
 
-    File entry;
-    bool foundAny = false;
-    String basePath = currentDir.length() > 0 ? currentDir : currentPath;
-    
-    while (entry = dir.openNextFile()) {
-        String entryName = entry.name();
-        String fullPath = basePath + entryName;
-        
-        // Convert both strings to lowercase for case-insensitive comparison
-        String lowerPattern = pattern;
-        String lowerName = entryName;
-        lowerPattern.toLowerCase();
-        lowerName.toLowerCase();
-        
-        // Check if the pattern matches
-        if (lowerName.indexOf(lowerPattern) != -1) {
-            foundAny = true;
-            SerialUSB.print(fullPath);
-            if (entry.isDirectory()) {
-                SerialUSB.println("/");
-            } else {
-                SerialUSB.println("  (" + formatSize(entry.size()) + ")");
+    uint32_t block() const { return benchBlockSizes[blockIndex]; }
+    bool randomAccess() const { return test == READ_RANDOM || test == WRITE_RANDOM; }
+    bool writing() const { return test == WRITE_GROW || test == WRITE_PREALLOC || test == WRITE_RANDOM; }
+
+    bool step() override {
+        if (aborted || err != Error::NONE) return false;
+        if (test < 0 || done == ops) {
+            if (test >= 0) endTest();
+            if (++test == TESTS) {
+                test = 0;
+                blockIndex++;
             }
+            return blockIndex < blockCount && beginTest();
         }
-        
-        // Recursively search in subdirectories
-        if (entry.isDirectory()) {
-            String newPath = fullPath + "/";
-            findFiles(pattern, newPath);
+        uint32_t length = block();
+        uint32_t start = ARM_DWT_CYCCNT;
+        bool ok = !randomAccess() || file.seekSet((uint64_t)random(size / length) * length);
+        if (ok && writing()) ok = file.write(buffer, length) == length;
+        else if (ok) ok = file.read(buffer, length) == (int)length;
+        latency.add(ARM_DWT_CYCCNT - start);
+        if (!ok) err = writing() ? Error::WRITE_FAILED : Error::READ_FAILED;
+        done++;
+        return true;
+    }
+
+    bool beginTest() {
+        done = 0;
+        ops = size / block();
+        if (randomAccess()) ops = min(ops, (uint32_t)BENCH_RANDOM_OPS);
+        latency.reset();
+        if (test == WRITE_GROW || test == WRITE_PREALLOC) {
+            // Both write tests start from a fresh file; the rest reuse the last one
+            file.close();
+            SD.sdfs.remove(BENCH_FILE);
+            file = SD.sdfs.open(BENCH_FILE, O_RDWR | O_CREAT | O_TRUNC);
+            if (!file) {
+                err = Error::WRITE_FAILED;
+                return false;
+            }
+            if (test == WRITE_PREALLOC && !file.preAllocate(size)) {
+                SerialUSB.println("  " + formatSize(block()) + " " + names[test] + ": not supported on this volume");
+                ops = 0;
+            }
         }
-        
-        entry.close();
+        if (!file.seekSet(0)) err = Error::READ_FAILED;
+        testStart = micros();
+        return err == Error::NONE;
     }
-    
-    dir.close();
-    if (!foundAny && currentDir.length() == 0) {
-        SerialUSB.println("No matches found for '" + pattern + "'");
+
+    void endTest() {
+        if (writing() && !file.sync()) err = Error::WRITE_FAILED;
+        uint32_t taken = micros() - testStart;
+        if (ops == 0 || err != Error::NONE) return;
+        latency.sort();
+        SerialUSB.printf("  %7s %-17s %8.2f MB/s %8.0f IOPS  p50 %8.1f us  p99 %8.1f us  max %8.1f us\r\n", formatSize(block()).c_str(),
+                         names[test], (double)ops * block() / max(taken, 1UL), ops * 1e6 / max(taken, 1UL), latency.percentile(0.5),
+                         latency.percentile(0.99), latency.maxMicros());
+    }
+
+    void progress() override {
+        if (test >= 0 && blockIndex < blockCount) {
+            SerialUSB.println(formatSize(block()) + " " + names[test] + ": " + String(done * 100 / max(ops, 1UL)) + "%");
+        }
+    }
+
+    void finish() override {
+        file.close();
+        SD.sdfs.remove(BENCH_FILE);
+        spaceRecount();
+        if (err != Error::NONE) SerialUSB.println("Error: " + String(writing() ? "Write" : "Read") + " failed during " + names[test] + " at " + formatSize(block()));
+        else if (aborted) SerialUSB.println("Benchmark aborted");
+        else SerialUSB.println("Benchmark done in " + String(elapsed() / 1000.0, 1) + " s");
     }
+};
+
+Error benchCard(uint32_t megabytes) {
+    uint64_t size = (uint64_t)megabytes << 20;
+    if (space.known && (uint64_t)space.freeClusters * space.bytesPerCluster < size + space.bytesPerCluster) return Error::WRITE_FAILED;
+    SerialUSB.println("Benchmarking the card with a " + formatSize(size) + " scratch file (" BENCH_FILE ")");
+    startJob(new BenchJob(size));
     return Error::NONE;
 }
 
-Error countItems(const String& path, unsigned long& fileCount, unsigned long& dirCount) {
-    File dir = SD.open(path.c_str());
-    if (!dir || !dir.isDirectory()) return Error::NOT_A_DIRECTORY;
+// USB half of `bench`, driven by usb_benchmark() in sync.py. The device sends
+// "BENCH_USB:<bytes per block size>:<block sizes>" and streams that many bytes
+// at each block size in turn, then sinks the same amount from the host and
+// reports both directions: "BENCH_USB_OUT:<block>:<micros>:<writes>:<p50>:
+// <p99>:<max>" (latencies in us), "BENCH_USB_IN:<bytes>:<micros>" and finally
+// "BENCH_USB_DONE".
+Error benchUsb(uint32_t megabytes) {
+    struct Result {
+        uint32_t micros, writes;
+        double p50, p99, max;
+    };
+    static BenchLatency latency;
+    size_t blocks = benchBlockCount();
+    Result results[sizeof(benchBlockSizes) / sizeof(benchBlockSizes[0])];
+    uint32_t segment = megabytes << 20;
+    uint8_t* buffer = &ioBuffers[0][0];
 
-    fileCount = 0;
-    dirCount = 0;
-    uint64_t totalSize = 0;
+    SerialUSB.println("BENCH_USB:" + String(segment) + ":" + String(blocks));
+    for (size_t i = 0; i < blocks; i++) {
+        uint32_t length = benchBlockSizes[i];
+        latency.reset();
+        uint32_t start = micros();
+        for (uint32_t sent = 0; sent < segment; sent += length) {
+            uint32_t callStart = ARM_DWT_CYCCNT;
+            SerialUSB.write(buffer, length);
+            latency.add(ARM_DWT_CYCCNT - callStart);
+        }
+        SerialUSB.flush();
+        results[i].micros = micros() - start;
+        results[i].writes = latency.count;
+        latency.sort();
+        results[i].p50 = latency.percentile(0.5);
+        results[i].p99 = latency.percentile(0.99);
+        results[i].max = latency.maxMicros();
+    }
 
-    File entry;
-    while (entry = dir.openNextFile()) {
-        if (entry.isDirectory()) {
-            dirCount++;
+    uint32_t received = 0, firstByte = 0, lastData = millis();
+    while (received < segment) {
+        int available = SerialUSB.available();
+        if (available > 0) {
+            if (!received) firstByte = micros();
+            received += SerialUSB.readBytes((char*)buffer, min((uint32_t)available, min(segment - received, (uint32_t)sizeof(ioBuffers))));
+            lastData = millis();
+        } else if (millis() - lastData > SERIAL_TIMEOUT) {
+            return Error::TIMEOUT;
         } else {
-            fileCount++;
-            totalSize += entry.size();
+            yield();
         }
-        entry.close();
     }
-    
-    dir.close();
-    
-    SerialUSB.println("\nDirectory Count Summary:");
-    SerialUSB.println("----------------------");
-    SerialUSB.println("Files: " + String(fileCount));
-    SerialUSB.println("Directories: " + String(dirCount));
-    SerialUSB.println("Total Size: " + formatSize(totalSize));
-    
+    uint32_t inMicros = micros() - firstByte;
+
+    for (size_t i = 0; i < blocks; i++) {
+        SerialUSB.println("BENCH_USB_OUT:" + String(benchBlockSizes[i]) + ":" + String(results[i].micros) + ":" + String(results[i].writes) +
+                          ":" + String(results[i].p50, 1) + ":" + String(results[i].p99, 1) + ":" + String(results[i].max, 1));
+    }
+    SerialUSB.println("BENCH_USB_IN:" + String(received) + ":" + String(inMicros));
+    SerialUSB.println("BENCH_USB_DONE");
     return Error::NONE;
 }
 
-Error clearFolder(const String& path) {
-    // Attempt to open the specified path
-    File dir = SD.open(path.c_str());
-    if (!dir || !dir.isDirectory()) {
-        if (dir) dir.close();
-        return Error::NOT_A_DIRECTORY;
+// Splits up to `count` trailing numeric arguments off `args`, leaving the
+// path, and stores them in `values` in the order given; returns how many.
+size_t takeNumbers(String& args, uint64_t* values, size_t count) {
+    uint64_t found[4];
+    size_t n = 0;
+    args.trim();
+    while (n < count && n < 4) {
+        int space = args.lastIndexOf(' ');
+        if (space < 0) break;
+        String token = args.substring(space + 1);
+        if (strspn(token.c_str(), "0123456789") != token.length()) break;
+        found[n++] = strtoull(token.c_str(), nullptr, 10);
+        args.remove(space);
+        args.trim();
     }
+    for (size_t i = 0; i < n; i++) values[i] = found[n - 1 - i];
+    return n;
+}
 
-    // Ask for user confirmation before proceeding
-    if (!confirmAction("clear (delete everything in) the directory " + path)) {
-        dir.close();
-        return Error::NONE;  // User declined, so do nothing
-    }
+// Machine-readable mode for hosts, entered with `rpc` and left with `exit`.
+// Each request is one line, "<id> <method> [args]", and each gets one
+// response: a header line "@<id> <code> <length>", then exactly <length>
+// bytes of compact JSON and a newline. The code is the request's Error value,
+// 0 on success; on failure the payload is {"error":"<NAME>"}. Requests are
+// answered in order and nothing else is printed while the mode is on, so a
+// host may send a batch of requests before reading any of the responses.
+bool rpcActive = false;
 
-    // Clear out the contents of the directory
-    File entry;
-    while ((entry = dir.openNextFile())) {
-        String entryName = entry.name();
-        String fullPath = path;
-        if (!fullPath.endsWith("/")) fullPath += "/";
-        fullPath += entryName;
+const char* const errorNames[] = {"NONE", "FILE_NOT_FOUND", "NOT_A_DIRECTORY", "INVALID_PATH", "SD_INIT_FAILED", "REMOVE_FAILED",
+                                  "IS_DIRECTORY", "NOT_EMPTY", "TIMEOUT", "WRITE_FAILED", "PROTOCOL", "READ_FAILED"};
 
-        if (entry.isDirectory()) {
-            // Close the File object before recursing
-            entry.close();
-            // Recursively clear this subfolder
-            Error err = clearFolder(fullPath);
-            if (err != Error::NONE) {
-                dir.close();
-                return err;
-            }
-            // Now remove the (empty) directory itself
-            if (!SD.rmdir(fullPath.c_str())) {
-                dir.close();
-                return Error::REMOVE_FAILED;
-            }
-        } else {
-            // Close the File object before removing
-            entry.close();
-            // Remove file
-            if (!SD.remove(fullPath.c_str())) {
-                dir.close();
-                return Error::REMOVE_FAILED;
+// Builds a response in a fixed buffer; `overflow` is set once it is full.
+struct RpcWriter {
+    char* buffer;
+    size_t capacity, length = 0;
+    bool overflow = false;
+
+    RpcWriter(char* buffer, size_t capacity) : buffer(buffer), capacity(capacity) {}
+
+    void raw(const char* text, size_t n) {
+        if (length + n > capacity) {
+            overflow = true;
+            return;
+        }
+        memcpy(buffer + length, text, n);
+        length += n;
+    }
+    void raw(const char* text) { raw(text, strlen(text)); }
+
+    void string(const char* text) {
+        raw("\"", 1);
+        for (const char* p = text; *p; p++) {
+            char escaped[8];
+            if (*p == '"' || *p == '\\') {
+                escaped[0] = '\\';
+                escaped[1] = *p;
+                raw(escaped, 2);
+            } else if ((uint8_t)*p < 0x20) {
+                raw(escaped, snprintf(escaped, sizeof(escaped), "\\u%04x", *p));
+            } else {
+                raw(p, 1);
             }
         }
+        raw("\"", 1);
     }
-    dir.close();
 
+    void number(uint64_t value) {
+        char digits[24];
+        raw(digits, snprintf(digits, sizeof(digits), "%llu", (unsigned long long)value));
+    }
+
+    // Starts a member of the enclosing object or array, with its name if given.
+    void field(const char* name = nullptr) {
+        if (length && buffer[length - 1] != '{' && buffer[length - 1] != '[') raw(",", 1);
+        if (!name) return;
+        string(name);
+        raw(":", 1);
+    }
+
+    void modified(uint16_t date, uint16_t time) {
+        char text[24];
+        field("modified");
+        raw(text, snprintf(text, sizeof(text), "\"%04u-%02u-%02uT%02u:%02u:%02u\"", FAT_YEAR(date), FAT_MONTH(date),
+                           FAT_DAY(date), FAT_HOUR(time), FAT_MINUTE(time), FAT_SECOND(time)));
+    }
+};
+
+void rpcEntry(RpcWriter& out, const char* name, bool isDir, uint64_t size, uint16_t date, uint16_t time) {
+    out.field();
+    out.raw("{");
+    out.field("name");
+    out.string(name);
+    out.field("dir");
+    out.raw(isDir ? "true" : "false");
+    out.field("size");
+    out.number(size);
+    out.modified(date, time);
+    out.raw("}");
+}
+
+String rpcPath(const String& args) {
+    if (args.length() == 0) return currentPath;
+    return args.startsWith("/") ? args : currentPath + args;
+}
+
+Error rpcStat(const String& path, RpcWriter& out) {
+    FsFile file = PERF_TIMED(PERF_SD_OPEN, SD.sdfs.open(path.c_str(), O_RDONLY));
+    if (!file) return Error::FILE_NOT_FOUND;
+    uint16_t date = 0, time = 0;
+    file.getModifyDateTime(&date, &time);
+    out.raw("{");
+    out.field("path");
+    out.string(path.c_str());
+    out.field("dir");
+    out.raw(file.isDir() ? "true" : "false");
+    out.field("size");
+    out.number(file.isDir() ? 0 : file.fileSize());
+    out.modified(date, time);
+    out.raw("}");
+    return Error::NONE;
+}
+
+// Lists from entry `start` on, as many entries as fit in one response;
+// "next" is where the following page starts, or null after the last entry.
+// A bare number pages the current directory, so a directory named only with
+// digits is listed with a trailing slash ("ls 425/ 50").
+Error rpcList(String args, RpcWriter& out) {
+    uint64_t start = 0;
+    args.trim();
+    if (args.length() && strspn(args.c_str(), "0123456789") == args.length()) {
+        start = strtoull(args.c_str(), nullptr, 10);
+        args = "";
+    } else {
+        takeNumbers(args, &start, 1);
+    }
+    String path = rpcPath(args);
+    out.raw("{");
+    out.field("path");
+    out.string(path.c_str());
+    out.field("entries");
+    out.raw("[");
+    uint64_t index = 0;
+    bool more = false;
+    auto add = [&](const char* name, bool isDir, uint64_t size, uint16_t date, uint16_t time) {
+        if (index++ < start) return true;
+        size_t before = out.length;
+        rpcEntry(out, name, isDir, size, date, time);
+        // Room is kept for closing the response
+        if (!out.overflow && out.length + 32 <= out.capacity) return true;
+        out.length = before;
+        out.overflow = false;
+        index--;
+        more = true;
+        return false;
+    };
+    Error err = lsEntries(path, [&](const LsEntry& entry) {
+        return add(entry.name, entry.isDir, entry.size, entry.stamp >> 16, entry.stamp & 0xFFFF);
+    });
+    if (err != Error::NONE) return err;
+    out.raw("]");
+    out.field("next");
+    if (more) out.number(index);
+    else out.raw("null");
+    out.raw("}");
+    return Error::NONE;
+}
+
+// CRC-32 of a byte range, read synchronously; a range longer than
+// RPC_SUM_MAX is refused, so hosts checksum large files in ranges, or with
+// `sum` from the shell.
+Error rpcChecksum(String args, RpcWriter& out) {
+    uint64_t range[2] = {0, UINT64_MAX};
+    takeNumbers(args, range, 2);
+    FsFile file;
+    uint64_t length = range[1];
+    Error err = openRange(rpcPath(args), range[0], length, file);
+    if (err != Error::NONE) return err;
+    if (length > RPC_SUM_MAX) return Error::PROTOCOL;
+    uint32_t crc = 0;
+    for (uint64_t done = 0; done < length;) {
+        size_t want = min((uint64_t)sizeof(ioBuffers[1]), length - done);
+        int got = PERF_TIMED(PERF_SD_READ, file.read(ioBuffers[1], want));
+        if (got != (int)want) return Error::READ_FAILED;
+        crc = crc32Update(crc, ioBuffers[1], got);
+        done += got;
+    }
+    char hex[12];
+    out.raw("{");
+    out.field("size");
+    out.number(file.fileSize());
+    out.field("offset");
+    out.number(range[0]);
+    out.field("length");
+    out.number(length);
+    out.field("crc");
+    out.raw(hex, snprintf(hex, sizeof(hex), "\"%08lx\"", (unsigned long)crc));
+    out.raw("}");
+    return Error::NONE;
+}
+
+Error rpcRemove(const String& path, bool directory) {
+    FsFile entry = PERF_TIMED(PERF_SD_OPEN, SD.sdfs.open(path.c_str(), O_RDONLY));
+    if (!entry) return Error::FILE_NOT_FOUND;
+    if (!directory) {
+        if (entry.isDir()) return Error::IS_DIRECTORY;
+        uint64_t size = entry.fileSize();
+        entry.close();
+        return deleteFile(path, size) ? Error::NONE : Error::REMOVE_FAILED;
+    }
+    if (!entry.isDir()) return Error::NOT_A_DIRECTORY;
+    FsFile child;
+    if (PERF_TIMED(PERF_SD_OPEN_NEXT, child.openNext(&entry, O_RDONLY))) return Error::NOT_EMPTY;
+    entry.close();
+    return deleteDirectory(path) ? Error::NONE : Error::REMOVE_FAILED;
+}
+
+Error rpcCall(const String& method, const String& args, RpcWriter& out) {
+    if (method == "ping") {
+        out.raw("{\"version\":\"" VERSION "\"}");
+    } else if (method == "pwd") {
+        out.raw("{\"path\":");
+        out.string(currentPath.c_str());
+        out.raw("}");
+    } else if (method == "cd") {
+        Error err = changeDirectory(args);
+        if (err != Error::NONE) return err;
+        return rpcCall("pwd", "", out);
+    } else if (method == "stat") {
+        return rpcStat(rpcPath(args), out);
+    } else if (method == "ls") {
+        return rpcList(args, out);
+    } else if (method == "sum") {
+        return rpcChecksum(args, out);
+    } else if (method == "rm" || method == "rmdir") {
+        if (args.length() == 0) return Error::INVALID_PATH;
+        Error err = rpcRemove(rpcPath(args), method == "rmdir");
+        if (err == Error::NONE) out.raw("{}");
+        return err;
+    } else if (method == "free") {
+        if (!space.bytesPerCluster) return Error::SD_INIT_FAILED;
+        out.raw("{\"fat\":");
+        out.number(space.fatType);
+        out.raw(",\"cluster\":");
+        out.number(space.bytesPerCluster);
+        out.raw(",\"total\":");
+        out.number((uint64_t)space.clusters * space.bytesPerCluster);
+        out.raw(",\"free\":");
+        if (space.known) out.number((uint64_t)space.freeClusters * space.bytesPerCluster);
+        else out.raw("null");
+        out.raw(",\"approximate\":");
+        out.raw(space.pending ? "true" : "false");
+        out.raw("}");
+    } else if (method == "exit") {
+        out.raw("{}");
+    } else {
+        return Error::PROTOCOL;
+    }
     return Error::NONE;
 }
 
+void rpcRequest(const String& line) {
+    if (line.length() == 0) return;
+    uint32_t start = micros();
+    char* end;
+    unsigned long id = strtoul(line.c_str(), &end, 10);
+    String rest = end;
+    rest.trim();
+    int space = rest.indexOf(' ');
+    String method = space < 0 ? rest : rest.substring(0, space);
+    String args = space < 0 ? "" : rest.substring(space + 1);
+    args.trim();
 
+    RpcWriter out((char*)ioBuffers[0], sizeof(ioBuffers[0]));
+    Error err = end == line.c_str() || *end != ' ' ? Error::PROTOCOL : rpcCall(method, args, out);
+    if (err == Error::NONE && out.overflow) err = Error::PROTOCOL;
+    if (err != Error::NONE) {
+        out.length = 0;
+        out.overflow = false;
+        out.raw("{\"error\":");
+        out.string(errorNames[(int)err]);
+        out.raw("}");
+    }
+    SerialUSB.printf("@%lu %d %u\n", id, (int)err, (unsigned)out.length);
+    SerialUSB.write((const uint8_t*)out.buffer, out.length);
+    SerialUSB.write('\n');
+    if (err == Error::NONE && method == "exit") {
+        rpcActive = false;
+        SerialUSB.print("\n> ");
+    }
+    perfCommand(method.c_str(), micros() - start);
+}
 
 void processCommand(const String& cmd) {
     if (cmd == "banner") { showBanner(); showHelp(); }
-    else if (cmd == "ls") {
-        SerialUSB.println("\nDirectory listing of " + currentPath + ":");
-        SerialUSB.println("------------------");
-        File dir = SD.open(currentPath.c_str());
-        Error err = listDirectory(dir);
-        dir.close();
-        if (err != Error::NONE) SerialUSB.println("Error: Failed to list directory");
+    else if (cmd == "ls" || cmd.startsWith("ls ")) {
+        LsOptions options;
+        String path, problem;
+        String args = cmd.substring(2);
+        args.trim();
+        while (args.length() > 0 && problem.length() == 0) {
+            int space = args.indexOf(' ');
+            String token = space < 0 ? args : args.substring(0, space);
+            args = space < 0 ? "" : args.substring(space + 1);
+            args.trim();
+            if (token == "--summary") {
+                options.summary = true;
+            } else if (token == "--sort" || token == "--top" || token == "--page") {
+                space = args.indexOf(' ');
+                String value = space < 0 ? args : args.substring(0, space);
+                args = space < 0 ? "" : args.substring(space + 1);
+                args.trim();
+                if (token == "--sort") {
+                    if (value == "name") options.sort = LsSort::NAME;
+                    else if (value == "size") options.sort = LsSort::SIZE;
+                    else if (value == "date") options.sort = LsSort::DATE;
+                    else problem = "--sort takes name, size or date";
+                } else if (value.toInt() <= 0) {
+                    problem = token + " takes a number from 1";
+                } else if (token == "--top") {
+                    options.top = value.toInt();
+                } else {
+                    options.page = value.toInt();
+                }
+            } else if (path.length() == 0 && !token.startsWith("--")) {
+                path = token;
+            } else {
+                problem = "Unknown option " + token;
+            }
+        }
+        if (options.top && options.sort == LsSort::NONE) options.sort = LsSort::SIZE;
+        if (path.length() == 0) path = currentPath;
+        else if (!path.startsWith("/")) path = currentPath + path;
+        if (problem.length() > 0) {
+            SerialUSB.println("Error: " + problem);
+        } else {
+            SerialUSB.println("\nDirectory listing of " + path + ":");
+            SerialUSB.println("------------------");
+            Error err = listDirectory(path, options);
+            if (err == Error::NOT_A_DIRECTORY) SerialUSB.println("Error: Not a directory");
+            else if (err != Error::NONE) SerialUSB.println("Error: Failed to list directory");
+        }
     }
     else if (cmd == "pwd") SerialUSB.println(currentPath);
+    else if (cmd == "rm -r") SerialUSB.println("Error: rm -r needs a directory");
+    else if (cmd.startsWith("rm -r ")) {
+        String path = cmd.substring(6);
+        path.trim();
+        if (!path.startsWith("/")) path = currentPath + path;
+        while (path.length() > 1 && path.endsWith("/")) path.remove(path.length() - 1);
+        if (path == "/") SerialUSB.println("Error: Use clearfolder / to empty the card");
+        else if (clearFolder(path, true) == Error::NOT_A_DIRECTORY) SerialUSB.println("Error: Not a directory");
+    }
     else if (cmd.startsWith("rm ")) {
         String path = cmd.substring(3);
         path.trim();
@@ -492,14 +5133,22 @@ void processCommand(const String& cmd) {
         Error err = removeFile(path);
         if (err == Error::FILE_NOT_FOUND) SerialUSB.println("Error: File not found");
         else if (err == Error::IS_DIRECTORY) SerialUSB.println("Error: Is a directory, use rmdir instead");
-        else if (err == Error::REMOVE_FAILED) SerialUSB.println("Error: Failed to remove file");
-        else if (err == Error::NONE) SerialUSB.println("File removed successfully");
     }
        else if (cmd.startsWith("downloaddir ")) {
         String path = cmd.substring(11);
         path.trim();
+        bool bundle = false, compress = false;
+        while (path.startsWith("--")) {
+            int space = path.indexOf(' ');
+            String option = space < 0 ? path : path.substring(0, space);
+            if (option == "--bundle") bundle = true;
+            else if (option == "--lz4") compress = true;
+            else break;
+            path = space < 0 ? "" : path.substring(space + 1);
+            path.trim();
+        }
         if (!path.startsWith("/")) path = currentPath + path;
-        Error err = sendDirectory(path);
+        Error err = sendDirectory(path, bundle, compress);
         if (err != Error::NONE) {
             SerialUSB.println("Error: Failed to send directory");
         }
@@ -512,21 +5161,13 @@ void processCommand(const String& cmd) {
         if (err == Error::FILE_NOT_FOUND) SerialUSB.println("Error: Directory not found");
         else if (err == Error::NOT_A_DIRECTORY) SerialUSB.println("Error: Not a directory");
         else if (err == Error::NOT_EMPTY) SerialUSB.println("Error: Directory not empty");
-        else if (err == Error::REMOVE_FAILED) SerialUSB.println("Error: Failed to remove directory");
-        else if (err == Error::NONE) SerialUSB.println("Directory removed successfully");
     }
       else if (cmd.startsWith("clearfolder ")) {
         String path = cmd.substring(12);
         path.trim();
         if (!path.startsWith("/")) path = currentPath + path;
-        Error err = clearFolder(path);
-        if (err == Error::NOT_A_DIRECTORY) {
-            SerialUSB.println("Error: Not a directory");
-        } else if (err == Error::REMOVE_FAILED) {
-            SerialUSB.println("Error: Failed to remove files or subdirectories");
-        } else if (err == Error::NONE) {
-            SerialUSB.println("Directory cleared successfully");
-        }
+        Error err = clearFolder(path, false);
+        if (err == Error::NOT_A_DIRECTORY) SerialUSB.println("Error: Not a directory");
     }
     else if (cmd.startsWith("cd ")) {
         String path = cmd.substring(3);
@@ -535,12 +5176,32 @@ void processCommand(const String& cmd) {
         if (err == Error::FILE_NOT_FOUND) SerialUSB.println("Error: Directory not found");
         else if (err == Error::NOT_A_DIRECTORY) SerialUSB.println("Error: Not a directory");
     }
-    else if (cmd.startsWith("cat ")) {
-        String path = cmd.substring(4);
+    else if (cmd.startsWith("cat ") || cmd.startsWith("hexdump ") || cmd.startsWith("head ") || cmd.startsWith("tail ")) {
+        String command = cmd.substring(0, cmd.indexOf(' '));
+        String path = cmd.substring(command.length() + 1);
         path.trim();
+        uint64_t range[2] = {0, MAX_FILE_PREVIEW};
+        uint32_t lines = 10;
+        size_t given = 0;
+        if (command == "head" || command == "tail") {
+            if (path.startsWith("-n")) {
+                char* rest;
+                lines = strtoul(path.c_str() + 2, &rest, 10);
+                path = rest;
+                path.trim();
+            }
+            range[1] = UINT64_MAX;
+        } else if ((given = takeNumbers(path, range, 2)) == 1) {
+            range[1] = UINT64_MAX;
+        }
         if (!path.startsWith("/")) path = currentPath + path;
-        Error err = printFile(path);
+        Error err = Error::NONE;
+        if (lines == 0) SerialUSB.println("Error: Line count must be at least 1");
+        else err = viewFile(path, command.c_str(), range[0], range[1], lines, command == "cat" && given == 0);
         if (err == Error::FILE_NOT_FOUND) SerialUSB.println("Error: File not found");
+        else if (err == Error::IS_DIRECTORY) SerialUSB.println("Error: Is a directory");
+        else if (err == Error::INVALID_PATH) SerialUSB.println("Error: Offset beyond end of file");
+        else if (err == Error::READ_FAILED) SerialUSB.println("Error: Read failed");
     }
     else if (cmd == "free") showFreeSpace();
     else if (cmd == "resync") {
@@ -554,6 +5215,37 @@ void processCommand(const String& cmd) {
         if (err != Error::NONE) SerialUSB.println("Error: Sync failed");
         else SerialUSB.println("Sync completed successfully");
     }
+    else if (cmd.startsWith("get ") || cmd.startsWith("sum ")) {
+        String path = cmd.substring(4);
+        uint64_t range[3] = {0, UINT64_MAX, 0};
+        takeNumbers(path, range, cmd.startsWith("sum ") ? 3 : 2);
+        if (!path.startsWith("/")) path = currentPath + path;
+        Error err = cmd.startsWith("sum ") ? checksumRange(path, range[0], range[1], range[2])
+                                           : sendRange(path, range[0], range[1]);
+        if (err == Error::FILE_NOT_FOUND) SerialUSB.println("Error: File not found");
+        else if (err == Error::IS_DIRECTORY) SerialUSB.println("Error: Is a directory");
+        else if (err == Error::INVALID_PATH) SerialUSB.println("Error: Offset beyond end of file");
+    }
+    else if (cmd.startsWith("put ")) {
+        String path = cmd.substring(4);
+        uint64_t offset = 0;
+        takeNumbers(path, &offset, 1);
+        if (!path.startsWith("/")) path = currentPath + path;
+        Error err = receiveRange(path, offset);
+        if (err == Error::FILE_NOT_FOUND) SerialUSB.println("Error: File not found");
+        else if (err == Error::IS_DIRECTORY) SerialUSB.println("Error: Is a directory");
+        else if (err == Error::INVALID_PATH) SerialUSB.println("Error: Offset beyond end of file");
+        else if (err == Error::WRITE_FAILED) SerialUSB.println("Error: SD write failed");
+    }
+    else if (cmd.startsWith("record ")) {
+        String path = cmd.substring(7);
+        uint64_t megabytes = RECORD_ROTATE_MB;
+        takeNumbers(path, &megabytes, 1);
+        if (!path.startsWith("/")) path = currentPath + path;
+        Error err = recordStream(path, megabytes * 1024 * 1024);
+        if (err == Error::IS_DIRECTORY) SerialUSB.println("Error: Is a directory");
+        else if (err == Error::WRITE_FAILED) SerialUSB.println("Error: SD write failed");
+    }
     else if (cmd.startsWith("foldersummary ")) {
         String path = cmd.substring(14);
         path.trim();
@@ -573,6 +5265,40 @@ void processCommand(const String& cmd) {
             SerialUSB.println("Error: Failed to search directory");
         }
     }
+    else if (cmd.startsWith("grep ")) {
+        String args = cmd.substring(5);
+        args.trim();
+        Error err = grepFiles(args);
+        if (err == Error::INVALID_PATH) SerialUSB.println("Error: Pattern must be 1 to " + String(GREP_PATTERN_MAX) + " bytes");
+        else if (err == Error::FILE_NOT_FOUND) SerialUSB.println("Error: Path not found");
+    }
+    else if (cmd == "dupes" || cmd.startsWith("dupes ")) {
+        String path = cmd.substring(5);
+        path.trim();
+        if (path.length() == 0) path = currentPath;
+        else if (!path.startsWith("/")) path = currentPath + path;
+        Error err = findDuplicates(path);
+        if (err == Error::NOT_A_DIRECTORY) SerialUSB.println("Error: Not a directory");
+        else if (err == Error::WRITE_FAILED) SerialUSB.println("Error: Unable to create " DEDUPE_FILE);
+    }
+    else if (cmd == "du" || cmd.startsWith("du ")) {
+        String path = cmd.substring(2);
+        path.trim();
+        long top = DU_TOP_DEFAULT;
+        int flag = path.indexOf("--top");
+        if (flag >= 0) {
+            String rest = path.substring(flag + 5);
+            rest.trim();
+            int end = rest.indexOf(' ');
+            top = (end < 0 ? rest : rest.substring(0, end)).toInt();
+            path = path.substring(0, flag) + (end < 0 ? "" : rest.substring(end));
+            path.trim();
+        }
+        if (path.length() == 0) path = currentPath;
+        else if (!path.startsWith("/")) path = currentPath + path;
+        if (top < 1 || top > DU_TOP_MAX) SerialUSB.println("Error: --top takes 1 to " + String(DU_TOP_MAX));
+        else if (diskUsage(path, top) == Error::NOT_A_DIRECTORY) SerialUSB.println("Error: Not a directory");
+    }
     else if (cmd == "count") {
         unsigned long fileCount = 0, dirCount = 0;
         Error err = countItems(currentPath, fileCount, dirCount);
@@ -580,9 +5306,82 @@ void processCommand(const String& cmd) {
             SerialUSB.println("Error: Failed to count items");
         }
     }
+    else if (cmd == "index") {
+        IndexJob* job = new IndexJob();
+        if (job->walker.begin("/")) {
+            startJob(job);
+        } else {
+            delete job;
+            SerialUSB.println("Error: Failed to write search index");
+        }
+    }
+    else if (cmd == "walkstats") printWalkStats();
+    else if (cmd == "stats") printStats();
+    else if (cmd == "stats --raw") printStatsRaw();
+    else if (cmd == "stats reset") {
+        perfReset();
+        SerialUSB.println("Stats reset");
+    }
+    else if (cmd == "bench" || cmd.startsWith("bench ")) {
+        String args = cmd.substring(5);
+        args.trim();
+        bool usb = args.startsWith("usb");
+        if (usb || args.startsWith("sd")) args = args.substring(usb ? 3 : 2);
+        args.trim();
+        long megabytes = args.length() ? args.toInt() : usb ? BENCH_USB_DEFAULT_MB : BENCH_DEFAULT_MB;
+        if (megabytes < 1 || megabytes > 1024) {
+            SerialUSB.println("Error: Size must be between 1 and 1024 MB");
+        } else if (usb) {
+            if (benchUsb(megabytes) != Error::NONE) SerialUSB.println("Error: Timed out waiting for the host");
+        } else if (benchCard(megabytes) != Error::NONE) {
+            SerialUSB.println("Error: Not enough free space for the scratch file");
+        }
+    }
+    else if (cmd == "rpc") {
+        rpcActive = true;
+        SerialUSB.println("RPC_READY");
+    }
+    else if (jobControl(cmd)) {}
     else if (cmd == "help") showHelp();
     else if (cmd.length() > 0) SerialUSB.println("Unknown command. Type 'help' for available commands.");
-    SerialUSB.print("\n> ");
+    if (!pendingConfirm.active && !(activeJob && activeJob->exclusive) && !rpcActive) SerialUSB.print("\n> ");
+}
+
+// Input that arrives while a job runs: job control always, and cheap queries
+// alongside a job that is not streaming to the host.
+void jobInput(const String& cmd) {
+    if (jobControl(cmd)) {
+        if (!activeJob->exclusive) SerialUSB.print("\n> ");
+    } else if (activeJob->exclusive) {
+        return;  // Anything else would land in the middle of the stream
+    } else if (cmd.length() == 0 || cmd == "pwd" || cmd == "free" || cmd == "walkstats" || cmd.startsWith("stats") ||
+               cmd == "help") {
+        processCommand(cmd);
+    } else {
+        SerialUSB.println("Busy: " + String(activeJob->name) + " is running ('jobs', 'pause', 'resume' or 'abort')");
+        SerialUSB.print("\n> ");
+    }
+}
+
+// Collects a command line without blocking. A partial line left idle for a
+// second counts as complete, as it did with readStringUntil().
+bool readCommandLine(String& cmd) {
+    static char line[COMMAND_LINE_MAX];
+    static size_t length = 0;
+    static uint32_t lastInput = 0;
+    bool complete = false;
+    while (!complete && SerialUSB.available()) {
+        char c = SerialUSB.read();
+        lastInput = millis();
+        if (c == '\n') complete = true;
+        else if (length < sizeof(line) - 1) line[length++] = c;
+    }
+    if (!complete && !(length && millis() - lastInput >= 1000)) return false;
+    line[length] = '\0';
+    length = 0;
+    cmd = line;
+    cmd.trim();
+    return true;
 }
 
 void setup() {
@@ -595,15 +5394,30 @@ void setup() {
         return;
     }
     SerialUSB.println("SD card initialized successfully.");
+    spaceBegin();
+    perfReset();
     SerialUSB.println("Type 'help' for available commands.");
     SerialUSB.print("\n> ");
 }
 
 void loop() {
-    if (SerialUSB.available()) {
-        String cmd = SerialUSB.readStringUntil('\n');
-        cmd.trim();
-        processCommand(cmd);
+    String cmd;
+    if (readCommandLine(cmd)) {
+        if (pendingConfirm.active) answerConfirm(cmd);
+        else if (rpcActive) rpcRequest(cmd);
+        else if (activeJob) jobInput(cmd);
+        else {
+            uint32_t start = micros();
+            processCommand(cmd);
+            if (!activeJob) perfCommand(cmd.c_str(), micros() - start);  // Jobs are timed when they end
+        }
+        perfHeap();
+    } else if (activeJob) {
+        runJob();
+        perfHeap();
+    } else {
+        indexFlush();
+        spaceIdle();
     }
 }
 
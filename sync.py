@@ -3,11 +3,50 @@ import os
 import serial
 import time
 import glob
+import json
 import select
+import struct
+import zlib
 from tqdm import tqdm
 
+try:
+    import lz4.block
+except ImportError:  # Compression is optional, bundles are sent raw without it
+    lz4 = None
+
 DEFAULT_SYNC_DIR = "sync_dir"
 DEFAULT_REMOTE_DIR = "/SYNC"
+MANIFEST_NAME = ".sdpeek_manifest"  # Device-side sync manifest, never synced itself
+
+# Framed sync protocol, see receiveFramed() in src/main.cpp
+FRAME_MAGIC = 0xA5
+FRAME_HEADER = struct.Struct("<BBHH")  # magic, type, seq, payload length
+FRAME_FILE_BEGIN = 1
+FRAME_DATA = 2
+FRAME_FILE_END = 3
+FRAME_SYNC_END = 4
+FRAME_ACK = 0x10
+FRAME_NAK = 0x11
+FRAME_ABORT = 0x12
+FRAME_MAX_PAYLOAD = 2048
+FRAME_RETRY_TIMEOUT = 0.2
+FRAME_RESEND_GUARD = 0.02  # Ignore repeated NAKs for a frame resent this recently
+
+# Bundle transport, see receiveBundle() in src/main.cpp
+BUNDLE_HEADER = struct.Struct("<cHQ")  # type, path length, size
+BUNDLE_FILE = b"F"
+BUNDLE_COMPRESSED = b"Z"
+BUNDLE_DIRECTORY = b"D"
+BUNDLE_READ_ERROR = b"X"
+BUNDLE_END = b"E"
+BUNDLE_ABORTED = b"A"  # Ends the stream early when the download is aborted on the device
+BUNDLE_WRITE_SIZE = 256 * 1024
+BUNDLE_BLOCK_STORED = 0x80000000
+BUNDLE_BLOCK = struct.Struct("<I")
+LZ4_MIN_SAVING = 0.1  # Files whose first block shrinks less than this are sent raw
+SUM_CHUNK = 1024 * 1024  # Granularity of resume checks
+SUM_BATCH = 32  # Checksum requests sent before reading their answers
+RECORD_CHUNK = struct.Struct("<I")  # Length before each piece of a 'record' stream, 0 to stop
 
 
 # + uf50-91/
@@ -20,70 +59,217 @@ DEFAULT_REMOTE_DIR = "/SYNC"
 # + 3-SAT_50Var_218Cls_Seed/
 
 # > 
-def download_directory(ser, remote_path, local_base_path):
+def read_exact(ser, size):
+    data = bytearray()
+    while len(data) < size:
+        chunk = ser.read(min(size - len(data), 65536))
+        if not chunk:
+            return None
+        data += chunk
+    return bytes(data)
+
+
+def download_bundle(ser, local_base_path, block_size=None):
+    """Unpack a bundle stream (downloaddir --bundle) into local_base_path."""
+    crc = 0
+    files_received = 0
+    bytes_received = 0
+    failed = []
+    last_file = None
+    start = time.time()
+    progress = tqdm(unit="B", unit_scale=True, desc="Downloading")
+    try:
+        while True:
+            header = read_exact(ser, BUNDLE_HEADER.size)
+            if header is None:
+                print("Error: Connection lost while receiving bundle")
+                return False
+            entry_type, path_length, size = BUNDLE_HEADER.unpack(header)
+            if entry_type == BUNDLE_ABORTED:
+                print("\nDownload aborted on the device")
+                return False
+            if entry_type == BUNDLE_END:
+                if size != crc:
+                    print("Error: Bundle checksum mismatch")
+                    return False
+                break
+            crc = zlib.crc32(header, crc)
+            path = read_exact(ser, path_length) if path_length else b""
+            if path is None:
+                print("Error: Connection lost while receiving bundle")
+                return False
+            crc = zlib.crc32(path, crc)
+            local_path = os.path.join(local_base_path, path.decode(errors="replace").lstrip("/"))
+
+            if entry_type == BUNDLE_DIRECTORY:
+                os.makedirs(local_path, exist_ok=True)
+            elif entry_type == BUNDLE_COMPRESSED:
+                os.makedirs(os.path.dirname(local_path), exist_ok=True)
+                with open(local_path, "wb") as f:
+                    remaining = size
+                    while remaining > 0:
+                        raw = min(block_size, remaining)
+                        prefix = read_exact(ser, BUNDLE_BLOCK.size)
+                        length = BUNDLE_BLOCK.unpack(prefix)[0] if prefix else 0
+                        block = read_exact(ser, length & ~BUNDLE_BLOCK_STORED) if prefix else None
+                        if block is None:
+                            print(f"Error: Connection lost while receiving {path.decode(errors='replace')}")
+                            return False
+                        crc = zlib.crc32(block, zlib.crc32(prefix, crc))
+                        if not length & BUNDLE_BLOCK_STORED:
+                            block = lz4.block.decompress(block, uncompressed_size=raw)
+                        f.write(block)
+                        remaining -= raw
+                        progress.update(raw)
+                last_file = local_path
+                files_received += 1
+                bytes_received += size
+            elif entry_type == BUNDLE_FILE:
+                os.makedirs(os.path.dirname(local_path), exist_ok=True)
+                with open(local_path, "wb") as f:
+                    remaining = size
+                    while remaining > 0:
+                        chunk = ser.read(min(65536, remaining))
+                        if not chunk:
+                            print(f"Error: Connection lost while receiving {path.decode(errors='replace')}")
+                            return False
+                        crc = zlib.crc32(chunk, crc)
+                        f.write(chunk)
+                        remaining -= len(chunk)
+                        progress.update(len(chunk))
+                last_file = local_path
+                files_received += 1
+                bytes_received += size
+            elif entry_type == BUNDLE_READ_ERROR and last_file:
+                os.remove(last_file)
+                failed.append(last_file)
+            else:
+                print(f"Error: Unknown bundle entry {entry_type!r}")
+                return False
+    finally:
+        progress.close()
+
+    elapsed = max(time.time() - start, 1e-6)
+    print(f"\nDownload complete. Received {files_received} files, {formatSize(bytes_received)} "
+          f"({bytes_received / elapsed / 1e6:.2f} MB/s).")
+    for local_path in failed:
+        print(f"  Read error on device, not saved: {local_path}")
+    return not failed
+
+
+def abort_device_job(ser):
+    """Abort the device's running job and drain its output until it goes quiet."""
+    ser.write(b"abort\n")
+    quiet_since = time.time()
+    while time.time() - quiet_since < 0.5:
+        if ser.read(ser.in_waiting or 1):
+            quiet_since = time.time()
+
+
+def download_directory(ser, remote_path, local_base_path, bundle=False, compress=False):
+    """
+    Download a directory from the Teensy to the local computer. Ctrl-C aborts
+    the download on the device too, which stops after the file in flight.
+    """
+    try:
+        return receive_directory(ser, remote_path, local_base_path, bundle, compress)
+    except KeyboardInterrupt:
+        print("\nInterrupted, stopping the download on the device...")
+        abort_device_job(ser)
+        raise
+
+
+def receive_directory(ser, remote_path, local_base_path, bundle=False, compress=False):
     """
-    Download a directory from the Teensy to the local computer.
-    Uses same approach as the working sync code.
+    Receive the tree that downloaddir streams.
+    The device walks the tree once and streams files as it finds them; the
+    file count arrives as a DIR_DONE:<n> trailer. With bundle=True the tree
+    comes as one packed stream instead, without per-file text markers, and
+    compress=True asks the device to LZ4 compress it.
     """
+    compress = compress and bundle and lz4 is not None
     # Clear any pending data
     if ser.in_waiting:
         ser.read(ser.in_waiting)
-    
+
     print(f"Starting download from {remote_path}...")
-    ser.write(f"downloaddir {remote_path}\n".encode())
-    time.sleep(0.1)  # Give Teensy time to process
-    
-    # Read the initial count
+    options = ("--bundle " if bundle else "") + ("--lz4 " if compress else "")
+    ser.write(f"downloaddir {options}{remote_path}\n".encode())
+
     response = ser.readline().decode(errors='ignore').strip()
-    if not response.startswith("DIR_COUNT:"):
+    if response.startswith("BUNDLE_BEGIN"):
+        fields = response.split()
+        return download_bundle(ser, local_base_path, int(fields[2]) if len(fields) > 2 else None)
+    if response.startswith("DIR_COUNT:"):  # Older firmware counts up front
+        total_files = int(response.split(":")[1])
+    elif response == "DIR_BEGIN":
+        total_files = None
+    else:
         print(f"Error: Unexpected response: {response}")
         return False
-    
-    total_files = int(response.split(":")[1])
-    print(f"Found {total_files} files to download")
-    
-    if total_files == 0:
-        print("No files found to download")
-        return True
-    
+
     files_received = 0
+    bytes_received = 0
+    failed = []
+    start = time.time()
+    progress = tqdm(total=total_files, unit="file", desc="Downloading")
     while True:
         response = ser.readline().decode(errors='ignore').strip()
-        
-        if response == "DIR_DONE":
+        if not response:
+            progress.close()
+            print("Error: Timed out waiting for the device")
+            return False
+
+        if response.startswith("DIR_ABORTED"):
+            progress.close()
+            print("\nDownload aborted on the device")
+            return False
+
+        if response.startswith("DIR_DONE"):
+            if ":" in response and int(response.split(":")[1]) != files_received:
+                print(f"Warning: device sent {response.split(':')[1]} files, received {files_received}")
             break
-            
+
         if response.startswith("FILE:"):
             # Get filename and expected size
             filename = response[5:]  # Remove FILE: prefix
             size = int(ser.readline().decode().strip())
-            
+
             # Create full local path
             local_path = os.path.join(local_base_path, filename.lstrip('/'))
             os.makedirs(os.path.dirname(local_path), exist_ok=True)
-            
-            print(f"Receiving: {filename} ({formatSize(size)})")
-            
-            # Read file data in chunks
+
             with open(local_path, 'wb') as f:
                 remaining = size
                 while remaining > 0:
-                    chunk_size = min(512, remaining)
-                    chunk = ser.read(chunk_size)
+                    chunk = ser.read(min(65536, remaining))
                     if not chunk:
+                        progress.close()
                         print(f"Error: Connection lost while receiving {filename}")
                         return False
                     f.write(chunk)
                     remaining -= len(chunk)
-            
-            # Read FILE_DONE marker
-            ser.readline()
-            
+
+            # FILE_DONE, or FILE_ERROR if the card failed to read the file
+            if ser.readline().decode(errors='ignore').strip() != "FILE_DONE":
+                os.remove(local_path)
+                failed.append(filename)
+
             files_received += 1
-            print(f"Progress: {files_received}/{total_files} files ({int(files_received/total_files*100)}%)")
-            
-    print(f"\nDownload complete. Received {files_received} files.")
-    return True
+            bytes_received += size
+            progress.update(1)
+        elif response.startswith("Error"):
+            progress.close()
+            print(response)
+            return False
+    progress.close()
+
+    elapsed = max(time.time() - start, 1e-6)
+    print(f"\nDownload complete. Received {files_received} files, {formatSize(bytes_received)} "
+          f"({bytes_received / elapsed / 1e6:.2f} MB/s).")
+    for filename in failed:
+        print(f"  Read error on device, not saved: {filename}")
+    return not failed
 
 
 def formatSize(bytes):
@@ -94,6 +280,9 @@ def formatSize(bytes):
     return f"{bytes:.1f} TB"
 
 def find_teensy_port():
+    # SDPEEK_PORT names the port outright, e.g. the pty of the native build
+    if os.environ.get("SDPEEK_PORT"):
+        return os.environ["SDPEEK_PORT"]
     if sys.platform.startswith("darwin"):
         ports = glob.glob("/dev/cu.usbmodem*")
     elif sys.platform.startswith("win"):
@@ -130,6 +319,375 @@ def wait_for_teensy_ready(ser):
     return False
 
 
+def read_device_stats(ser):
+    """
+    Fetch the device's runtime counters ('stats --raw') as a dict. Times are
+    converted from CPU cycles to microseconds; each histogram bucket b counts
+    calls that took under 2**b us (the last one is open-ended).
+    """
+    ser.reset_input_buffer()
+    ser.write(b"stats --raw\n")
+    stats = {"ops": {}, "commands": {}}
+    while True:
+        raw = ser.readline()
+        if not raw:
+            raise TimeoutError("No stats from the device")
+        # A prompt still in flight from the previous command can lead the first line
+        line = raw.decode("utf-8", errors="replace").strip().lstrip("> ")
+        fields = line.split(":")
+        if fields[0] == "STATS_BEGIN":
+            stats["since_reset_ms"] = int(fields[1])
+            cycles_per_us = int(fields[2]) / 1e6
+        elif fields[0] == "STATS_OP":
+            count, cycles, max_cycles, total_bytes = map(int, fields[2:6])
+            stats["ops"][fields[1]] = {
+                "count": count,
+                "total_us": cycles / cycles_per_us,
+                "max_us": max_cycles / cycles_per_us,
+                "bytes": total_bytes,
+                "histogram": [int(n) for n in fields[6].split(",")],
+            }
+        elif fields[0] == "STATS_CMD":
+            count, total_us, max_us = map(int, fields[2:5])
+            stats["commands"][fields[1]] = {"count": count, "total_us": total_us, "max_us": max_us}
+        elif fields[0] == "STATS_HEAP":
+            stats["heap"] = {"in_use": int(fields[1]), "peak": int(fields[2])}
+        elif fields[0] == "STATS_END":
+            return stats
+
+
+def usb_benchmark(ser, megabytes=4):
+    """
+    Run the device's USB benchmark ('bench usb'): receive megabytes MB at each
+    of the device's block sizes, send the same amount back, and print the
+    throughput measured on both ends with the device's write latencies.
+    """
+    ser.reset_input_buffer()
+    ser.write(f"bench usb {megabytes}\n".encode())
+    while True:
+        raw = ser.readline()
+        if not raw:
+            print("Error: No response from the device")
+            return False
+        line = raw.decode("utf-8", errors="replace").strip()
+        if line.startswith("Error"):
+            print(line)
+            return False
+        if line.startswith("BENCH_USB:"):
+            segment, blocks = map(int, line.split(":")[1:3])
+            break
+
+    host_seconds = []
+    for _ in range(blocks):
+        start = time.time()
+        if read_exact(ser, segment) is None:
+            print("Error: Connection lost during the benchmark")
+            return False
+        host_seconds.append(time.time() - start)
+
+    payload = bytes(min(segment, BUNDLE_WRITE_SIZE))
+    start = time.time()
+    for offset in range(0, segment, len(payload)):
+        ser.write(payload[: segment - offset])
+    ser.flush()
+    upload_seconds = time.time() - start
+
+    print(f"{'Device -> host':>16}  {'device MB/s':>11}  {'host MB/s':>9}  {'writes/s':>9}  {'p50 us':>8}  {'p99 us':>8}  {'max us':>8}")
+    index = 0
+    while True:
+        raw = ser.readline()
+        if not raw:
+            print("Error: Timed out waiting for the benchmark results")
+            return False
+        line = raw.decode("utf-8", errors="replace").strip()
+        fields = line.split(":")
+        if fields[0] == "BENCH_USB_OUT":
+            block, micros, writes = map(int, fields[1:4])
+            p50, p99, worst = map(float, fields[4:7])
+            print(f"{formatSize(block):>16}  {segment / max(micros, 1):>11.2f}  "
+                  f"{segment / 1e6 / max(host_seconds[index], 1e-6):>9.2f}  {writes * 1e6 / max(micros, 1):>9.0f}  "
+                  f"{p50:>8.1f}  {p99:>8.1f}  {worst:>8.1f}")
+            index += 1
+        elif fields[0] == "BENCH_USB_IN":
+            received, micros = map(int, fields[1:3])
+            print(f"Host -> device: {received / max(micros, 1):.2f} MB/s on the device, "
+                  f"{segment / 1e6 / max(upload_seconds, 1e-6):.2f} MB/s on the host")
+        elif fields[0] == "BENCH_USB_DONE":
+            return True
+
+
+def read_line(ser, timeout=10):
+    """Next non-blank line from the device without a leading prompt, or None
+    if nothing arrives for timeout seconds."""
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        raw = ser.readline()
+        line = raw.decode("utf-8", errors="replace").strip()
+        if line.startswith(">"):
+            line = line[1:].strip()
+        if line:
+            return line
+        if raw:
+            deadline = time.time() + timeout
+    return None
+
+
+class RpcError(Exception):
+    """A request the device answered with an error; name is the device's
+    Error value, such as FILE_NOT_FOUND."""
+
+    def __init__(self, method, name):
+        super().__init__(f"{method}: {name}")
+        self.name = name
+
+
+class DeviceRpc:
+    """
+    The device's rpc mode: one line per request, answered in order with a
+    header line "@<id> <code> <length>" and <length> bytes of JSON. call()
+    waits for each answer; call_many() sends a whole batch before reading
+    the answers, so small queries cost one round trip together.
+
+        with DeviceRpc(ser) as rpc:
+            sizes = [entry["size"] for entry in rpc.call_many([("stat", p) for p in paths])]
+    """
+
+    def __init__(self, ser, timeout=10):
+        self.ser = ser
+        self.timeout = timeout
+        self.next_id = 1
+
+    def __enter__(self):
+        self.ser.reset_input_buffer()
+        self.ser.write(b"rpc\n")
+        while True:
+            line = read_line(self.ser, self.timeout)
+            if line is None:
+                raise TimeoutError("The device did not enter rpc mode")
+            if line == "RPC_READY":
+                return self
+
+    def __exit__(self, *exc):
+        self.call("exit")
+        read_line(self.ser, 1)  # The shell prompt
+
+    def call(self, method, *args):
+        return self.call_many([(method, *args)])[0]
+
+    def call_many(self, requests):
+        """Results of each (method, *args) request, in order; raises RpcError
+        for the first that failed once all have been answered."""
+        ids = []
+        lines = []
+        for method, *args in requests:
+            ids.append((self.next_id, method))
+            lines.append(" ".join([str(self.next_id), method] + [str(arg) for arg in args]) + "\n")
+            self.next_id += 1
+        self.ser.write("".join(lines).encode())
+        results, failure = [], None
+        for request_id, method in ids:
+            code, payload = self.read_response(request_id)
+            if code and failure is None:
+                failure = RpcError(method, payload.get("error"))
+            results.append(payload)
+        if failure:
+            raise failure
+        return results
+
+    def read_response(self, request_id):
+        header = read_line(self.ser, self.timeout)
+        if header is None:
+            raise TimeoutError(f"No response to rpc request {request_id}")
+        fields = header.split()
+        if len(fields) != 3 or fields[0] != f"@{request_id}":
+            raise IOError(f"Unexpected rpc response: {header!r}")
+        payload = read_exact(self.ser, int(fields[2]) + 1)  # The JSON and its newline
+        if payload is None:
+            raise TimeoutError(f"Response to rpc request {request_id} cut short")
+        return int(fields[1]), json.loads(payload)
+
+
+def device_checksums(ser, remote_path, offset, length):
+    """
+    CRC-32 of each SUM_CHUNK piece of a byte range of a device file, as
+    (offset, length, crc) tuples, and the file's size on the device. The
+    range is clamped to the file; returns (None, None) if there is no file.
+    The pieces are asked for in rpc batches of SUM_BATCH requests.
+    """
+    with DeviceRpc(ser) as rpc:
+        try:
+            remote_size = rpc.call("sum", remote_path, 0, 0)["size"]
+        except RpcError as error:
+            if error.name == "FILE_NOT_FOUND":
+                return None, None
+            raise
+        end = min(offset + length, remote_size)
+        starts = range(offset, end, SUM_CHUNK)
+        chunks = []
+        for batch in range(0, len(starts), SUM_BATCH):
+            requests = [("sum", remote_path, start, min(SUM_CHUNK, end - start))
+                        for start in starts[batch:batch + SUM_BATCH]]
+            for result in rpc.call_many(requests):
+                chunks.append((result["offset"], result["length"], int(result["crc"], 16)))
+    return chunks, remote_size
+
+
+def matching_prefix(ser, remote_path, local_path):
+    """
+    How many leading bytes of local_path match the device file, in whole
+    checksum chunks, and the device file's size (None if it does not exist).
+    """
+    local_size = os.path.getsize(local_path) if os.path.exists(local_path) else 0
+    chunks, remote_size = device_checksums(ser, remote_path, 0, local_size)
+    verified = 0
+    if chunks:
+        with open(local_path, "rb") as file:
+            for start, size, crc in chunks:
+                if zlib.crc32(file.read(size)) != crc:
+                    break
+                verified = start + size
+    return verified, remote_size
+
+
+def get_file(ser, remote_path, local_path, resume=True):
+    """
+    Copy one file from the device. With resume, the part of local_path that
+    already matches the device copy is kept and only the rest is fetched,
+    which also pulls just the new tail of a growing log. Ctrl-C stops the
+    transfer on the device; running it again picks up from there.
+    """
+    offset = 0
+    if resume and os.path.exists(local_path):
+        offset, remote_size = matching_prefix(ser, remote_path, local_path)
+        if remote_size is None:
+            print("Error: File not found")
+            return False
+    try:
+        return receive_range(ser, remote_path, local_path, offset)
+    except KeyboardInterrupt:
+        print("\nInterrupted, stopping the transfer on the device...")
+        abort_device_job(ser)
+        raise
+
+
+def receive_range(ser, remote_path, local_path, offset):
+    """Fetch remote_path from offset on into local_path, replacing whatever
+    the local file held from offset on."""
+    ser.reset_input_buffer()
+    ser.write(f"get {remote_path} {offset}\n".encode())
+    line = read_line(ser)
+    if not line or not line.startswith("GET_BEGIN:"):
+        print(line or "Error: No response from the device")
+        return False
+    size, offset, length = map(int, line[10:].split(":"))
+
+    if os.path.dirname(local_path):
+        os.makedirs(os.path.dirname(local_path), exist_ok=True)
+    crc = 0
+    start = time.time()
+    with open(local_path, "r+b" if os.path.exists(local_path) else "wb") as file:
+        file.truncate(offset)
+        file.seek(offset)
+        with tqdm(total=size, initial=offset, unit="B", unit_scale=True, desc="Downloading") as progress:
+            remaining = length
+            while remaining > 0:
+                chunk = ser.read(min(65536, remaining))
+                if not chunk:
+                    print("\nError: Connection lost, run again to resume")
+                    return False
+                file.write(chunk)
+                crc = zlib.crc32(chunk, crc)
+                remaining -= len(chunk)
+                progress.update(len(chunk))
+
+        line = read_line(ser)
+        if not line or not line.startswith("GET_END:") or int(line[8:], 16) != crc:
+            file.truncate(offset)  # Unverified, fetch it again next time
+            print(line if line and line.startswith("Error") else "Error: Range failed verification")
+            return False
+    elapsed = max(time.time() - start, 1e-6)
+    print(f"Received {formatSize(length)} from offset {offset} ({length / elapsed / 1e6:.2f} MB/s), "
+          f"{local_path} now {formatSize(size)}")
+    return True
+
+
+def put_file(ser, local_path, remote_path, resume=True):
+    """
+    Copy one file to the device. With resume, the part of the device copy
+    that already matches local_path is kept and only the rest is sent. If the
+    link drops, the device keeps what arrived and the next run resumes there.
+    """
+    offset = matching_prefix(ser, remote_path, local_path)[0] if resume else 0
+    length = os.path.getsize(local_path) - offset
+    ser.reset_input_buffer()
+    ser.write(f"put {remote_path} {offset}\n".encode())
+    line = read_line(ser)
+    if not line or not line.startswith("PUT_READY:"):
+        print(line or "Error: No response from the device")
+        return False
+
+    ser.write(f"{length}\n".encode())
+    crc = 0
+    start = time.time()
+    with open(local_path, "rb") as file, \
+            tqdm(total=offset + length, initial=offset, unit="B", unit_scale=True, desc="Uploading") as progress:
+        file.seek(offset)
+        while True:
+            chunk = file.read(BUNDLE_WRITE_SIZE)
+            if not chunk:
+                break
+            ser.write(chunk)
+            crc = zlib.crc32(chunk, crc)
+            progress.update(len(chunk))
+
+    line = read_line(ser)
+    if not line or not line.startswith("PUT_DONE:"):
+        print(line or "Error: No response from the device")
+        return False
+    count, device_crc = line[9:].split(":")
+    if int(count) != length or int(device_crc, 16) != crc:
+        print("Error: Range failed verification on the device")
+        return False
+    elapsed = max(time.time() - start, 1e-6)
+    print(f"Sent {formatSize(length)} from offset {offset} ({length / elapsed / 1e6:.2f} MB/s)")
+    return True
+
+
+def record_stream(ser, source, remote_path, rotate_mb=None, chunk_size=BUNDLE_WRITE_SIZE):
+    """
+    Stream everything read from source (a binary file object, such as a pipe)
+    into remote_path with 'record', until source ends. Returns the device's
+    counters as a dict, or None if it could not start or the card failed.
+    """
+    ser.reset_input_buffer()
+    ser.write(f"record {remote_path}{'' if rotate_mb is None else f' {rotate_mb}'}\n".encode())
+    line = read_line(ser)
+    if not line or not line.startswith("RECORD_READY:"):
+        print(line or "Error: No response from the device")
+        return None
+
+    with tqdm(unit="B", unit_scale=True, desc="Recording") as progress:
+        while True:
+            chunk = source.read(chunk_size)
+            if not chunk:
+                break
+            ser.write(RECORD_CHUNK.pack(len(chunk)) + chunk)
+            progress.update(len(chunk))
+        ser.write(RECORD_CHUNK.pack(0))
+
+    line = read_line(ser, 60)
+    if not line or not line.startswith(("RECORD_END:", "RECORD_ERROR:")):
+        print(line or "Error: No response from the device")
+        return None
+    status, *fields = line.split(":")
+    counters = dict(zip(("bytes", "files", "overruns", "worst_stall_us", "peak_ring_bytes"), map(int, fields)))
+    print(read_line(ser, 1) or "")
+    if status == "RECORD_ERROR":
+        print(f"Error: SD write failed after {formatSize(counters['bytes'])}")
+        return None
+    return counters
+
+
 def send_file(ser, local_path, remote_path):
     file_size = os.path.getsize(local_path)
     ser.write(f"FILE:{os.path.basename(local_path)}\n".encode())
@@ -139,7 +697,7 @@ def send_file(ser, local_path, remote_path):
     print(f"Sending file: {local_path}, size: {file_size}")
 
     with open(local_path, "rb") as file:
-        chunk_size = 512
+        chunk_size = 64 * 1024
         while True:
             chunk = file.read(chunk_size)
             if not chunk:
@@ -147,16 +705,287 @@ def send_file(ser, local_path, remote_path):
             ser.write(chunk)
             # time.sleep(0.01)  # Small delay between chunks
 
-    response = ser.readline().decode().strip()
-    # if response != "FILE_RECEIVED":
-    # print(f"Error sending file {local_path}")
-    # return False
-    print(f"Sent {len(chunk)} bytes")
+    # Drain the device's per-file report up to its acknowledgement
+    while True:
+        response = ser.readline().decode(errors="ignore").strip()
+        if not response or response == "FILE_RECEIVED" or response.startswith("Error"):
+            break
+    if response != "FILE_RECEIVED":
+        print(f"Error sending file {local_path}: {response or 'no acknowledgement'}")
+        return False
+    print(f"Sent {file_size} bytes")
 
     return True
 
 
-def sync_directory(ser, local_path, remote_path):
+def build_frame(frame_type, seq, payload=b""):
+    header = FRAME_HEADER.pack(FRAME_MAGIC, frame_type, seq & 0xFFFF, len(payload))
+    return header + payload + struct.pack("<I", zlib.crc32(header + payload))
+
+
+def parse_frames(buffer):
+    """Split complete, CRC-checked frames off the front of buffer.
+    Returns (frames, unconsumed bytes). Text between frames is dropped, text
+    after the last frame is kept for the caller."""
+    frames = []
+    while True:
+        start = buffer.find(bytes([FRAME_MAGIC]))
+        if start < 0:
+            return frames, buffer
+        buffer = buffer[start:]
+        if len(buffer) < FRAME_HEADER.size:
+            return frames, buffer
+        _, frame_type, seq, length = FRAME_HEADER.unpack_from(buffer)
+        end = FRAME_HEADER.size + length + 4
+        if length > FRAME_MAX_PAYLOAD:
+            buffer = buffer[1:]
+            continue
+        if len(buffer) < end:
+            return frames, buffer
+        (crc,) = struct.unpack_from("<I", buffer, end - 4)
+        if zlib.crc32(buffer[: end - 4]) != crc:
+            buffer = buffer[1:]
+            continue
+        frames.append((frame_type, seq, buffer[FRAME_HEADER.size : end - 4]))
+        buffer = buffer[end:]
+
+
+def iter_sync_frames(files, local_path, max_payload):
+    for file in files:
+        relative_path = "/" + os.path.relpath(file, local_path).replace("\\", "/")
+        size = os.path.getsize(file)
+        yield FRAME_FILE_BEGIN, struct.pack("<I", size) + relative_path.encode()
+        with open(file, "rb") as f:
+            while True:
+                chunk = f.read(max_payload)
+                if not chunk:
+                    break
+                yield FRAME_DATA, chunk
+        yield FRAME_FILE_END, b""
+    yield FRAME_SYNC_END, b""
+
+
+def send_frames(ser, frames, window, progress=None):
+    """Selective-repeat sender: keeps up to `window` frames unacknowledged,
+    resends the frames a NAK bitmap marks missing and the oldest frame on ACK
+    timeout.
+    Sequence numbers are tracked as absolute counters and sent modulo 2^16.
+    Returns (success, bytes received after the final frame)."""
+    in_flight = {}  # seq -> [frame bytes, last send time]
+    next_seq = 0
+    acked = 0
+    exhausted = False
+    pending = b""
+    resent = 0
+    while not exhausted or in_flight:
+        while not exhausted and next_seq - acked < window:
+            try:
+                frame_type, payload = next(frames)
+            except StopIteration:
+                exhausted = True
+                break
+            frame = build_frame(frame_type, next_seq, payload)
+            ser.write(frame)
+            in_flight[next_seq] = [frame, time.time()]
+            next_seq += 1
+            if progress is not None and frame_type == FRAME_DATA:
+                progress.update(len(payload))
+
+        pending += ser.read(ser.in_waiting or 1)
+        responses, pending = parse_frames(pending)
+        for frame_type, seq, payload in responses:
+            absolute = acked + ((seq - acked) & 0xFFFF)
+            if frame_type == FRAME_ABORT:
+                print(f"\nError: Device aborted sync: {payload.decode(errors='replace')}")
+                return False, pending
+            if frame_type not in (FRAME_ACK, FRAME_NAK) or absolute > next_seq:
+                continue
+            # Both carry the device's next expected frame, a cumulative ACK
+            for done in range(acked, absolute):
+                in_flight.pop(done, None)
+            acked = max(acked, absolute)
+            if frame_type == FRAME_NAK and len(payload) == 4:
+                (missing,) = struct.unpack("<I", payload)
+                now = time.time()
+                for offset in range(32):
+                    entry = in_flight.get(absolute + offset)
+                    if missing >> offset & 1 and entry and now - entry[1] > FRAME_RESEND_GUARD:
+                        ser.write(entry[0])
+                        entry[1] = now
+                        resent += 1
+
+        if in_flight and time.time() - in_flight[acked][1] > FRAME_RETRY_TIMEOUT:
+            ser.write(in_flight[acked][0])
+            in_flight[acked][1] = time.time()
+            resent += 1
+    if resent:
+        print(f"\nResent {resent} frames")
+    return True, pending
+
+
+def sync_directory_framed(ser, local_path, files, window, max_payload):
+    total_bytes = sum(os.path.getsize(file) for file in files)
+    frames = iter_sync_frames(files, local_path, max_payload)
+    with tqdm(total=total_bytes, desc="Syncing", unit="B", unit_scale=True) as progress:
+        ok, pending = send_frames(ser, frames, window, progress)
+    # The device reports its summary as text once the SYNC_END frame is acknowledged
+    while ok:
+        if b"\n" not in pending:
+            more = ser.readline()
+            if not more:
+                break
+            pending += more
+            continue
+        raw, pending = pending.split(b"\n", 1)
+        line = raw.decode(errors="ignore").strip()
+        if line:
+            print(line)
+        if line.startswith("Sync completed") or line.startswith("Error"):
+            break
+    print(f"Sync {'completed' if ok else 'failed'}: {len(files)} files, {formatSize(total_bytes)}")
+    return ok
+
+
+def compress_file_blocks(f, block_size):
+    """
+    Yield (on-wire LZ4 block, file bytes covered) for an open file, reading
+    one block at a time, or return None if its first block shrinks too little
+    and the file should go raw (f is then back at its start).
+    """
+    raw = f.read(block_size)
+    packed = lz4.block.compress(raw, store_size=False)
+    if not raw or len(packed) > len(raw) * (1 - LZ4_MIN_SAVING):
+        f.seek(0)
+        return None
+
+    def blocks(raw, packed):
+        while raw:
+            if len(packed) < len(raw):
+                yield BUNDLE_BLOCK.pack(len(packed)) + packed, len(raw)
+            else:
+                yield BUNDLE_BLOCK.pack(len(raw) | BUNDLE_BLOCK_STORED) + raw, len(raw)
+            raw = f.read(block_size)
+            packed = lz4.block.compress(raw, store_size=False)
+
+    return blocks(raw, packed)
+
+
+def iter_bundle(local_path, files, block_size=None):
+    """Yield (piece, file bytes covered) for the bundle stream of files under
+    local_path. With a block_size, files are LZ4 compressed where it pays off."""
+    crc = 0
+    out = bytearray()
+    covered = 0
+
+    def entry(entry_type, relative, size=0):
+        nonlocal crc
+        path = ("/" + relative.replace("\\", "/")).encode()
+        header = BUNDLE_HEADER.pack(entry_type, len(path), size) + path
+        crc = zlib.crc32(header, crc)
+        out.extend(header)
+
+    for root, dirs, _ in os.walk(local_path):
+        for name in dirs:
+            entry(BUNDLE_DIRECTORY, os.path.relpath(os.path.join(root, name), local_path))
+    for file in files:
+        relative = os.path.relpath(file, local_path)
+        with open(file, "rb") as f:
+            pieces = compress_file_blocks(f, block_size) if block_size else None
+            if pieces is None:
+                entry(BUNDLE_FILE, relative, os.path.getsize(file))
+                pieces = ((data, len(data)) for data in iter(lambda: f.read(BUNDLE_WRITE_SIZE), b""))
+            else:
+                entry(BUNDLE_COMPRESSED, relative, os.path.getsize(file))
+            for piece, length in pieces:
+                crc = zlib.crc32(piece, crc)
+                out.extend(piece)
+                covered += length
+                if len(out) >= BUNDLE_WRITE_SIZE:
+                    yield bytes(out), covered
+                    out.clear()
+                    covered = 0
+    out.extend(BUNDLE_HEADER.pack(BUNDLE_END, 0, crc))
+    yield bytes(out), covered
+
+
+def sync_directory_bundle(ser, local_path, files, block_size=None):
+    total_bytes = sum(os.path.getsize(file) for file in files)
+    reply = b""
+    with tqdm(total=total_bytes, desc="Syncing", unit="B", unit_scale=True) as progress:
+        for piece, covered in iter_bundle(local_path, files, block_size):
+            ser.write(piece)
+            progress.update(covered)
+            if ser.in_waiting:
+                reply += ser.read(ser.in_waiting)
+                if b"Error" in reply:
+                    break
+    ok = True
+    while True:
+        if b"\n" not in reply:
+            more = ser.readline()
+            if not more:
+                ok = False
+                break
+            reply += more
+            continue
+        raw, reply = reply.split(b"\n", 1)
+        line = raw.decode(errors="ignore").strip()
+        if line:
+            print(line)
+        if line.startswith("Error"):
+            ok = False
+            break
+        if line.startswith("Sync completed"):
+            break
+    print(f"Sync {'completed' if ok else 'failed'}: {len(files)} files, {formatSize(total_bytes)}")
+    return ok
+
+
+def file_crc32(path):
+    crc = 0
+    with open(path, "rb") as f:
+        for chunk in iter(lambda: f.read(1 << 20), b""):
+            crc = zlib.crc32(chunk, crc)
+    return crc
+
+
+def build_manifest(local_path, files):
+    """Manifest entries (relative path, size, crc32, local file), sorted by the
+    UTF-8 bytes of the path to match the device's strcmp() merge order."""
+    entries = []
+    for file in files:
+        relative_path = "/" + os.path.relpath(file, local_path).replace("\\", "/")
+        entries.append((relative_path, os.path.getsize(file), file_crc32(file), file))
+    entries.sort(key=lambda entry: entry[0].encode())
+    return entries
+
+
+def exchange_manifest(ser, entries, prune):
+    """Send the host manifest and return the local files the device needs,
+    or None if the device does not support manifests."""
+    ser.write(f"MANIFEST:{len(entries)}{' PRUNE' if prune else ''}\n".encode())
+    ser.write("".join(f"{crc:08x} {size} {path}\n" for path, size, crc, _ in entries).encode())
+    needed = []
+    deadline = time.time() + 10 + len(entries) / 500
+    while time.time() < deadline:
+        line = ser.readline().decode(errors="ignore").strip()
+        if line.startswith("NEED:"):
+            first, last = map(int, line[5:].split("-"))
+            needed.extend(entries[i][3] for i in range(first, last + 1))
+        elif line.startswith("MANIFEST_DONE:"):
+            changed, removed = line[14:].split()
+            print(f"{changed} of {len(entries)} files changed, {removed} removed from the device")
+            return needed
+        elif line.startswith("Error"):
+            print(line)
+            return None
+    return None
+
+
+def sync_directory(ser, local_path, remote_path, mode="bundle", prune=False, compress=True):
+    """mode is "bundle" (one packed stream), "framed" (windowed with
+    retransmission, for unreliable links) or "text" (per-file, oldest firmware).
+    Bundles are LZ4 compressed when compress is set and both sides support it."""
     ser.write(f"syncdir {remote_path}\n".encode())
     response = ser.readline().decode().strip()
     if response != "Ready to receive files. Start transfer from host.":
@@ -167,8 +996,36 @@ def sync_directory(ser, local_path, remote_path):
         os.path.join(root, file)
         for root, _, files in os.walk(local_path)
         for file in files
+        if file != MANIFEST_NAME
     ]
 
+    if mode != "text":
+        needed = exchange_manifest(ser, build_manifest(local_path, files), prune)
+        if needed is None:
+            # Older firmware rejects the manifest line and leaves sync mode
+            print("Device does not support incremental sync, using text mode")
+            time.sleep(0.2)
+            ser.reset_input_buffer()
+            return sync_directory(ser, local_path, remote_path, mode="text")
+        if mode == "bundle":
+            ser.write(b"MODE:BUNDLE\n")
+            response = ser.readline().decode(errors="ignore").strip()
+            if response.startswith("MODE_OK:BUNDLE"):
+                fields = response.split()
+                block_size = int(fields[2]) if compress and lz4 and fields[1:2] == ["LZ4"] else None
+                return sync_directory_bundle(ser, local_path, needed, block_size)
+            print(f"Error: Bundle mode rejected. Response: {response}")
+            return False
+        ser.write(b"MODE:FRAMED\n")
+        response = ser.readline().decode(errors="ignore").strip()
+        if response.startswith("MODE_OK:FRAMED"):
+            _, window, max_payload = response.split()
+            return sync_directory_framed(
+                ser, local_path, needed, int(window), min(int(max_payload), FRAME_MAX_PAYLOAD)
+            )
+        print(f"Error: Framed mode rejected. Response: {response}")
+        return False
+
     ser.write(f"FILE_COUNT:{len(files)}\n".encode())
 
     success_count = 0
@@ -206,9 +1063,28 @@ def open_serial_monitor(port, baud_rate, local_dir):
                     cmd = input()
                     if cmd.lower() == "exit":
                         break
-                    elif cmd.lower() == "resync":
+                    elif cmd.lower() in ("resync", "resync --prune"):
                         print("Resyncing files...")
-                        sync_directory(ser, local_dir, DEFAULT_REMOTE_DIR)
+                        sync_directory(ser, local_dir, DEFAULT_REMOTE_DIR, prune=cmd.lower().endswith("--prune"))
+                    elif cmd.lower().startswith("bench usb"):
+                        size = cmd.split()[2:]
+                        usb_benchmark(ser, int(size[0]) if size else 4)
+                    elif cmd.startswith(("get ", "put ")) and len(cmd.split()) > 1:
+                        # get <remote> [local] / put <local> [remote], resuming partial copies
+                        args = cmd.split()[1:]
+                        if cmd.startswith("get "):
+                            local = args[1] if len(args) > 1 else os.path.join(local_dir, os.path.basename(args[0]))
+                            get_file(ser, args[0], local)
+                        else:
+                            remote = args[1] if len(args) > 1 else f"{DEFAULT_REMOTE_DIR}/{os.path.basename(args[0])}"
+                            put_file(ser, args[0], remote)
+                    elif cmd.startswith("record ") and len(cmd.split()) > 2:
+                        # record <local file or pipe> <remote> [MB]
+                        args = cmd.split()[1:]
+                        with open(args[0], "rb") as source:
+                            record_stream(ser, source, args[1], int(args[2]) if len(args) > 2 else None)
+                    elif cmd.lower() == "stats --json":
+                        print(json.dumps(read_device_stats(ser), indent=2))
                     else:
                         ser.write((cmd + "\n").encode())
     except KeyboardInterrupt: